@@ -0,0 +1,192 @@
+/*
+ * Key dispatch benchmark.
+ * Replays the same key presses through config::KeyMap and through the sibling-list tree it
+ * replaced, for the shipped keybinds.moon and for keymaps padded out with more chords.
+ * Run it from the repo root: `make bench`.
+ */
+#include "../src/keybinder.hpp"
+#include "../src/keymap.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using honeymoon::config::KeyBinder;
+using honeymoon::config::KeyMap;
+
+namespace {
+    // The dispatch KeyMap replaced: a child list per node, and the action's name looked up
+    // by string every time a binding fires.
+    class KeyTree {
+    public:
+        struct Node {
+            Key key = Key::None;
+            Node* next_sibling = nullptr;
+            Node* first_child = nullptr;
+            std::string action;
+        };
+
+        KeyTree(const std::vector<KeyBinder::Binding>& bindings, const std::vector<std::string>& names)
+            : names(names) {
+            for (const auto& b : bindings) {
+                Node* node = &root;
+                for (Key k : b.keys) {
+                    Node* child = find_child(node, k);
+                    if (!child) child = add_child(node, k);
+                    node = child;
+                }
+                node->action = b.action;
+            }
+            current = &root;
+        }
+        ~KeyTree() { free_children(&root); }
+        KeyTree(const KeyTree&) = delete;
+        KeyTree& operator=(const KeyTree&) = delete;
+
+        // What the key does: an action id, 0 for nothing yet or a miss.
+        uint16_t press(Key k) {
+            Node* next = find_child(current, k);
+            if (!next) { current = &root; return 0; }
+            current = next;
+            if (current->action.empty() || current->first_child) return 0;
+            uint16_t id = lookup_action(current->action);
+            current = &root;
+            return id;
+        }
+
+    private:
+        Node root;
+        Node* current;
+        const std::vector<std::string>& names;
+
+        static Node* find_child(Node* parent, Key k) {
+            for (Node* c = parent->first_child; c; c = c->next_sibling)
+                if (c->key == k) return c;
+            return nullptr;
+        }
+        static Node* add_child(Node* parent, Key k) {
+            Node* c = new Node;
+            c->key = k;
+            c->next_sibling = parent->first_child;
+            parent->first_child = c;
+            return c;
+        }
+        static void free_children(Node* n) {
+            for (Node* c = n->first_child; c;) {
+                Node* next = c->next_sibling;
+                free_children(c);
+                delete c;
+                c = next;
+            }
+        }
+        uint16_t lookup_action(const std::string& name) const {
+            for (size_t i = 0; i < names.size(); ++i)
+                if (std::strcmp(name.c_str(), names[i].c_str()) == 0) return (uint16_t)(i + 1);
+            return 0;
+        }
+    };
+
+    class Dispatch {
+    public:
+        explicit Dispatch(const KeyMap& map) : map(map) {}
+        uint16_t press(Key k) {
+            KeyMap::Step step = map.step(state, k);
+            if (step.kind == KeyMap::Step::Prefix) { state = step.value; return 0; }
+            state = KeyMap::ROOT;
+            return step.kind == KeyMap::Step::Action ? step.value : 0;
+        }
+
+    private:
+        const KeyMap& map;
+        uint16_t state = KeyMap::ROOT;
+    };
+
+    // Every name the bindings use, in order; a name's id is its index plus one.
+    std::vector<std::string> action_names(const std::vector<KeyBinder::Binding>& bindings) {
+        std::vector<std::string> names;
+        for (const auto& b : bindings) {
+            bool seen = false;
+            for (const auto& n : names) seen = seen || n == b.action;
+            if (!seen) names.push_back(b.action);
+        }
+        return names;
+    }
+
+    // `extra` more chords under C-c, two letters each, on top of the file's bindings.
+    std::vector<KeyBinder::Binding> padded(std::vector<KeyBinder::Binding> bindings, size_t extra, std::mt19937& rng) {
+        size_t base = bindings.size();
+        for (size_t i = 0; i < extra && base > 0; ++i) {
+            Key a = static_cast<Key>('a' + (i / 26) % 26), b = static_cast<Key>('a' + i % 26);
+            bindings.push_back({{Key::Ctrl_C, a, b}, bindings[rng() % base].action});
+        }
+        return bindings;
+    }
+
+    // Mostly typing, the rest bound sequences, chosen evenly across the bindings.
+    std::vector<Key> presses(const std::vector<KeyBinder::Binding>& bindings, size_t count, std::mt19937& rng) {
+        std::vector<Key> keys;
+        keys.reserve(count + 8);
+        while (keys.size() < count) {
+            if (rng() % 4 != 0 || bindings.empty()) {
+                keys.push_back(static_cast<Key>('a' + rng() % 26));
+                continue;
+            }
+            const auto& b = bindings[rng() % bindings.size()];
+            keys.insert(keys.end(), b.keys.begin(), b.keys.end());
+        }
+        return keys;
+    }
+
+    template <typename D>
+    double ns_per_key(D& dispatch, const std::vector<Key>& keys, uint64_t& sum) {
+        auto t = std::chrono::steady_clock::now();
+        for (Key k : keys) sum += dispatch.press(k);
+        auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t).count();
+        return ns / keys.size();
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "keybinds.moon";
+    auto file = KeyBinder::load_from_file(path);
+    if (file.empty()) {
+        fprintf(stderr, "no bindings in %s\n", path);
+        return 1;
+    }
+    auto names = action_names(file);
+    std::mt19937 rng(1);
+    constexpr size_t PRESSES = 4'000'000;
+    constexpr int ROUNDS = 5;
+
+    printf("%-10s %9s %12s %12s\n", "bindings", "presses", "tree ns/key", "table ns/key");
+    for (size_t extra : {size_t(0), size_t(100), size_t(400), size_t(676)}) {
+        auto bindings = padded(file, extra, rng);
+        KeyTree tree(bindings, names);
+        KeyMap map;
+        map.compile(bindings, [&](const std::string& name) -> uint16_t {
+            for (size_t i = 0; i < names.size(); ++i)
+                if (names[i] == name) return (uint16_t)(i + 1);
+            return 0;
+        });
+        Dispatch table(map);
+        auto keys = presses(bindings, PRESSES, rng);
+
+        // Best of a few rounds; both must fire the same actions.
+        uint64_t tree_sum = 0, table_sum = 0;
+        double tree_ns = 1e9, table_ns = 1e9;
+        for (int r = 0; r < ROUNDS; ++r) {
+            tree_ns = std::min(tree_ns, ns_per_key(tree, keys, tree_sum));
+            table_ns = std::min(table_ns, ns_per_key(table, keys, table_sum));
+        }
+        if (tree_sum != table_sum) {
+            fprintf(stderr, "dispatch disagrees with %zu bindings\n", bindings.size());
+            return 1;
+        }
+        printf("%-10zu %9zu %12.2f %12.2f\n", bindings.size(), keys.size(), tree_ns, table_ns);
+    }
+    return 0;
+}
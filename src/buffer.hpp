@@ -3,13 +3,19 @@
  * It's a std::vector with a hole in the middle. O(1) at the cursor, O(N) everywhere else.
  */
 #pragma once
+#include <array>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include "concepts.hpp"
+#include "edit.hpp"
+#include "lines.hpp"
+#include "save.hpp"
+#include "snapshot.hpp"
 
 namespace honeymoon::mem {
     template <typename CharT = char>
@@ -28,6 +34,8 @@ namespace honeymoon::mem {
         ~GapBuffer() = default;
 
         void load_from_file(const std::string& filename) {
+            stamp = {};
+            tracking = false;
             int fd = open(filename.c_str(), O_RDONLY);
             if (fd < 0) return;
             struct stat st;
@@ -39,40 +47,52 @@ namespace honeymoon::mem {
             if (n < 0 || (size_type)n != size) { buffer.resize(DEFAULT_GAP_SIZE); gap_start = 0; gap_end = DEFAULT_GAP_SIZE; return; }
             gap_start = size;
             gap_end = buffer.size();
+            lines.reset();
+            edit_log.reset();
+            extents.reset(size);
+            stamp = FileStamp::of(st);
+            tracking = true;
         }
 
+        // Both halves in one writev, to a sibling that's renamed over the file once it's on disk.
         void save_to_file(const std::string& filename) {
-            int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) return;
-            if (gap_start > 0) (void)write(fd, buffer.data(), gap_start);
-            if (gap_end < buffer.size()) (void)write(fd, buffer.data() + gap_end, buffer.size() - gap_end);
-            close(fd);
-            dirty = false;
+            std::string error;
+            if (write_file(filename, segments(), error)) dirty = false;
         }
 
         void insert_char(CharT c) {
             if (gap_start == gap_end) expand_gap();
+            log_insert(gap_start, &c, 1);
+            lines.on_insert(gap_start, &c, 1);
             buffer[gap_start++] = c;
             dirty = true;
         }
 
-        void insert_string(const std::string& s) { for (char c : s) insert_char(c); }
-        void insert_string(const char* s, size_t n) { for (size_t i = 0; i < n; ++i) insert_char(s[i]); }
+        void insert_string(const std::string& s) { insert_string(s.data(), s.size()); }
+        // One gap resize and one copy, however long the text.
+        void insert_string(const CharT* s, size_t n) {
+            if (n == 0) return;
+            if (gap_end - gap_start < n) expand_gap(n);
+            log_insert(gap_start, s, n);
+            lines.on_insert(gap_start, s, n);
+            std::copy(s, s + n, buffer.begin() + gap_start);
+            gap_start += n;
+            dirty = true;
+        }
 
         void delete_char() {
-            if (gap_start > 0) { gap_start--; dirty = true; }
+            if (gap_start > 0) { log_erase(gap_start - 1, gap_start); lines.on_erase(gap_start - 1, gap_start); gap_start--; dirty = true; }
         }
         
         void delete_forward() {
-            if (gap_end < buffer.size()) { gap_end++; dirty = true; }
+            if (gap_end < buffer.size()) { log_erase(gap_start, gap_start + 1); lines.on_erase(gap_start, gap_start + 1); gap_end++; dirty = true; }
         }
 
         void delete_range(size_type start, size_type end) {
             if (start > end) std::swap(start, end);
             if (end > size()) end = size();
             move_gap(start);
-            size_type count = end - start;
-            while (count > 0 && gap_end < buffer.size()) { gap_end++; count--; }
+            if (start < end) { log_erase(start, end); lines.on_erase(start, end); gap_end += end - start; }
             dirty = true;
         }
 
@@ -100,7 +120,11 @@ namespace honeymoon::mem {
             if (start > end) std::swap(start, end);
             if (end > size()) end = size();
             std::string res; res.reserve(end - start);
-            for (size_type i = start; i < end; ++i) res.push_back(get_char_at(i));
+            while (start < end) {
+                std::basic_string_view<CharT> run = chunk_at(start).substr(0, end - start);
+                res.append(run.data(), run.size());
+                start += run.size();
+            }
             return res;
         }
 
@@ -109,20 +133,104 @@ namespace honeymoon::mem {
             return buffer[gap_end + (index - gap_start)];
         }
 
+        // The two halves around the gap, in document order. Valid until the next edit.
+        std::array<std::basic_string_view<CharT>, 2> segments() const {
+            return {std::basic_string_view<CharT>(buffer.data(), gap_start),
+                    std::basic_string_view<CharT>(buffer.data() + gap_end, buffer.size() - gap_end)};
+        }
+
+        // Contiguous text from pos up to the gap or the end, whichever comes first.
+        std::basic_string_view<CharT> chunk_at(size_type pos) const {
+            if (pos < gap_start) return {buffer.data() + pos, gap_start - pos};
+            size_type phys = gap_end + std::min(pos - gap_start, buffer.size() - gap_end);
+            return {buffer.data() + phys, buffer.size() - phys};
+        }
+
+        // Contiguous text ending at pos, starting at the gap or the beginning.
+        std::basic_string_view<CharT> chunk_before(size_type pos) const {
+            if (pos <= gap_start) return {buffer.data(), pos};
+            return {buffer.data() + gap_end, pos - gap_start};
+        }
+
+        // Line queries are O(log lines); the index is built lazily as far as anyone has looked.
+        size_type line_start(size_type line) const { return lines.line_start(line, run_reader(), size()); }
+        size_type line_of(size_type offset) const { return lines.line_of(offset, run_reader(), size()); }
+        size_type line_count() const { return lines.line_count(run_reader(), size()); }
+
+        // Everything that changed since the last call, for whoever keeps derived state.
+        void take_edits(EditBatch& out) { edit_log.take(out); }
+
+        // The text moves whenever the gap does, so a snapshot is a copy.
+        TextSnapshot<CharT> snapshot() const {
+            std::basic_string<CharT> text;
+            text.reserve(size());
+            for (auto seg : segments()) text.append(seg);
+            return TextSnapshot<CharT>(std::move(text));
+        }
+
         size_type size() const { return buffer.size() - (gap_end - gap_start); }
         size_type get_cursor() const { return gap_start; }
         bool is_dirty() const { return dirty; }
         void set_dirty(bool d) { dirty = d; }
 
+        // Where the text may differ from the file as loaded or last saved. False if there's
+        // no such file to compare against, or it's lost track of which that is.
+        bool dirty_extents(std::vector<Extent>& out) const {
+            out.clear();
+            if (!tracking) return false;
+            extents.dirty(out);
+            return true;
+        }
+        const FileStamp& disk_stamp() const { return stamp; }
+        // The text lives in memory, so writing the file can't pull anything out from under it.
+        void pin_extents(const std::vector<Extent>&) {}
+        // The file, as s describes it, now holds exactly this text.
+        void mark_saved(const std::string&, const FileStamp& s) {
+            stamp = s;
+            extents.reset(size());
+            tracking = true;
+        }
+        // The file, as s describes it, holds the text as it was some edits ago; which bytes
+        // those changed isn't known until the next full save.
+        void mark_saved_earlier(const FileStamp& s) {
+            stamp = s;
+            tracking = false;
+        }
+
     private:
         std::vector<CharT> buffer;
         size_type gap_start;
         size_type gap_end;
         bool dirty = false;
+        mutable LineIndex<CharT> lines;
+        EditLog edit_log;
+        ExtentMap extents;
+        FileStamp stamp;
+        bool tracking = false; // extents says where the text differs from the file stamp describes
+
+        auto run_reader() const {
+            return [this](size_type pos) { return chunk_at(pos); };
+        }
+
+        TextPoint point_at(size_type pos) const {
+            size_type row = line_of(pos);
+            return {(uint32_t)row, (uint32_t)(pos - line_start(row))};
+        }
+
+        // Both run before the line index and the text change.
+        void log_insert(size_type pos, const CharT* s, size_type n) {
+            TextPoint at = point_at(pos);
+            edit_log.inserted(pos, at, EditLog::advance(at, s, n), n);
+            extents.insert(pos, n);
+        }
+        void log_erase(size_type start, size_type end) {
+            edit_log.erased(start, end, point_at(start), point_at(end));
+            extents.erase(start, end);
+        }
 
-        void expand_gap() {
+        void expand_gap(size_type need = 1) {
             size_type old_size = buffer.size();
-            size_type chunk_size = std::max(DEFAULT_GAP_SIZE, old_size / 2);
+            size_type chunk_size = std::max({DEFAULT_GAP_SIZE, old_size / 2, need});
             buffer.resize(old_size + chunk_size);
             size_type post_gap = old_size - gap_end;
             std::copy_backward(buffer.begin() + gap_end, buffer.begin() + old_size, buffer.end());
@@ -2,8 +2,13 @@
 #pragma once
 #include <concepts>
 #include <string>
+#include <string_view>
 #include <cstddef>
+#include <vector>
+#include "edit.hpp"
 #include "input.hpp"
+#include "save.hpp"
+#include "snapshot.hpp"
 
 namespace honeymoon::kernel {
 
@@ -11,7 +16,7 @@ namespace honeymoon::kernel {
     concept CharType = std::same_as<T, char> || std::same_as<T, wchar_t>;
 
     template<typename B>
-    concept EditableBuffer = requires(B b, const std::string& filename, size_t pos, size_t start, size_t end, const std::string& s) {
+    concept EditableBuffer = requires(B b, const std::string& filename, size_t pos, size_t start, size_t end, const std::string& s, honeymoon::mem::EditBatch& edits, std::vector<honeymoon::mem::Extent>& extents, const honeymoon::mem::FileStamp& stamp) {
         { b.load_from_file(filename) } -> std::same_as<void>;
         { b.save_to_file(filename) } -> std::same_as<void>;
         { b.insert_char('c') } -> std::same_as<void>;
@@ -26,12 +31,27 @@ namespace honeymoon::kernel {
         { b.insert_string(s) } -> std::same_as<void>;
         { b.get_range(start, end) } -> std::convertible_to<std::string>;
         { b.delete_range(start, end) } -> std::same_as<void>;
+        { b.line_start(pos) } -> std::convertible_to<size_t>;
+        { b.line_of(pos) } -> std::convertible_to<size_t>;
+        { b.line_count() } -> std::convertible_to<size_t>;
+        { b.chunk_at(pos) } -> std::convertible_to<std::string_view>;
+        { b.chunk_before(pos) } -> std::convertible_to<std::string_view>;
+        { b.take_edits(edits) } -> std::same_as<void>;
+        { b.snapshot() } -> std::same_as<honeymoon::mem::TextSnapshot<typename B::value_type>>;
+        { b.dirty_extents(extents) } -> std::same_as<bool>;
+        { b.pin_extents(extents) } -> std::same_as<void>;
+        { b.mark_saved(filename, stamp) } -> std::same_as<void>;
+        { b.mark_saved_earlier(stamp) } -> std::same_as<void>;
+        { b.disk_stamp() } -> std::convertible_to<honeymoon::mem::FileStamp>;
     };
 
     template<typename T>
     concept TerminalDevice = requires(T t, std::string_view data) {
         { t.get_window_size() } -> std::same_as<std::pair<int, int>>;
         { t.read_key() } -> std::same_as<Key>;
+        { t.input_fd() } -> std::convertible_to<int>;
+        { t.input_timeout() } -> std::convertible_to<int>;
+        { t.take_paste() } -> std::same_as<std::string>;
         { t.write_raw(data) } -> std::same_as<void>;
     };
 }
@@ -14,6 +14,7 @@ struct Config {
   int tab_width = 4;
   int scroll_offset = 0;
   int font_size = 12;
+  int undo_limit_mb = 64;
 
   static bool file_exists(const std::string& path) {
     int fd = open(path.c_str(), O_RDONLY);
@@ -79,6 +80,8 @@ struct Config {
         show_line_numbers = (strcmp(val, "true") == 0);
       else if (strcmp(key, "syntax_highlighting") == 0)
         syntax_highlighting = (strcmp(val, "true") == 0);
+      else if (strcmp(key, "undo_limit_mb") == 0)
+        undo_limit_mb = atoi(val) > 0 ? atoi(val) : undo_limit_mb;
     }
     return true;
   }
@@ -97,9 +100,10 @@ struct Config {
       "# Honeymoon Configuration\n"
       "tab_width %d\n"
       "show_line_numbers %s\n"
-      "syntax_highlighting %s\n",
+      "syntax_highlighting %s\n"
+      "undo_limit_mb %d\n",
       tab_width, show_line_numbers ? "true" : "false",
-      syntax_highlighting ? "true" : "false");
+      syntax_highlighting ? "true" : "false", undo_limit_mb);
     if (len > 0) (void)write(fd, buf, len);
     close(fd);
     return true;
@@ -0,0 +1,98 @@
+/*
+ * Edit Records.
+ * What changed, where, in bytes and in rows/columns, so whoever keeps derived state
+ * (a syntax tree, say) can patch it instead of starting over.
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace honeymoon::mem {
+
+    // Same layout as tree-sitter's TSPoint; column counts bytes.
+    struct TextPoint {
+        uint32_t row = 0;
+        uint32_t column = 0;
+    };
+
+    // [start, old_end) was replaced by [start, new_end).
+    struct EditRecord {
+        size_t start = 0;
+        size_t old_end = 0;
+        size_t new_end = 0;
+        TextPoint start_point;
+        TextPoint old_end_point;
+        TextPoint new_end_point;
+    };
+
+    // Edits since the last take(). `reset` means the whole text was replaced (a load),
+    // and the records before it no longer mean anything.
+    struct EditBatch {
+        std::vector<EditRecord> edits;
+        bool reset = false;
+
+        void clear() {
+            edits.clear();
+            reset = false;
+        }
+    };
+
+    class EditLog {
+    public:
+        // A new buffer counts as a reset: whatever was derived from the previous one is stale.
+        EditLog() { pending.reset = true; }
+
+        template <typename CharT>
+        static TextPoint advance(TextPoint p, const CharT* s, size_t n) {
+            std::basic_string_view<CharT> text(s, n);
+            size_t last = text.npos;
+            for (size_t i = text.find(CharT('\n')); i != text.npos; i = text.find(CharT('\n'), i + 1)) {
+                p.row++;
+                last = i;
+            }
+            p.column = last == text.npos ? p.column + n : n - last - 1;
+            return p;
+        }
+
+        void inserted(size_t pos, TextPoint at, TextPoint end, size_t n) {
+            if (!pending.edits.empty()) {
+                EditRecord& last = pending.edits.back();
+                if (last.new_end == pos) { // typing run
+                    last.new_end += n;
+                    last.new_end_point = end;
+                    return;
+                }
+            }
+            pending.edits.push_back({pos, pos, pos + n, at, at, end});
+        }
+
+        void erased(size_t start, size_t end, TextPoint from, TextPoint to) {
+            if (!pending.edits.empty()) {
+                EditRecord& last = pending.edits.back();
+                if (last.start == last.new_end && last.start == end) { // backspace run
+                    last.start = last.new_end = start;
+                    last.start_point = last.new_end_point = from;
+                    return;
+                }
+            }
+            pending.edits.push_back({start, end, start, from, to, from});
+        }
+
+        void reset() {
+            pending.edits.clear();
+            pending.reset = true;
+        }
+
+        // Hands the pending edits over; `out` is reused so steady state doesn't allocate.
+        void take(EditBatch& out) {
+            out.clear();
+            std::swap(out, pending);
+        }
+
+    private:
+        EditBatch pending;
+    };
+
+} // namespace honeymoon::mem
@@ -1,20 +1,36 @@
 #include "concepts.hpp"
 #include "config.hpp"
+#include "eventloop.hpp"
+#include "fileindex.hpp"
+#include "fuzzy.hpp"
+#include "grep.hpp"
 #include "undo.hpp"
 #include "history.hpp"
 #include "input.hpp"
+#include "iterator.hpp"
+#include "journal.hpp"
 #include "keybinder.hpp"
+#include "keymap.hpp"
+#include "lexer.hpp"
 #include "logo.hpp"
+#include "screen.hpp"
+#include "regex.hpp"
+#include "replace.hpp"
+#include "save.hpp"
+#include "search.hpp"
 #include "treesitter.hpp"
 #include <algorithm>
 #include <cctype>
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <concepts>
+#include <memory>
 #include <string>
 #include <variant>
 #include <vector>
+#include <poll.h>
 
 namespace honeymoon::kernel {
 
@@ -24,13 +40,51 @@ struct HomeState {
 struct EditorState {
   std::string filename;
 };
+// Narrows the file index as the query is typed. Enter opens the selected path, or the
+// query itself when nothing matches.
 struct FileSearchState {
   std::string query;
+  std::shared_ptr<const honeymoon::search::PathList> paths = {}; // null until indexed
+  std::vector<honeymoon::search::FuzzyHit> hits = {};
+  size_t matched = 0;
+  size_t selection = 0;
+  size_t scroll = 0;
+  double ms = 0; // the last match
+};
+// Hits stream in while the search runs. Enter on a new query searches; on the one
+// already searched, it visits the selected hit.
+struct ProjectGrepState {
+  std::string query;
+  bool regex = false;
+  std::string searched = {};
+  std::string error = {}; // why the last query didn't start
+  std::vector<honeymoon::search::GrepHit> hits = {};
+  honeymoon::search::GrepStats stats = {};
+  size_t selection = 0;
+  size_t scroll = 0;
 };
 struct TextSearchState {
   std::string query;
   size_t start_idx;
   bool forward;
+  std::vector<honeymoon::search::Step> steps = {}; // backspace pops one
+  bool regex = false;
+};
+// Prompts for the pattern, then the replacement, then (for query_replace) asks about
+// each match. Nothing is edited until the answers are in.
+struct ReplaceState {
+  enum Phase : uint8_t { PATTERN, REPLACEMENT, ANSWER };
+  std::string query; // the prompt being typed
+  size_t start_idx;
+  size_t from, to; // the region searched: the selection, or point to the end
+  bool regex = false;
+  bool ask = true;
+  Phase phase = PATTERN;
+  std::string pattern = {};
+  std::string replacement = {};
+  std::vector<honeymoon::search::Match> matches = {};
+  size_t next = 0; // the match being asked about
+  std::vector<honeymoon::search::Match> accepted = {};
 };
 struct GotoLineState {
   std::string query;
@@ -43,11 +97,15 @@ struct SettingsState {
 };
 struct HelpState {};
 struct AboutState {};
+// A journal of edits never saved turned up on open; asks whether to replay it.
+struct RecoverState {
+  honeymoon::mem::JournalFile journal;
+};
 
 using EditorMode =
-    std::variant<HomeState, EditorState, FileSearchState, TextSearchState,
-                 GotoLineState, RecentFilesState, SettingsState, HelpState,
-                 AboutState>;
+    std::variant<HomeState, EditorState, FileSearchState, ProjectGrepState,
+                 TextSearchState, ReplaceState, GotoLineState, RecentFilesState,
+                 SettingsState, HelpState, AboutState, RecoverState>;
 
 template <typename BufferPolicy, typename TerminalPolicy>
   requires EditableBuffer<BufferPolicy> && TerminalDevice<TerminalPolicy>
@@ -58,6 +116,7 @@ public:
     update_window_size();
     bind_default_keys();
     load();
+    max_undo_bytes = (size_t)undo_limit_mb << 20;
     std::string logo_str(honeymoon::STARTUP_LOGO);
     size_t lpos = 0;
     while (lpos < logo_str.size()) {
@@ -77,40 +136,116 @@ public:
   }
 
   void open(const std::string &filename) {
+    journal.close();
     current_filename = filename;
     buffer.load_from_file(filename);
+    clear_undo();
     status_message = "Opened " + filename;
     mode = EditorState{filename};
+    honeymoon::mem::JournalFile found;
+    std::string jpath = honeymoon::mem::journal_path(filename);
+    if (honeymoon::mem::read_journal(jpath, found) && !found.records.empty()) {
+      if (found.base == buffer.disk_stamp()) {
+        size_t n = found.records.size();
+        status_message = filename + " has " + std::to_string(n) + (n == 1 ? " unsaved edit" : " unsaved edits") +
+                         " in " + jpath + ". Recover? (y/n)";
+        mode = RecoverState{std::move(found)};
+      } else {
+        journal.start(filename, buffer.disk_stamp());
+        status_message = "Opened " + filename + "; dropped " + jpath + ", the file changed after it was written";
+      }
+    } else {
+      journal.start(filename, buffer.disk_stamp());
+    }
     syntax_engine.set_language_for_file(filename);
     honeymoon::util::add_to_history(recent_files, filename);
     honeymoon::util::save_history(".honeymoon_history", recent_files);
   }
 
+  // Draw, then sleep until a key, a resize, a finished parse or some other event shows up.
+  // A lone ESC keeps the wait short so it can still be delivered as a key.
   void run() {
+    events.watch(terminal.input_fd(), EV_INPUT);
+    if (syntax_engine.wake_fd() >= 0)
+      events.watch(syntax_engine.wake_fd(), EV_SYNTAX);
+    if (grep.wake_fd() >= 0)
+      events.watch(grep.wake_fd(), EV_GREP);
+    if (file_index.wake_fd() >= 0)
+      events.watch(file_index.wake_fd(), EV_INDEX);
+    if (saver.wake_fd() >= 0)
+      events.watch(saver.wake_fd(), EV_SAVE);
+    uint64_t ready[16];
     while (!should_quit) {
       refresh_screen();
-      process_keypress();
+      // Counting search matches is idle work: poll, and do a slice whenever nothing's pending.
+      size_t n = events.wait(match_counter.busy() ? 0 : terminal.input_timeout(), ready, 16);
+      if (n == 0) {
+        process_input();
+        count_matches();
+      }
+      for (size_t i = 0; i < n && !should_quit; ++i) {
+        if (ready[i] == EV_INPUT)
+          process_input();
+        else if (ready[i] == EV_SYNTAX)
+          syntax_engine.take_result();
+        else if (ready[i] == EV_GREP)
+          take_grep_hits();
+        else if (ready[i] == EV_INDEX)
+          take_file_index();
+        else if (ready[i] == EV_SAVE)
+          take_save_progress();
+        else if (ready[i] == honeymoon::driver::EventLoop::RESIZE)
+          update_window_size();
+      }
+    }
+    // A save still being written decides whether the journal is still needed.
+    while (saver.busy()) {
+      pollfd p{saver.wake_fd(), POLLIN, 0};
+      poll(&p, 1, 100);
     }
+    if (last_save)
+      take_save_progress();
     terminal.write_raw("\x1b[2J\x1b[H");
   }
 
 private:
+  using TextIt = honeymoon::mem::TextIterator<BufferPolicy>;
+
+  enum EventToken : uint64_t { EV_INPUT, EV_SYNTAX, EV_GREP, EV_INDEX, EV_SAVE };
+
+  honeymoon::driver::EventLoop events;
   TerminalPolicy terminal;
   BufferPolicy buffer;
   bool should_quit = false;
   std::string current_filename = "[No Name]";
   std::string status_message =
       "Honeymoon | C-x C-c: Quit | C-x C-s: Save | C-SP: Mark";
+  // Frame bytes. Grows geometrically and keeps its capacity, so steady-state frames don't allocate.
   struct RenderBuf {
-    char data[4096];
+    char* data = nullptr;
     size_t len = 0;
+    size_t cap = 0;
+    RenderBuf() = default;
+    RenderBuf(const RenderBuf&) = delete;
+    RenderBuf& operator=(const RenderBuf&) = delete;
+    ~RenderBuf() { free(data); }
     void clear() { len = 0; }
-    RenderBuf& append(const char* s) { while (*s && len < sizeof(data)) data[len++] = *s++; return *this; }
-    RenderBuf& append(char c) { if (len < sizeof(data)) data[len++] = c; return *this; }
-    RenderBuf& append(int n, char c) { if (n <= 0) return *this; size_t avail = sizeof(data) - len; size_t m = (size_t)n < avail ? (size_t)n : avail; for (size_t i = 0; i < m; i++) data[len++] = c; return *this; }
-    RenderBuf& append(const char* s, size_t n) { size_t m = n < sizeof(data) - len ? n : sizeof(data) - len; memcpy(data + len, s, m); len += m; return *this; }
-    RenderBuf& append(const std::string& s) { append(s.data(), s.size()); return *this; }
+    size_t reserve(size_t n) {
+      if (len + n > cap) {
+        size_t want = std::max({cap * 2, len + n, (size_t)4096});
+        if (char* p = (char*)realloc(data, want)) { data = p; cap = want; }
+      }
+      return std::min(n, cap - len);
+    }
+    RenderBuf& append(const char* s, size_t n) { n = reserve(n); memcpy(data + len, s, n); len += n; return *this; }
+    RenderBuf& append(const char* s) { return append(s, strlen(s)); }
+    RenderBuf& append(char c) { return append(&c, 1); }
+    RenderBuf& append(int n, char c) { if (n <= 0) return *this; size_t m = reserve(n); memset(data + len, c, m); len += m; return *this; }
+    RenderBuf& append(const std::string& s) { return append(s.data(), s.size()); }
   } output_buffer;
+  honeymoon::driver::Screen screen;
+  static constexpr const char* STYLE_REVERSE = "\x1b[7m";
+  static constexpr const char* STYLE_GUTTER = "\x1b[36m";
   char* clipboard = nullptr;
   size_t clipboard_len = 0;
   size_t scroll_row = 0, scroll_col = 0;
@@ -120,6 +255,20 @@ private:
   EditorMode mode;
   std::vector<std::string> recent_files;
   honeymoon::syntax::TreeSitterHighlighter syntax_engine;
+  honeymoon::syntax::Lexer lexer;
+  honeymoon::search::MatchCounter match_counter;
+  honeymoon::search::Regex search_regex;
+  honeymoon::search::ProjectGrep grep;
+  honeymoon::util::FileIndex file_index; // started the first time the finder opens
+  honeymoon::search::FuzzyMatcher finder;
+  honeymoon::mem::FileSaver saver; // finishes what's queued before the editor goes
+  std::string save_note;           // on the status bar: how the last save is going
+  std::string rewrite_reason;      // why the save being written wasn't done in place
+  uint64_t last_save = 0;          // the newest save handed to the writer, until it's settled
+  uint64_t last_save_mark = 0;     // how far the journal had got when it was taken
+  honeymoon::mem::Journal journal; // the current file's edits since it was last saved
+  static constexpr size_t COUNT_SLICE = 32 << 20;
+  honeymoon::mem::EditBatch pending_edits;
 
   enum ActionId : uint8_t {
     ACT_NONE = 0,
@@ -131,6 +280,9 @@ private:
     ACT_UNDO, ACT_REDO, ACT_COPY, ACT_MOVE_WORD_BACKWARD, ACT_MOVE_WORD_FORWARD,
     ACT_KILL_WORD, ACT_TRANSPOSE_WORDS, ACT_GOTO_LINE, ACT_FIND_FILE,
     ACT_LIST_BUFFERS, ACT_KILL_BUFFER, ACT_SELECT_ALL, ACT_HELP_KEY, ACT_HELP_FUNC,
+    ACT_SEARCH_FORWARD_REGEXP, ACT_SEARCH_BACKWARD_REGEXP,
+    ACT_QUERY_REPLACE, ACT_QUERY_REPLACE_REGEXP, ACT_REPLACE_ALL, ACT_REPLACE_ALL_REGEXP,
+    ACT_PROJECT_GREP, ACT_PROJECT_GREP_REGEXP,
   };
 
   struct ActionEntry { const char* name; ActionId id; };
@@ -153,6 +305,10 @@ private:
     {"find_file", ACT_FIND_FILE}, {"list_buffers", ACT_LIST_BUFFERS},
     {"kill_buffer", ACT_KILL_BUFFER}, {"select_all", ACT_SELECT_ALL},
     {"help_key", ACT_HELP_KEY}, {"help_func", ACT_HELP_FUNC},
+    {"search_forward_regexp", ACT_SEARCH_FORWARD_REGEXP}, {"search_backward_regexp", ACT_SEARCH_BACKWARD_REGEXP},
+    {"query_replace", ACT_QUERY_REPLACE}, {"query_replace_regexp", ACT_QUERY_REPLACE_REGEXP},
+    {"replace_all", ACT_REPLACE_ALL}, {"replace_all_regexp", ACT_REPLACE_ALL_REGEXP},
+    {"project_grep", ACT_PROJECT_GREP}, {"project_grep_regexp", ACT_PROJECT_GREP_REGEXP},
   };
 
   static ActionId lookup_action(const std::string& name) {
@@ -176,28 +332,62 @@ private:
     if (clipboard) { memcpy(clipboard, s, n); clipboard[n] = '\0'; }
   }
 
+  // Every edit goes through these two so the undo log and the journal see it.
+  void insert_text(const char* s, size_t n) {
+    record_insert(buffer.get_cursor(), s, n);
+    journal.inserted(buffer.get_cursor(), s, n);
+    buffer.insert_string(s, n);
+  }
+  void insert_text(const std::string& s) { insert_text(s.data(), s.size()); }
+  void insert_text(char c) { insert_text(&c, 1); }
+
+  // Leaves the cursor at start, like BufferPolicy::delete_range.
+  void erase_text(size_t start, size_t end) {
+    if (start > end) std::swap(start, end);
+    end = std::min(end, buffer.size());
+    if (start < end) record_erase(start, buffer.get_range(start, end));
+    journal.erased(start, end - start);
+    buffer.delete_range(start, end);
+  }
+
+  void replay_group(const Group& g, bool undo) {
+    size_t n = g.edits.size();
+    for (size_t i = 0; i < n; ++i) {
+      const Edit& e = g.edits[undo ? n - 1 - i : i];
+      if (e.inserted == undo) {
+        journal.erased(e.pos, e.text.size());
+        buffer.delete_range(e.pos, e.pos + e.text.size());
+      } else {
+        journal.inserted(e.pos, e.text.data(), e.text.size());
+        buffer.move_gap(e.pos);
+        buffer.insert_string(e.text.data(), e.text.size());
+      }
+    }
+    buffer.move_gap(undo ? g.cursor_before : g.cursor_after);
+  }
+
   void execute_action(ActionId id) {
     switch (id) {
       case ACT_QUIT: should_quit = true; break;
-      case ACT_SAVE_FILE: buffer.save_to_file(current_filename); status_message = "Saved"; break;
+      case ACT_SAVE_FILE: save_file(); break;
       case ACT_MARK_SET: selection_anchor = buffer.get_cursor(); status_message = "Mark Set"; break;
       case ACT_CANCEL: {
         if (std::holds_alternative<GotoLineState>(mode)) {
           mode = EditorState{current_filename}; status_message = "Cancelled";
         } else {
-          selection_anchor = std::string::npos; current_node = root_node; pending_key_count = 0; status_message = "Quit";
+          selection_anchor = std::string::npos; key_state = honeymoon::config::KeyMap::ROOT; pending_key_count = 0; status_message = "Quit";
         } break;
       }
       case ACT_CUT: {
         if (selection_anchor != std::string::npos) {
-          snapshot_for_undo(buffer.get_content(), buffer.get_cursor());
+          begin_undo_group(buffer.get_cursor());
           size_t c = buffer.get_cursor(); set_clipboard(buffer.get_range(selection_anchor, c));
-          buffer.delete_range(selection_anchor, c); selection_anchor = std::string::npos; status_message = "Cut";
+          erase_text(selection_anchor, c); selection_anchor = std::string::npos; status_message = "Cut";
         } else status_message = "No selection";
         break;
       }
       case ACT_YANK: {
-        if (clipboard && clipboard_len) { snapshot_for_undo(buffer.get_content(), buffer.get_cursor()); buffer.insert_string(clipboard, clipboard_len); status_message = "Yank"; }
+        if (clipboard && clipboard_len) { begin_undo_group(buffer.get_cursor()); insert_text(clipboard, clipboard_len); status_message = "Yank"; }
         else { status_message = "Empty"; }
         break;
       }
@@ -206,28 +396,40 @@ private:
       case ACT_KILL_LINE: kill_to_eol(); break;
       case ACT_RECENTER: recenter_view(); break;
       case ACT_TRANSPOSE_CHARS: transpose_chars(); break;
-      case ACT_NEWLINE: snapshot_for_undo(buffer.get_content(), buffer.get_cursor()); buffer.insert_char('\n'); break;
+      case ACT_NEWLINE: begin_undo_group(buffer.get_cursor()); insert_text('\n'); break;
       case ACT_SEARCH_FORWARD: mode = TextSearchState{.query = "", .start_idx = buffer.get_cursor(), .forward = true}; status_message = "I-Search: "; break;
       case ACT_SEARCH_BACKWARD: mode = TextSearchState{.query = "", .start_idx = buffer.get_cursor(), .forward = false}; status_message = "I-Search Back: "; break;
+      case ACT_SEARCH_FORWARD_REGEXP: mode = TextSearchState{.query = "", .start_idx = buffer.get_cursor(), .forward = true, .regex = true}; status_message = "Regexp I-Search: "; break;
+      case ACT_SEARCH_BACKWARD_REGEXP: mode = TextSearchState{.query = "", .start_idx = buffer.get_cursor(), .forward = false, .regex = true}; status_message = "Regexp I-Search Back: "; break;
+      case ACT_QUERY_REPLACE: start_replace(true, false); break;
+      case ACT_QUERY_REPLACE_REGEXP: start_replace(true, true); break;
+      case ACT_REPLACE_ALL: start_replace(false, false); break;
+      case ACT_REPLACE_ALL_REGEXP: start_replace(false, true); break;
       case ACT_INDENT: perform_indent(true); break;
       case ACT_DEDENT: perform_indent(false); break;
-      case ACT_DELETE_BACKWARD: snapshot_for_undo(buffer.get_content(), buffer.get_cursor()); buffer.delete_char(); break;
-      case ACT_DELETE_FORWARD: snapshot_for_undo(buffer.get_content(), buffer.get_cursor()); buffer.delete_forward(); break;
+      case ACT_DELETE_BACKWARD: {
+        begin_undo_group(buffer.get_cursor());
+        size_t c = buffer.get_cursor();
+        if (c > 0) erase_text(c - 1, c);
+        break;
+      }
+      case ACT_DELETE_FORWARD: {
+        begin_undo_group(buffer.get_cursor());
+        size_t c = buffer.get_cursor();
+        erase_text(c, c + 1);
+        break;
+      }
       case ACT_MOVE_UP: move_cursor_2d(-1, 0); break;
       case ACT_MOVE_DOWN: move_cursor_2d(1, 0); break;
       case ACT_MOVE_LEFT: move_cursor_lin(-1); break;
       case ACT_MOVE_RIGHT: move_cursor_lin(1); break;
       case ACT_UNDO: {
-        std::string cur = buffer.get_content(); size_t cur_cursor = buffer.get_cursor();
-        auto result = apply_undo(cur, cur_cursor);
-        if (result) { buffer.delete_range(0, buffer.size()); buffer.move_gap(0); buffer.insert_string(result->content); buffer.move_gap(result->cursor); status_message = "Undo"; }
+        if (auto *g = apply_undo(buffer.get_cursor())) { replay_group(*g, true); status_message = "Undo"; }
         else { status_message = "Nothing to undo"; }
         break;
       }
       case ACT_REDO: {
-        std::string cur = buffer.get_content(); size_t cur_cursor = buffer.get_cursor();
-        auto result = apply_redo(cur, cur_cursor);
-        if (result) { buffer.delete_range(0, buffer.size()); buffer.move_gap(0); buffer.insert_string(result->content); buffer.move_gap(result->cursor); status_message = "Redo"; }
+        if (auto *g = apply_redo()) { replay_group(*g, false); status_message = "Redo"; }
         else { status_message = "Nothing to redo"; }
         break;
       }
@@ -241,9 +443,11 @@ private:
       case ACT_KILL_WORD: kill_word(); break;
       case ACT_TRANSPOSE_WORDS: transpose_words(); break;
       case ACT_GOTO_LINE: mode = GotoLineState{.query = ""}; status_message = "Go to line: "; break;
-      case ACT_FIND_FILE: mode = FileSearchState{.query = ""}; status_message = "Find File: "; break;
+      case ACT_FIND_FILE: start_find_file(); break;
+      case ACT_PROJECT_GREP: mode = ProjectGrepState{.query = ""}; update_grep_status(std::get<ProjectGrepState>(mode)); break;
+      case ACT_PROJECT_GREP_REGEXP: mode = ProjectGrepState{.query = "", .regex = true}; update_grep_status(std::get<ProjectGrepState>(mode)); break;
       case ACT_LIST_BUFFERS: mode = RecentFilesState{.selection = 0}; break;
-      case ACT_KILL_BUFFER: current_filename = "[No Name]"; buffer = BufferPolicy(); mode = HomeState{}; status_message = "Buffer Closed"; break;
+      case ACT_KILL_BUFFER: journal.discard(); current_filename = "[No Name]"; buffer = BufferPolicy(); clear_undo(); mode = HomeState{}; status_message = "Buffer Closed"; break;
       case ACT_SELECT_ALL: selection_anchor = 0; buffer.move_gap(buffer.size()); status_message = "Select All"; break;
       case ACT_HELP_KEY: mode = HelpState{}; status_message = "Help: Describe Key"; break;
       case ACT_HELP_FUNC: mode = HelpState{}; status_message = "Help: Describe Function"; break;
@@ -251,75 +455,32 @@ private:
     }
   }
 
-  struct KeyNode {
-    Key key;
-    KeyNode* next_sibling = nullptr;
-    KeyNode* first_child = nullptr;
-    std::string action;
-  };
-
-  KeyNode* root_node = nullptr;
-  KeyNode* current_node = nullptr;
+  honeymoon::config::KeyMap keymap;
+  uint16_t key_state = honeymoon::config::KeyMap::ROOT;
   Key pending_keys[16];
   int pending_key_count = 0;
 
 public:
-  ~Editor() { delete_key_tree(root_node); free(clipboard); }
+  ~Editor() { free(clipboard); }
 private:
 
-  void delete_key_tree(KeyNode* n) {
-    if (!n) return;
-    delete_key_tree(n->first_child);
-    delete_key_tree(n->next_sibling);
-    delete n;
-  }
-
-  KeyNode* find_child(KeyNode* parent, Key k) {
-    for (KeyNode* c = parent->first_child; c; c = c->next_sibling) {
-      if (c->key == k) return c;
-    }
-    return nullptr;
-  }
-
-  KeyNode* add_child(KeyNode* parent, Key k) {
-    KeyNode* c = new KeyNode;
-    c->key = k;
-    c->next_sibling = parent->first_child;
-    parent->first_child = c;
-    return c;
-  }
-
+  // Action names are resolved here, once; dispatch only ever sees ActionIds.
   void bind_default_keys() {
-    root_node = new KeyNode;
-    current_node = root_node;
-    load_custom_binds();
-  }
-
-  void add_binding(const std::vector<Key> &keys, const std::string &action) {
-    if (keys.empty()) return;
-    KeyNode* node = root_node;
-    for (const auto &k : keys) {
-      KeyNode* child = find_child(node, k);
-      if (!child) child = add_child(node, k);
-      node = child;
-    }
-    node->action = action;
+    keymap.compile(honeymoon::config::KeyBinder::load_from_file("keybinds.moon"),
+                   [](const std::string &name) -> uint16_t { return lookup_action(name); });
+    key_state = honeymoon::config::KeyMap::ROOT;
   }
 
-  void load_custom_binds() {
-    auto binds = honeymoon::config::KeyBinder::load_from_file("keybinds.moon");
-    for (auto &b : binds) {
-      add_binding(b.keys, b.action);
-    }
-  }
-
-
   static constexpr const char* home_menu[] = {
       "File Searcher", "Recent Files", "Settings", "Help", "About", "Quit"};
   static constexpr int home_menu_n = 6;
   static constexpr const char* settings_menu[] = {
       "Line Numbers", "Syntax Highlighting", "Tab Width", "Back"};
   static constexpr int settings_menu_n = 4;
+  static constexpr size_t MAX_FILE_HITS = 200; // more than any screen shows
+  // Patching in place isn't atomic, so it's kept for big files with little changed.
+  static constexpr size_t IN_PLACE_MIN_SIZE = 16 << 20;
+  static constexpr size_t IN_PLACE_MAX_SHARE = 8; // at most 1/8 of the file changed
 
   void update_window_size() {
     auto [rows, cols] = terminal.get_window_size();
@@ -327,31 +488,44 @@ private:
     window_cols = cols;
     if (window_rows > 2)
       window_rows -= 2;
+    screen.resize(rows, cols);
   }
 
+  // Every mode draws into the screen grid; only the cells that changed since
+  // the last frame are sent to the terminal.
   void refresh_screen() {
-    update_window_size();
-    output_buffer.clear();
+    screen.begin_frame();
 
     auto render_visitor = [this](auto &state) {
       using T = std::decay_t<decltype(state)>;
       if constexpr (std::is_same_v<T, EditorState> ||
                     std::is_same_v<T, TextSearchState> ||
-                    std::is_same_v<T, GotoLineState>) {
-        output_buffer.append("\x1b[?25l\x1b[H");
+                    std::is_same_v<T, ReplaceState> ||
+                    std::is_same_v<T, GotoLineState> ||
+                    std::is_same_v<T, RecoverState>) {
         draw_rows();
         draw_status_bar();
         draw_message_bar();
         place_cursor();
+      } else if constexpr (std::is_same_v<T, ProjectGrepState>) {
+        draw_grep_hits(state);
+        draw_grep_status_bar(state);
+        draw_message_bar();
+        screen.set_cursor(window_rows + 1, std::min(get_display_width(status_message), window_cols - 1));
+      } else if constexpr (std::is_same_v<T, FileSearchState>) {
+        draw_file_hits(state);
+        draw_file_status_bar(state);
+        draw_message_bar();
+        screen.set_cursor(window_rows + 1, std::min(get_display_width(status_message), window_cols - 1));
       } else {
-        output_buffer.append("\x1b[?25l\x1b[2J\x1b[H");
         draw_centered_view();
       }
     };
 
     std::visit(render_visitor, mode);
-    output_buffer.append("\x1b[?25h");
-    terminal.write_raw(output_buffer.data, output_buffer.len);
+    output_buffer.clear();
+    if (screen.flush(output_buffer))
+      terminal.write_raw(output_buffer.data, output_buffer.len);
   }
 
   int get_display_width(const std::string &s) {
@@ -379,8 +553,7 @@ private:
       int y = start_y + i;
       if (y >= window_rows)
         break;
-      output_buffer.append("\x1b[" + std::to_string(y + 1) + ";1H");
-      output_buffer.append(std::string(pad, ' ')).append(logo_lines[i]);
+      screen.put(y, pad, logo_lines[i]);
     }
   }
 
@@ -399,13 +572,9 @@ private:
   }
 
   void draw_state_ui(HomeState &state, int y, int) {
-    for (int i = 0; i < home_menu_n; ++i) {
-      if (i == state.selection)
-        output_buffer.append("\x1b[7m");
-      draw_centered_text(y + i, home_menu[i]);
-      if (i == state.selection)
-        output_buffer.append("\x1b[m");
-    }
+    for (int i = 0; i < home_menu_n; ++i)
+      draw_centered_text(y + i, home_menu[i],
+                         i == state.selection ? STYLE_REVERSE : nullptr);
   }
 
   void draw_state_ui(AboutState &, int y, int) {
@@ -434,11 +603,8 @@ private:
       else if (label == "Tab Width")
         val = " [" + std::to_string(tab_width) + "] ";
 
-      if (i == state.selection)
-        output_buffer.append("\x1b[7m");
-      draw_centered_text(y + i, label + val);
-      if (i == state.selection)
-        output_buffer.append("\x1b[m");
+      draw_centered_text(y + i, label + val,
+                         i == state.selection ? STYLE_REVERSE : nullptr);
     }
   }
 
@@ -446,32 +612,24 @@ private:
     if (recent_files.empty()) {
       draw_centered_text(y, "No recent files.");
     } else {
-      for (int i = 0; i < (int)recent_files.size(); ++i) {
-        if (i == state.selection)
-          output_buffer.append("\x1b[7m");
-        draw_centered_text(y + i, recent_files[i]);
-        if (i == state.selection)
-          output_buffer.append("\x1b[m");
-      }
+      for (int i = 0; i < (int)recent_files.size(); ++i)
+        draw_centered_text(y + i, recent_files[i],
+                           i == state.selection ? STYLE_REVERSE : nullptr);
     }
   }
 
-  void draw_state_ui(FileSearchState &state, int y, int) {
-    draw_centered_text(y, "Search File: " + state.query);
-  }
-
   template <typename T> void draw_state_ui(T &, int, int) {}
 
-  void draw_centered_text(int y, const std::string &text) {
+  // Returns the column just past the text.
+  int draw_centered_text(int y, const std::string &text,
+                         const char *style = nullptr) {
     if (y >= window_rows)
-      return;
+      return 0;
     int width = get_display_width(text);
     int pad = (window_cols - width) / 2;
     if (pad < 0)
       pad = 0;
-    output_buffer.append("\x1b[" + std::to_string(y + 1) + ";" +
-                             std::to_string(pad + 1) + "H")
-        .append(text);
+    return screen.put(y, pad, text, style);
   }
 
   struct EditorCursor {
@@ -480,19 +638,41 @@ private:
     int c;
   };
 
+  // Columns count code points, the way Screen::put lays them out: every byte that doesn't
+  // continue a UTF-8 sequence starts one.
   EditorCursor get_visual_cursor() {
-    std::string content = buffer.get_content();
     size_t cursor = buffer.get_cursor();
-    int r = 0, c = 0;
-    for (size_t i = 0; i < cursor && i < content.size(); ++i) {
-      if (content[i] == '\n') {
-        r++;
-        c = 0;
-      } else {
-        c++;
-      }
+    size_t row = buffer.line_of(cursor);
+    return {cursor, (int)row, (int)columns_between(buffer.line_start(row), cursor)};
+  }
+
+  size_t columns_between(size_t from, size_t to) {
+    size_t cols = 0;
+    for (size_t pos = from; pos < to;) {
+      std::string_view run = buffer.chunk_at(pos).substr(0, to - pos);
+      for (char ch : run)
+        cols += ((unsigned char)ch & 0xC0) != 0x80;
+      pos += run.size();
+    }
+    return cols;
+  }
+
+  // Where column `col` starts in [from, to), or `to` if there aren't that many.
+  size_t offset_at_column(size_t from, size_t to, size_t col) {
+    for (size_t pos = from; pos < to;) {
+      std::string_view run = buffer.chunk_at(pos).substr(0, to - pos);
+      for (size_t i = 0; i < run.size(); ++i)
+        if (((unsigned char)run[i] & 0xC0) != 0x80 && col-- == 0)
+          return pos + i;
+      pos += run.size();
     }
-    return {cursor, r, c};
+    return to;
+  }
+
+  // End of `line` (offset of its '\n', or size() for the last line).
+  size_t line_end_of(size_t line) {
+    size_t next = buffer.line_start(line + 1);
+    return next == std::string::npos ? buffer.size() : next - 1;
   }
 
   static constexpr const char* color_for_tree_sitter(honeymoon::syntax::HighlightKind kind) {
@@ -512,13 +692,24 @@ private:
   }
 
   void draw_rows() {
-    std::string content = buffer.get_content();
     bool using_tree_sitter = false;
+    buffer.take_edits(pending_edits);
+    if (pending_edits.reset) {
+      syntax_engine.invalidate();
+      lexer.invalidate();
+    }
+    for (const auto &e : pending_edits.edits) {
+      syntax_engine.edit(e);
+      lexer.edit(e);
+    }
     if (syntax_highlighting &&
         syntax_engine.set_language_for_file(current_filename)) {
-      syntax_engine.update(content);
+      if (syntax_engine.needs_parse())
+        syntax_engine.update(buffer);
       using_tree_sitter = syntax_engine.active();
     }
+    bool using_lexer = syntax_highlighting && !using_tree_sitter &&
+                       lexer.set_language_for_file(current_filename);
     auto cur = get_visual_cursor();
 
 
@@ -536,87 +727,54 @@ private:
       scroll_col = cur.c - visible_cols + 1;
 
 
-    std::vector<size_t> line_offsets;
-    line_offsets.push_back(0);
-    for (size_t i = 0; i < content.size(); ++i) {
-      if (content[i] == '\n')
-        line_offsets.push_back(i + 1);
-    }
-
     int y = 0;
-    size_t line_pos = 0;
-    for (size_t i = 0; i < scroll_row && line_pos < content.size(); ++i) {
-      size_t nl = content.find('\n', line_pos);
-      if (nl == std::string::npos) { line_pos = content.size(); break; }
-      line_pos = nl + 1;
-    }
-    for (; y < window_rows && line_pos <= content.size(); ++y) {
-      size_t nl = content.find('\n', line_pos);
-      size_t line_end = (nl == std::string::npos) ? content.size() : nl;
+    for (; y < window_rows; ++y) {
       size_t file_row = y + scroll_row;
-      std::string_view line_view(content.data() + line_pos, line_end - line_pos);
-      line_pos = (nl == std::string::npos) ? content.size() + 1 : nl + 1;
-
-      if (show_line_numbers)
-        {
-          auto n = std::to_string(file_row + 1);
-          output_buffer.append("\x1b[36m" + std::string(4 - n.size(), ' ') +
-                               n + " \x1b[39m");
-        }
-      else
-        output_buffer.append(" ");
-
-      size_t line_start_abs = (file_row < line_offsets.size())
-                                  ? line_offsets[file_row]
-                                  : 0;
-
-
-      if (scroll_col < line_view.size())
-        line_view = line_view.substr(scroll_col);
-      else
-        line_view = line_view.substr(0, 0);
-      if (line_view.size() > (size_t)visible_cols)
-        line_view = line_view.substr(0, visible_cols);
+      size_t line_start_abs = buffer.line_start(file_row);
+      if (line_start_abs == std::string::npos)
+        break;
+      size_t line_end = line_end_of(file_row);
+      size_t view_start = offset_at_column(line_start_abs, line_end, scroll_col);
+      size_t view_end = offset_at_column(view_start, line_end, visible_cols);
+      std::string line_text = buffer.get_range(view_start, view_end);
+      std::string_view line_view(line_text);
+
+      int x = 1;
+      if (show_line_numbers) {
+        char num[24];
+        int w = snprintf(num, sizeof(num), "%4zu ", file_row + 1);
+        x = screen.put(y, 0, std::string_view(num, w), STYLE_GUTTER);
+      }
 
-      for (size_t i = 0; i < line_view.size(); ++i) {
-        size_t abs = line_start_abs + scroll_col + i;
+      using honeymoon::syntax::HighlightKind;
+      const HighlightKind *kinds = nullptr;
+      if (syntax_highlighting && using_tree_sitter) {
+        kinds = syntax_engine.line_kinds(view_start, view_end);
+      } else if (using_lexer) {
+        kinds = lexer.line_kinds(buffer, file_row, view_end - line_start_abs);
+        if (kinds)
+          kinds += view_start - line_start_abs;
+      }
+      // One code point per put, styled by its first byte.
+      for (size_t i = 0, n; i < line_view.size(); i += n) {
+        n = 1;
+        while (i + n < line_view.size() && ((unsigned char)line_view[i + n] & 0xC0) == 0x80)
+          n++;
+        size_t abs = view_start + i;
         bool sel = (selection_anchor != std::string::npos &&
                     abs >= std::min(selection_anchor, buffer.get_cursor()) &&
                     abs < std::max(selection_anchor, buffer.get_cursor()));
-        if (sel)
-          output_buffer.append("\x1b[7m");
-
-        char c = line_view[i];
-        bool had_syntax_style = false;
-        if (syntax_highlighting) {
-          if (!sel && using_tree_sitter) {
-            auto kind = syntax_engine.kind_at(abs);
-            if (const char *style = color_for_tree_sitter(kind)) {
-              output_buffer.append(style);
-              had_syntax_style = true;
-            }
-          } else if (!sel) {
-            if (std::isdigit(static_cast<unsigned char>(c))) {
-              output_buffer.append("\x1b[36m");
-              had_syntax_style = true;
-            } else if (c == '"') {
-              output_buffer.append("\x1b[32m");
-              had_syntax_style = true;
-            }
-          }
-        }
 
-        output_buffer.append(1, c);
-        if (sel || had_syntax_style)
-          output_buffer.append("\x1b[m");
+        const char *style = sel ? STYLE_REVERSE : nullptr;
+        if (kinds && !sel)
+          style = color_for_tree_sitter(kinds[i]);
+        x = screen.put(y, x, line_view.substr(i, n), style);
       }
-
-      output_buffer.append("\x1b[K\r\n");
     }
 
 
     for (; y < window_rows; y++) {
-      if (content.empty()) {
+      if (buffer.size() == 0) {
         int logo_start_y = window_rows / 3;
         int logo_row = y - logo_start_y;
         if (logo_row >= 0 && logo_row < (int)logo_lines.size()) {
@@ -624,41 +782,112 @@ private:
           int width = get_display_width(msg);
           int pad = (window_cols - 5 - width) / 2;
           if (pad > 0)
-            output_buffer.append("~");
-          output_buffer.append(std::string(std::max(0, pad - 1), ' '))
-              .append(msg);
+            screen.put(y, 0, "~");
+          screen.put(y, std::max(0, pad), msg);
         } else {
-          output_buffer.append("~");
+          screen.put(y, 0, "~");
         }
       } else {
-        output_buffer.append("~");
+        screen.put(y, 0, "~");
       }
-      output_buffer.append("\x1b[K\r\n");
     }
   }
 
   void draw_status_bar() {
     std::string stat = "File: " + current_filename +
-                       (buffer.is_dirty() ? " [+]" : "") + " ";
+                       (buffer.is_dirty() ? " [+]" : "") + " " + save_note;
     std::string rstat = std::to_string(get_visual_cursor().r + 1) + "/" +
                         std::to_string(buffer.size());
     size_t len = stat.length(), rlen = rstat.length();
-    if (len > (size_t)window_cols)
-      len = window_cols;
-    output_buffer.append("\x1b[7m").append(stat.substr(0, len));
-    while (len < (size_t)window_cols) {
-      if (window_cols - len == rlen) {
-        output_buffer.append(rstat);
-        break;
+    screen.fill(window_rows, 0, window_cols, ' ', STYLE_REVERSE);
+    screen.put(window_rows, 0, stat, STYLE_REVERSE);
+    if (len + rlen <= (size_t)window_cols)
+      screen.put(window_rows, window_cols - rlen, rstat, STYLE_REVERSE);
+  }
+
+  // One hit per row, path:line: text; the selection follows the view.
+  void draw_grep_hits(ProjectGrepState &state) {
+    if (state.selection < state.scroll)
+      state.scroll = state.selection;
+    if (window_rows > 0 && state.selection >= state.scroll + window_rows)
+      state.scroll = state.selection - window_rows + 1;
+    for (int y = 0; y < window_rows; ++y) {
+      size_t i = state.scroll + y;
+      if (i >= state.hits.size()) {
+        screen.put(y, 0, "~");
+        continue;
+      }
+      const auto &h = state.hits[i];
+      const char *style = i == state.selection ? STYLE_REVERSE : nullptr;
+      if (style)
+        screen.fill(y, 0, window_cols, ' ', style);
+      int x = screen.put(y, 0, h.path, style ? style : STYLE_GUTTER);
+      x = screen.put(y, x, ":" + std::to_string(h.line) + ": ", style);
+      screen.put(y, x, h.text, style);
+    }
+  }
+
+  // Best match on top.
+  void draw_file_hits(FileSearchState &state) {
+    if (state.selection < state.scroll)
+      state.scroll = state.selection;
+    if (window_rows > 0 && state.selection >= state.scroll + window_rows)
+      state.scroll = state.selection - window_rows + 1;
+    for (int y = 0; y < window_rows; ++y) {
+      size_t i = state.scroll + y;
+      if (i >= state.hits.size()) {
+        screen.put(y, 0, "~");
+        continue;
       }
-      output_buffer.append(" ");
-      len++;
+      const char *style = i == state.selection ? STYLE_REVERSE : nullptr;
+      if (style)
+        screen.fill(y, 0, window_cols, ' ', style);
+      screen.put(y, 0, std::string(state.paths->path(state.hits[i].index)), style);
+    }
+  }
+
+  void draw_file_status_bar(const FileSearchState &state) {
+    std::string stat = "Files: ";
+    if (state.paths)
+      stat += std::to_string(state.matched) + "/" + std::to_string(state.paths->size());
+    if (!file_index.ready())
+      stat += state.paths ? " (indexing)" : "indexing...";
+    char timing[32] = "";
+    if (state.paths && !state.query.empty())
+      snprintf(timing, sizeof(timing), "%.1f ms ", state.ms);
+    screen.fill(window_rows, 0, window_cols, ' ', STYLE_REVERSE);
+    screen.put(window_rows, 0, stat, STYLE_REVERSE);
+    size_t rlen = strlen(timing);
+    if (stat.size() + rlen <= (size_t)window_cols)
+      screen.put(window_rows, window_cols - rlen, timing, STYLE_REVERSE);
+  }
+
+  void draw_grep_status_bar(const ProjectGrepState &state) {
+    const auto &s = state.stats;
+    std::string stat = "Grep: " + std::to_string(state.hits.size()) + " hits in " +
+                       std::to_string(s.files) + " files";
+    if (s.binary)
+      stat += ", " + std::to_string(s.binary) + " binary skipped";
+    char timing[96] = "";
+    if (!state.searched.empty()) {
+      double mbs = s.total_ms > 0 ? s.bytes / 1048576.0 / (s.total_ms / 1000) : 0;
+      if (s.first_ms >= 0)
+        snprintf(timing, sizeof(timing), "first %.1f ms, %s %.1f ms, %.0f MB/s ", s.first_ms,
+                 s.done ? "total" : "so far", s.total_ms, mbs);
+      else
+        snprintf(timing, sizeof(timing), "%s %.1f ms, %.0f MB/s ", s.done ? "total" : "so far", s.total_ms, mbs);
     }
-    output_buffer.append("\x1b[m\r\n");
+    if (s.truncated)
+      stat += " (stopped at " + std::to_string(honeymoon::search::ProjectGrep::MAX_HITS) + ")";
+    screen.fill(window_rows, 0, window_cols, ' ', STYLE_REVERSE);
+    screen.put(window_rows, 0, stat, STYLE_REVERSE);
+    size_t rlen = strlen(timing);
+    if (stat.size() + rlen <= (size_t)window_cols)
+      screen.put(window_rows, window_cols - rlen, timing, STYLE_REVERSE);
   }
 
   void draw_message_bar() {
-    output_buffer.append("\x1b[K").append(status_message);
+    screen.put(window_rows + 1, 0, status_message);
   }
 
   void place_cursor() {
@@ -669,20 +898,58 @@ private:
     if (r >= window_rows)
       r = window_rows - 1;
     int gutter = show_line_numbers ? 5 : 1;
-    output_buffer.append("\x1b[" + std::to_string(r + 1) + ";" +
-                         std::to_string(c + 1 + gutter) + "H");
+    screen.set_cursor(r, c + gutter);
   }
 
-  void process_keypress() {
-    Key k = terminal.read_key();
-    if (k == Key::None)
-      return;
+  // Handles every key that has arrived so far; the frame is drawn once afterwards,
+  // however many there were.
+  void process_input() {
+    Key k;
+    while (!should_quit && (k = terminal.read_key()) != Key::None) {
+      if (k == Key::Paste)
+        std::visit([this](auto &state) { this->handle_paste(state, terminal.take_paste()); }, mode);
+      else
+        std::visit([this, k](auto &state) { this->handle_input(state, k); }, mode);
+    }
+  }
 
-    std::visit([this, k](auto &state) { this->handle_input(state, k); }, mode);
+  // A paste is one edit: one bulk insert, one undo group, never a keybinding.
+  void handle_paste(EditorState &, std::string text) {
+    // Terminals send line breaks as CR; CRLF and lone CR both become LF.
+    size_t out = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+      if (text[i] == '\r') {
+        text[out++] = '\n';
+        if (i + 1 < text.size() && text[i + 1] == '\n')
+          ++i;
+      } else {
+        text[out++] = text[i];
+      }
+    }
+    text.resize(out);
+    key_state = honeymoon::config::KeyMap::ROOT;
+    pending_key_count = 0;
+    close_typing_group();
+    begin_undo_group(buffer.get_cursor());
+    insert_text(text);
+    close_typing_group();
+    status_message = "Pasted " + std::to_string(text.size()) + " bytes";
+  }
+
+  // Prompts take the first line, typed in as if by hand.
+  template <typename State>
+  void handle_paste(State &state, std::string text) {
+    if constexpr (requires { state.query; }) {
+      for (char c : text) {
+        if (c == '\r' || c == '\n')
+          break;
+        handle_input(state, static_cast<Key>(c));
+      }
+    }
   }
 
   void handle_input(EditorState &, Key k) {
-    if (k == Key::Esc && current_node == root_node) {
+    if (k == Key::Esc && key_state == honeymoon::config::KeyMap::ROOT) {
       if (selection_anchor != std::string::npos) {
         selection_anchor = std::string::npos;
         status_message = "Selection Cancelled";
@@ -690,38 +957,35 @@ private:
       }
     }
 
-    KeyNode* next = find_child(current_node, k);
-    if (next) {
-      current_node = next;
+    using Step = honeymoon::config::KeyMap::Step;
+    Step step = keymap.step(key_state, k);
+    if (step.kind == Step::Action || step.kind == Step::Unknown) {
+      key_state = honeymoon::config::KeyMap::ROOT;
+      pending_key_count = 0;
+      status_message = "";
+      close_typing_group();
+      if (step.kind == Step::Action)
+        execute_action(static_cast<ActionId>(step.value));
+      else
+        status_message = "Action not found: " + keymap.unknown_action(step.value);
+    } else if (step.kind == Step::Prefix) {
+      key_state = step.value;
       if (pending_key_count < 16) pending_keys[pending_key_count++] = k;
-
-      if (!current_node->action.empty() && !current_node->first_child) {
-        ActionId aid = lookup_action(current_node->action);
-        current_node = root_node;
-        pending_key_count = 0;
-        status_message = "";
-        close_typing_group();
-        if (aid != ACT_NONE)
-          execute_action(aid);
-        else
-          status_message = std::string("Action not found: ") + current_node->action;
-      } else {
-        std::string msg;
-        for (int i = 0; i < pending_key_count; ++i) {
-          if (i) msg += ' ';
-          msg += to_string(pending_keys[i]);
-        }
-        status_message = msg;
+      std::string msg;
+      for (int i = 0; i < pending_key_count; ++i) {
+        if (i) msg += ' ';
+        msg += to_string(pending_keys[i]);
       }
+      status_message = msg;
     } else {
-      if (current_node != root_node) {
+      if (key_state != honeymoon::config::KeyMap::ROOT) {
         status_message = "Undefined Key";
-        current_node = root_node;
+        key_state = honeymoon::config::KeyMap::ROOT;
         pending_key_count = 0;
       } else {
         if (is_printable((int)k) && k != Key::Esc) {
-          snapshot_for_undo(buffer.get_content(), buffer.get_cursor());
-          buffer.insert_char((char)k);
+          begin_undo_group(buffer.get_cursor());
+          insert_text((char)k);
           status_message = "";
         } else {
           status_message = "Unbound Key";
@@ -730,51 +994,251 @@ private:
     }
   }
 
+  // Every step starts where the last one matched: a longer query can't match any
+  // earlier, and if the shorter one failed so does this one. Neither holds for a
+  // regexp, which just searches again from the current match.
   void handle_input(TextSearchState &state, Key k) {
     if (k == Key::Enter || k == Key::Esc) {
       mode = EditorState{current_filename};
+      match_counter.stop();
       status_message = "";
       return;
     }
     if (k == Key::Ctrl_G) {
       mode = EditorState{current_filename};
+      match_counter.stop();
       buffer.move_gap(state.start_idx);
       status_message = "Cancelled";
       return;
     }
 
-    bool next = false;
+    size_t at = state.steps.empty() ? state.start_idx : state.steps.back().pos;
+    size_t end = state.steps.empty() ? state.start_idx : state.steps.back().end;
+    bool failing = !state.steps.empty() && !state.steps.back().found;
+    size_t query_len = state.query.size();
     if (k == Key::Backspace || k == Key::Ctrl_H) {
-      if (!state.query.empty())
-        state.query.pop_back();
-    } else if (k == Key::Ctrl_S) {
-      state.forward = true;
-      next = true;
-    } else if (k == Key::Ctrl_R) {
-      state.forward = false;
-      next = true;
+      if (!state.steps.empty())
+        state.steps.pop_back();
+      state.query.resize(state.steps.empty() ? 0 : state.steps.back().query_len);
+      buffer.move_gap(state.steps.empty() ? state.start_idx : state.steps.back().pos);
+      if (state.regex && state.query.size() != query_len)
+        search_regex.compile(state.query);
+    } else if (k == Key::Ctrl_S || k == Key::Ctrl_R) {
+      state.forward = k == Key::Ctrl_S;
+      if (state.query.empty())
+        return;
+      // Repeating a failed search wraps around.
+      if (state.regex) {
+        size_t from = failing ? (state.forward ? 0 : buffer.size())
+                              : (state.forward ? std::max(end, at + 1) : at);
+        regex_step(state, from, failing ? std::string::npos : at);
+      } else {
+        size_t from = failing ? (state.forward ? 0 : buffer.size())
+                              : (state.forward ? at + 1 : (at > 0 ? at - 1 : 0));
+        search_step(state, from, failing || state.forward || at > 0);
+      }
     } else if (is_printable((int)k)) {
       state.query.push_back((char)k);
+      if (state.regex) {
+        search_regex.compile(state.query);
+        regex_step(state, state.forward ? at : end, std::string::npos);
+      } else {
+        search_step(state, at, !failing);
+      }
+    } else {
+      return;
+    }
+    if (state.query.size() != query_len) {
+      if (state.regex)
+        match_counter.stop();
+      else
+        match_counter.start(state.query);
     }
+    update_search_status(state);
+  }
 
-    std::string c = buffer.get_content();
-    size_t start_pos = buffer.get_cursor();
-    if (next)
-      start_pos =
-          (state.forward) ? start_pos + 1 : (start_pos > 0 ? start_pos - 1 : 0);
+  void push_search_step(TextSearchState &state, size_t found, size_t found_end) {
+    size_t at = state.steps.empty() ? state.start_idx : state.steps.back().pos;
+    size_t end = state.steps.empty() ? state.start_idx : state.steps.back().end;
+    if (found != std::string::npos) {
+      buffer.move_gap(found);
+      at = found;
+      end = found_end;
+    }
+    state.steps.push_back({state.query.size(), at, end, found != std::string::npos});
+  }
 
+  void search_step(TextSearchState &state, size_t from, bool may_match) {
     size_t found = std::string::npos;
-    if (state.forward)
-      found = c.find(state.query, start_pos);
-    else
-      found = c.rfind(state.query, start_pos);
+    if (may_match)
+      found = state.forward ? honeymoon::search::find_forward(buffer, state.query, from)
+                            : honeymoon::search::find_backward(buffer, state.query, from);
+    push_search_step(state, found, found + state.query.size());
+  }
 
-    if (found != std::string::npos) {
-      buffer.move_gap(found);
-      status_message = "I-Search: " + state.query;
+  // `skip` is the start of an empty match a repeated search must not land on again.
+  void regex_step(TextSearchState &state, size_t from, size_t skip) {
+    honeymoon::search::Match m;
+    if (search_regex.valid()) {
+      m = state.forward ? search_regex.search_forward(buffer, from)
+                        : search_regex.search_backward(buffer, from);
+      if (!state.forward && m.found() && m.start == skip && m.end == skip)
+        m = skip > 0 ? search_regex.search_backward(buffer, skip - 1) : honeymoon::search::Match{};
+    }
+    push_search_step(state, m.start, m.end);
+  }
+
+  void update_search_status(const TextSearchState &state) {
+    bool failing = !state.steps.empty() && !state.steps.back().found;
+    status_message = failing ? "Failing " : "";
+    status_message += state.regex ? "Regexp I-Search" : "I-Search";
+    status_message += state.forward ? ": " : " Back: ";
+    status_message += state.query;
+    if (state.regex && !state.query.empty() && !search_regex.valid())
+      status_message += " [" + search_regex.error() + "]";
+    if (match_counter.done())
+      status_message += " [" + std::to_string(match_counter.count()) + " matches]";
+  }
+
+  void count_matches() {
+    if (!match_counter.busy())
+      return;
+    auto *state = std::get_if<TextSearchState>(&mode);
+    if (!state) {
+      match_counter.stop();
+      return;
+    }
+    match_counter.step(buffer, COUNT_SLICE);
+    if (match_counter.done())
+      update_search_status(*state);
+  }
+
+  // The region is the selection if there is one, otherwise point to the end of the buffer.
+  void start_replace(bool ask, bool regex) {
+    size_t c = buffer.get_cursor();
+    size_t from = c, to = buffer.size();
+    if (selection_anchor != std::string::npos) {
+      from = std::min(selection_anchor, c);
+      to = std::max(selection_anchor, c);
+      selection_anchor = std::string::npos;
+    }
+    mode = ReplaceState{.query = "", .start_idx = c, .from = from, .to = to, .regex = regex, .ask = ask};
+    update_replace_status(std::get<ReplaceState>(mode));
+  }
+
+  void handle_input(ReplaceState &state, Key k) {
+    if (k == Key::Ctrl_G || (k == Key::Esc && state.phase != ReplaceState::ANSWER)) {
+      finish_replace(state, false);
+      status_message = "Cancelled";
+      return;
+    }
+    if (state.phase == ReplaceState::ANSWER) {
+      answer_replace(state, k);
+      return;
+    }
+    if (k == Key::Backspace || k == Key::Ctrl_H) {
+      if (!state.query.empty())
+        state.query.pop_back();
+    } else if (is_printable((int)k)) {
+      state.query.push_back((char)k);
+    } else if (k == Key::Enter && state.phase == ReplaceState::PATTERN) {
+      if (state.query.empty())
+        return;
+      if (state.regex && !search_regex.compile(state.query)) {
+        status_message = "Invalid regexp: " + search_regex.error();
+        return;
+      }
+      state.pattern = std::move(state.query);
+      state.query.clear();
+      state.phase = ReplaceState::REPLACEMENT;
+    } else if (k == Key::Enter) {
+      state.replacement = std::move(state.query);
+      state.query.clear();
+      state.matches = state.regex ? honeymoon::search::find_all(buffer, search_regex, state.from, state.to)
+                                  : honeymoon::search::find_all(buffer, state.pattern, state.from, state.to);
+      if (state.matches.empty()) {
+        finish_replace(state, false);
+        status_message = "No match";
+        return;
+      }
+      if (!state.ask) {
+        state.accepted = std::move(state.matches);
+        finish_replace(state, true);
+        return;
+      }
+      state.phase = ReplaceState::ANSWER;
+      show_replace_match(state);
     } else {
-      status_message = "Failing I-Search: " + state.query;
+      return;
+    }
+    update_replace_status(state);
+  }
+
+  // y or SPC replaces, n or DEL skips, ! replaces the rest, . replaces this one and stops,
+  // q, Enter or Esc stop. The answers are only applied once it's over.
+  void answer_replace(ReplaceState &state, Key k) {
+    const auto &m = state.matches;
+    if (k == Key('y') || k == Key(' ') || k == Key('.')) {
+      state.accepted.push_back(m[state.next++]);
+    } else if (k == Key('n') || k == Key::Backspace || k == Key::Del) {
+      state.next++;
+    } else if (k == Key('!')) {
+      state.accepted.insert(state.accepted.end(), m.begin() + state.next, m.end());
+      state.next = m.size();
+    } else if (k != Key('q') && k != Key::Enter && k != Key::Esc) {
+      return;
+    }
+    if (state.next >= m.size() || k == Key('.') || k == Key('q') || k == Key::Enter || k == Key::Esc) {
+      finish_replace(state, true);
+      return;
+    }
+    show_replace_match(state);
+    update_replace_status(state);
+  }
+
+  // The match is shown as the selection, with point at its end.
+  void show_replace_match(const ReplaceState &state) {
+    const auto &m = state.matches[state.next];
+    selection_anchor = m.start;
+    buffer.move_gap(m.end);
+  }
+
+  // All accepted matches go in one splice: one erase, one insert, one undo group and
+  // a single edit record for the parser. Point ends up after the last replacement.
+  void finish_replace(ReplaceState &state, bool apply) {
+    selection_anchor = std::string::npos;
+    buffer.move_gap(state.start_idx);
+    size_t n = apply ? state.accepted.size() : 0;
+    if (n > 0) {
+      auto with = state.regex ? honeymoon::search::Template::parse(state.replacement)
+                              : honeymoon::search::Template::literal(state.replacement);
+      std::string text = honeymoon::search::splice(buffer, state.accepted, with);
+      close_typing_group();
+      begin_undo_group(state.start_idx);
+      erase_text(state.accepted.front().start, state.accepted.back().end);
+      insert_text(text);
+      close_typing_group();
     }
+    size_t skipped = apply ? state.matches.size() - n : 0;
+    status_message = "Replaced " + std::to_string(n) + (n == 1 ? " occurrence" : " occurrences");
+    if (skipped)
+      status_message += " (skipped " + std::to_string(skipped) + ")";
+    mode = EditorState{current_filename};
+  }
+
+  void update_replace_status(const ReplaceState &state) {
+    if (state.phase == ReplaceState::ANSWER) {
+      status_message = "Query replacing " + state.pattern + " with " + state.replacement +
+                       ": (y, n, !, ., q) [" + std::to_string(state.next + 1) + "/" +
+                       std::to_string(state.matches.size()) + "]";
+      return;
+    }
+    status_message = state.ask ? "Query replace" : "Replace";
+    if (state.regex)
+      status_message += " regexp";
+    if (state.phase == ReplaceState::REPLACEMENT)
+      status_message += " " + state.pattern + " with";
+    status_message += ": " + state.query;
   }
 
   void handle_input(HomeState &state, Key k) {
@@ -793,7 +1257,7 @@ private:
         state.selection = 0;
     } else if (k == Key::Enter) {
       switch (state.selection) {
-        case 0: mode = FileSearchState{}; break;
+        case 0: start_find_file(); break;
         case 1: mode = RecentFilesState{}; break;
         case 2: mode = SettingsState{}; break;
         case 3: mode = HelpState{}; break;
@@ -824,18 +1288,258 @@ private:
   }
 
   void handle_input(FileSearchState &state, Key k) {
-    if (k == Key::Esc) {
+    if (k == Key::Esc || k == Key::Ctrl_G) {
       mode = HomeState{};
+      status_message = "";
       return;
     }
-    if (k == Key::Enter) {
-      if (!state.query.empty())
+    size_t n = state.hits.size();
+    size_t page = window_rows > 1 ? window_rows - 1 : 1;
+    if (k == Key::ArrowUp || k == Key::Ctrl_P) {
+      if (state.selection > 0)
+        state.selection--;
+    } else if (k == Key::ArrowDown || k == Key::Ctrl_N) {
+      if (state.selection + 1 < n)
+        state.selection++;
+    } else if (k == Key::PageUp) {
+      state.selection -= std::min(state.selection, page);
+    } else if (k == Key::PageDown) {
+      state.selection = n ? std::min(n - 1, state.selection + page) : 0;
+    } else if (k == Key::Enter) {
+      if (n)
+        open(std::string(state.paths->path(state.hits[state.selection].index)));
+      else if (!state.query.empty())
         open(state.query);
+      return;
+    } else if (k == Key::Backspace || k == Key::Ctrl_H) {
+      if (!state.query.empty())
+        state.query.pop_back();
+      refilter(state);
+    } else if (is_printable((int)k)) {
+      state.query.push_back((char)k);
+      refilter(state);
+    }
+    status_message = "Find File: " + state.query;
+  }
+
+  // The index is built once, in the background, and watched from then on. It's saved
+  // beside the history on the way out, so the next session starts from it.
+  void start_find_file() {
+    file_index.start(".", ".honeymoon_index");
+    finder.reset();
+    FileSearchState state{.query = "", .paths = file_index.paths()};
+    refilter(state);
+    mode = std::move(state);
+    status_message = "Find File: ";
+  }
+
+  void refilter(FileSearchState &state) {
+    auto t0 = std::chrono::steady_clock::now();
+    state.hits = finder.match(state.paths, state.query, MAX_FILE_HITS);
+    state.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    state.matched = finder.matched();
+    state.selection = state.scroll = 0;
+  }
+
+  // A fresher list means a full match again; the old one's candidates don't carry over.
+  void take_file_index() {
+    auto paths = file_index.paths();
+    if (auto *state = std::get_if<FileSearchState>(&mode)) {
+      size_t selection = state->selection;
+      state->paths = std::move(paths);
+      refilter(*state);
+      state->selection = std::min(selection, state->hits.empty() ? 0 : state->hits.size() - 1);
+    }
+  }
+
+  void handle_input(ProjectGrepState &state, Key k) {
+    if (k == Key::Esc || k == Key::Ctrl_G) {
+      grep.stop();
+      mode = EditorState{current_filename};
+      status_message = "";
+      return;
+    }
+    size_t n = state.hits.size();
+    size_t page = window_rows > 1 ? window_rows - 1 : 1;
+    if (k == Key::ArrowUp || k == Key::Ctrl_P) {
+      if (state.selection > 0)
+        state.selection--;
+    } else if (k == Key::ArrowDown || k == Key::Ctrl_N) {
+      if (state.selection + 1 < n)
+        state.selection++;
+    } else if (k == Key::PageUp) {
+      state.selection -= std::min(state.selection, page);
+    } else if (k == Key::PageDown) {
+      state.selection = n ? std::min(n - 1, state.selection + page) : 0;
+    } else if (k == Key::Enter) {
+      if (state.query.empty())
+        return;
+      if (state.query != state.searched) {
+        start_grep(state);
+      } else if (n) {
+        visit_grep_hit(state.hits[state.selection]);
+        return;
+      }
     } else if (k == Key::Backspace || k == Key::Ctrl_H) {
       if (!state.query.empty())
         state.query.pop_back();
-    } else if (is_printable((int)k))
+      state.error.clear();
+    } else if (is_printable((int)k)) {
       state.query.push_back((char)k);
+      state.error.clear();
+    }
+    update_grep_status(state);
+  }
+
+  void start_grep(ProjectGrepState &state) {
+    state.hits.clear();
+    state.selection = state.scroll = 0;
+    state.stats = {};
+    state.searched.clear();
+    state.error.clear();
+    if (grep.start(".", state.query, state.regex))
+      state.searched = state.query;
+    else
+      state.error = grep.error();
+  }
+
+  void take_grep_hits() {
+    auto *state = std::get_if<ProjectGrepState>(&mode);
+    if (!state) {
+      std::vector<honeymoon::search::GrepHit> dropped;
+      grep.take(dropped);
+      return;
+    }
+    state->stats = grep.take(state->hits);
+  }
+
+  // Stays in the buffer if the hit is in the file already open, so unsaved edits survive.
+  // By value: the hit lives in the grep state, which leaving the mode destroys.
+  void visit_grep_hit(honeymoon::search::GrepHit h) {
+    grep.stop();
+    // Hits are spelled relative to ".", the open file however it was typed.
+    if (!honeymoon::mem::same_file(h.path, current_filename))
+      open(h.path);
+    mode = EditorState{current_filename};
+    size_t idx = buffer.line_start(h.line - 1);
+    buffer.move_gap(idx == std::string::npos ? buffer.size() : std::min(idx + h.column, buffer.size()));
+    status_message = h.path + ":" + std::to_string(h.line);
+  }
+
+  // A few changes to a big file are written over it where it lies. Anything else goes to
+  // the writer thread as a snapshot, and the buffer counts as saved from here on; an edit
+  // made while it writes makes it dirty again, and so does a save that fails.
+  void save_file() {
+    uint64_t mark = journal.mark();
+    std::vector<honeymoon::mem::Extent> extents;
+    size_t changed = 0;
+    const auto &stamp = buffer.disk_stamp();
+    if (saver.busy())
+      rewrite_reason = "a save was already running";
+    else if (buffer.size() < IN_PLACE_MIN_SIZE)
+      rewrite_reason = "small file";
+    else if (!stamp.known())
+      rewrite_reason = "new file";
+    else if (stamp != honeymoon::mem::stamp_of(current_filename))
+      rewrite_reason = "file changed on disk";
+    else if (!buffer.dirty_extents(extents))
+      rewrite_reason = "edited while the last save was written";
+    else if ((int64_t)buffer.size() < stamp.size)
+      rewrite_reason = "file shrank";
+    else {
+      for (const auto &e : extents)
+        changed += e.end - e.start;
+      if (changed <= buffer.size() / IN_PLACE_MAX_SHARE) {
+        save_in_place(extents, changed, mark);
+        return;
+      }
+      rewrite_reason = format_size(changed) + " moved or changed";
+    }
+    last_save = saver.save(current_filename, buffer.snapshot());
+    last_save_mark = mark;
+    buffer.set_dirty(false);
+    save_note = "[saving]";
+    status_message = "Saving " + current_filename + "...";
+  }
+
+  // The writer is idle, so the only other reader of the text is the parse thread, and its
+  // snapshot may read the very bytes about to be written.
+  void save_in_place(const std::vector<honeymoon::mem::Extent> &extents, size_t changed, uint64_t mark) {
+    auto t0 = std::chrono::steady_clock::now();
+    syntax_engine.hold_parse();
+    buffer.pin_extents(extents);
+    honeymoon::mem::FileStamp stamp;
+    std::string error;
+    if (!honeymoon::mem::patch_file(current_filename, buffer, extents, stamp, error)) {
+      save_note = "[save failed]";
+      status_message = "Could not save " + current_filename + ": " + error;
+      return;
+    }
+    buffer.mark_saved(current_filename, stamp);
+    journal.saved(mark, stamp);
+    last_save = 0; // whatever the writer finished last is older than this
+    buffer.set_dirty(false);
+    save_note.clear();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    char took[32];
+    snprintf(took, sizeof(took), "%.1f ms", ms);
+    status_message = "Saved " + current_filename + " in place (" + std::to_string(extents.size()) +
+                     (extents.size() == 1 ? " extent, " : " extents, ") + format_size(changed) + " in " + took + ")";
+  }
+
+  void take_save_progress() {
+    auto p = saver.progress();
+    if (!p.done) {
+      save_note = "[saving " + std::to_string(p.total ? p.written * 100 / p.total : 100) + "% of " +
+                  format_size(p.total) + "]";
+      return;
+    }
+    if (!p.ok) {
+      save_note = "[save failed]";
+      if (p.path == current_filename)
+        buffer.set_dirty(true);
+      message_if_editing("Could not save " + p.path + ": " + p.error);
+      return;
+    }
+    // Unless another save is queued, the file is the buffer as it was when this one was
+    // asked for. Edits made meanwhile are all the journal still needs.
+    if (p.id == last_save && p.path == current_filename) {
+      if (!buffer.is_dirty())
+        buffer.mark_saved(p.path, p.stamp);
+      else
+        buffer.mark_saved_earlier(p.stamp);
+      journal.saved(last_save_mark, p.stamp);
+      last_save = 0; // settled; hearing about it again changes nothing
+    }
+    save_note.clear();
+    message_if_editing("Saved " + p.path + " (rewrote " + format_size(p.total) + " in " +
+                       std::to_string((long long)p.ms) + " ms: " + rewrite_reason + ")");
+  }
+
+  static std::string format_size(size_t bytes) {
+    if (bytes < 1024)
+      return std::to_string(bytes) + " B";
+    static constexpr const char *units[] = {"KB", "MB", "GB", "TB"};
+    double n = bytes / 1024.0;
+    int u = 0;
+    for (; n >= 1024 && u < 3; ++u)
+      n /= 1024;
+    char out[32];
+    snprintf(out, sizeof(out), "%.1f %s", n, units[u]);
+    return out;
+  }
+
+  // The message line doubles as the prompt in the minibuffer modes; leave those alone.
+  void message_if_editing(std::string msg) {
+    if (std::holds_alternative<EditorState>(mode))
+      status_message = std::move(msg);
+  }
+
+  void update_grep_status(const ProjectGrepState &state) {
+    status_message = state.regex ? "Grep regexp: " : "Grep: ";
+    status_message += state.query;
+    if (!state.error.empty())
+      status_message += " [" + state.error + "]";
   }
 
   void handle_input(GotoLineState &state, Key k) {
@@ -851,15 +1555,8 @@ private:
         if (end == state.query.c_str() || *end != '\0') {
           status_message = "Invalid number";
         } else {
-          std::string c = buffer.get_content();
-          size_t idx = 0;
-          int current_line = 1;
-          while (idx < c.size() && current_line < line_num) {
-            if (c[idx] == '\n')
-              current_line++;
-            idx++;
-          }
-          buffer.move_gap(idx);
+          size_t idx = buffer.line_start(line_num > 1 ? (size_t)line_num - 1 : 0);
+          buffer.move_gap(idx == std::string::npos ? buffer.size() : idx);
           status_message = "Jumped to line " + state.query;
         }
       }
@@ -906,6 +1603,47 @@ private:
     }
   }
 
+  // The journal's edits go through insert_text and erase_text like typed ones, so one undo
+  // takes them all back, but they aren't journaled a second time: the journal carries on
+  // from where it stopped.
+  void handle_input(RecoverState &state, Key k) {
+    if (k == Key::Esc || k == Key::Ctrl_G) { // not now: the journal stays, and isn't written over
+      mode = EditorState{current_filename};
+      status_message = "Left " + honeymoon::mem::journal_path(current_filename) + " alone; edits to " +
+                       current_filename + " aren't journaled";
+      return;
+    }
+    if (k == (Key)'n' || k == (Key)'N') {
+      journal.start(current_filename, buffer.disk_stamp());
+      mode = EditorState{current_filename};
+      status_message = "Discarded the journal of " + current_filename;
+      return;
+    }
+    if (k != (Key)'y' && k != (Key)'Y')
+      return;
+    size_t applied = 0, kept = 0;
+    begin_undo_group(buffer.get_cursor());
+    for (const auto &r : state.journal.records) {
+      if (r.pos > buffer.size() || (!r.insert && r.len > buffer.size() - r.pos))
+        break; // not this text's edits after all
+      if (r.insert) {
+        buffer.move_gap(r.pos);
+        insert_text(r.text);
+      } else {
+        erase_text(r.pos, r.pos + r.len);
+      }
+      applied++;
+      kept = r.end;
+    }
+    close_typing_group();
+    journal.start(current_filename, state.journal.base, kept);
+    buffer.set_dirty(applied > 0);
+    status_message = "Recovered " + std::to_string(applied) + (applied == 1 ? " edit to " : " edits to ") + current_filename;
+    if (applied < state.journal.records.size())
+      status_message += " (dropped " + std::to_string(state.journal.records.size() - applied) + " that didn't fit)";
+    mode = EditorState{current_filename};
+  }
+
   void handle_input(HelpState &, Key k) {
     if (k == Key::Esc)
       mode = HomeState{};
@@ -915,8 +1653,11 @@ private:
       mode = HomeState{};
   }
 
+  // Moves by code points, so the cursor never lands inside one and always has a column.
   void move_cursor_lin(int off) {
     long long np = (long long)buffer.get_cursor() + off;
+    while (np > 0 && np < (long long)buffer.size() && ((unsigned char)buffer.get_char_at(np) & 0xC0) == 0x80)
+      np += off < 0 ? -1 : 1;
     if (np < 0)
       np = 0;
     if (np > (long long)buffer.size())
@@ -929,140 +1670,112 @@ private:
     int tr = cur.r + rd;
     if (tr < 0)
       tr = 0;
-    std::string c = buffer.get_content();
-    int br = 0;
-    size_t i = 0;
-    while (br < tr && i < c.size()) {
-      if (c[i] == '\n')
-        br++;
-      i++;
-    }
-    if (br < tr) {
-      buffer.move_gap(c.size());
+    size_t i = buffer.line_start(tr);
+    if (i == std::string::npos) {
+      buffer.move_gap(buffer.size());
       return;
     }
     int tc = cur.c + cd;
-    size_t eol = i;
-    while (eol < c.size() && c[eol] != '\n')
-      eol++;
     if (tc < 0)
       tc = 0;
-    if (tc > (int)(eol - i))
-      tc = eol - i;
-    buffer.move_gap(i + tc);
+    buffer.move_gap(offset_at_column(i, line_end_of(tr), tc));
+  }
+
+  static bool is_separator(char c) {
+    unsigned char u = static_cast<unsigned char>(c);
+    return std::isspace(u) || std::ispunct(u);
   }
 
-  bool is_separator(char c) { return std::isspace(c) || std::ispunct(c); }
+  // Steps forward from pos while the separator-ness matches `sep`.
+  size_t skip_forward(size_t pos, bool sep) {
+    size_t n = buffer.size();
+    for (TextIt it(buffer, pos); pos < n && is_separator(*it) == sep; ++it)
+      pos++;
+    return pos;
+  }
+
+  // Steps backward from pos while the character before it matches `sep`.
+  size_t skip_backward(size_t pos, bool sep) {
+    for (TextIt it(buffer, pos); pos > 0 && is_separator(*--it) == sep;)
+      pos--;
+    return pos;
+  }
 
   void move_word_forward() {
-    std::string c = buffer.get_content();
     size_t idx = buffer.get_cursor();
-    if (idx >= c.size())
+    if (idx >= buffer.size())
       return;
-    while (idx < c.size() && is_separator(c[idx]))
-      idx++;
-    while (idx < c.size() && !is_separator(c[idx]))
-      idx++;
-    buffer.move_gap(idx);
+    buffer.move_gap(skip_forward(skip_forward(idx, true), false));
   }
 
   void move_word_backward() {
     size_t idx = buffer.get_cursor();
     if (idx == 0)
       return;
-    std::string c = buffer.get_content();
-    idx--;
-    while (idx > 0 && is_separator(c[idx]))
-      idx--;
-    while (idx > 0 && !is_separator(c[idx]))
-      idx--;
-    if (is_separator(c[idx]))
-      idx++;
-    buffer.move_gap(idx);
+    buffer.move_gap(skip_backward(skip_backward(idx, true), false));
   }
 
   void move_line_start() {
-    std::string c = buffer.get_content();
-    size_t idx = buffer.get_cursor();
-    while (idx > 0 && c[idx - 1] != '\n')
-      idx--;
-    buffer.move_gap(idx);
+    buffer.move_gap(buffer.line_start(buffer.line_of(buffer.get_cursor())));
   }
 
   void move_line_end() {
-    std::string c = buffer.get_content();
-    size_t idx = buffer.get_cursor();
-    while (idx < c.size() && c[idx] != '\n')
-      idx++;
-    buffer.move_gap(idx);
+    buffer.move_gap(line_end_of(buffer.line_of(buffer.get_cursor())));
   }
 
   void kill_to_eol() {
-    snapshot_for_undo(buffer.get_content(), buffer.get_cursor());
+    begin_undo_group(buffer.get_cursor());
     size_t start = buffer.get_cursor();
-    std::string c = buffer.get_content();
-    size_t end = start;
-    while (end < c.size() && c[end] != '\n')
-      end++;
-    if (start == end && end < c.size())
+    size_t end = line_end_of(buffer.line_of(start));
+    if (start == end && end < buffer.size())
       end++;
     if (end > start) {
       set_clipboard(buffer.get_range(start, end));
-      buffer.delete_range(start, end);
+      erase_text(start, end);
       status_message = "Killed line";
     }
   }
 
   void kill_word() {
-    snapshot_for_undo(buffer.get_content(), buffer.get_cursor());
+    begin_undo_group(buffer.get_cursor());
     size_t start = buffer.get_cursor();
     move_word_forward();
     size_t end = buffer.get_cursor();
     if (end > start) {
       set_clipboard(buffer.get_range(start, end));
-      buffer.delete_range(start, end);
+      erase_text(start, end);
       status_message = "Killed word";
     }
   }
 
   void transpose_chars() {
-    snapshot_for_undo(buffer.get_content(), buffer.get_cursor());
+    begin_undo_group(buffer.get_cursor());
     size_t idx = buffer.get_cursor();
     if (idx == 0 || buffer.size() < 2)
       return;
-    std::string c = buffer.get_content();
-    if (idx >= c.size())
+    if (idx >= buffer.size())
       idx--;
     if (idx > 0) {
-      char a = c[idx - 1];
-      char b = c[idx];
-      buffer.delete_range(idx - 1, idx + 1);
-      buffer.move_gap(idx - 1);
-      buffer.insert_char(b);
-      buffer.insert_char(a);
+      std::string pair = buffer.get_range(idx - 1, idx + 1);
+      char a = pair[0];
+      char b = pair[1];
+      erase_text(idx - 1, idx + 1);
+      insert_text(b);
+      insert_text(a);
     }
   }
 
   void transpose_words() {
-    snapshot_for_undo(buffer.get_content(), buffer.get_cursor());
-    std::string c = buffer.get_content();
+    begin_undo_group(buffer.get_cursor());
     size_t cur = buffer.get_cursor();
 
 
-    size_t word2_end = cur;
-    while (word2_end > 0 && is_separator(c[word2_end - 1]))
-      word2_end--;
-    size_t word2_start = word2_end;
-    while (word2_start > 0 && !is_separator(c[word2_start - 1]))
-      word2_start--;
+    size_t word2_end = skip_backward(cur, true);
+    size_t word2_start = skip_backward(word2_end, false);
 
 
-    size_t word1_end = word2_start;
-    while (word1_end > 0 && is_separator(c[word1_end - 1]))
-      word1_end--;
-    size_t word1_start = word1_end;
-    while (word1_start > 0 && !is_separator(c[word1_start - 1]))
-      word1_start--;
+    size_t word1_end = skip_backward(word2_start, true);
+    size_t word1_start = skip_backward(word1_end, false);
 
     if (word1_start >= word2_start || word1_start == word1_end ||
         word2_start == word2_end) {
@@ -1076,11 +1789,10 @@ private:
     std::string word2 = buffer.get_range(word2_start, word2_end);
 
 
-    buffer.delete_range(word1_start, word2_end);
-    buffer.move_gap(word1_start);
-    buffer.insert_string(word2);
-    buffer.insert_string(sep);
-    buffer.insert_string(word1);
+    erase_text(word1_start, word2_end);
+    insert_text(word2);
+    insert_text(sep);
+    insert_text(word1);
 
 
     buffer.move_gap(word1_start + word2.size() + sep.size() + word1.size());
@@ -1094,29 +1806,27 @@ private:
   }
 
   void perform_indent(bool forward) {
-    snapshot_for_undo(buffer.get_content(), buffer.get_cursor());
+    begin_undo_group(buffer.get_cursor());
     if (selection_anchor != std::string::npos) {
       status_message = "Block indent todo";
     } else {
       if (forward) {
         for (int i = 0; i < tab_width; ++i)
-          buffer.insert_char(' ');
+          insert_text(' ');
       } else {
 
-        std::string c = buffer.get_content();
         size_t cur = buffer.get_cursor();
-        size_t line_start = cur;
-        while (line_start > 0 && c[line_start - 1] != '\n')
-          line_start--;
+        size_t line_start = buffer.line_start(buffer.line_of(cur));
 
         size_t spaces = 0;
-        while (line_start + spaces < c.size() &&
-               c[line_start + spaces] == ' ' &&
-               (int)spaces < tab_width)
+        for (TextIt it(buffer, line_start);
+             line_start + spaces < buffer.size() && *it == ' ' &&
+             (int)spaces < tab_width;
+             ++it)
           spaces++;
 
         if (spaces > 0) {
-          buffer.delete_range(line_start, line_start + spaces);
+          erase_text(line_start, line_start + spaces);
           size_t cursor_adj = std::min(spaces, cur - line_start);
           buffer.move_gap(cur - cursor_adj);
           status_message = "Dedented";
@@ -0,0 +1,94 @@
+/*
+ * Event Loop.
+ * epoll over stdin, a signalfd for SIGWINCH and anything else that wants to wake us.
+ * Idle means asleep.
+ */
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <vector>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+namespace honeymoon::driver {
+
+    class EventLoop {
+    public:
+        // Reported by wait() when the terminal was resized.
+        static constexpr uint64_t RESIZE = ~0ull;
+
+        EventLoop() {
+            epfd = epoll_create1(EPOLL_CLOEXEC);
+            // Block SIGWINCH before any thread exists so every thread inherits the mask
+            // and the signal only ever arrives through the signalfd.
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGWINCH);
+            sigprocmask(SIG_BLOCK, &mask, nullptr);
+            int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+            if (sfd >= 0)
+                add(sfd, RESIZE, Kind::Signal);
+        }
+
+        ~EventLoop() {
+            for (const Watch& w : watches)
+                if (w.kind != Kind::Plain)
+                    close(w.fd);
+            if (epfd >= 0)
+                close(epfd);
+        }
+
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator=(const EventLoop&) = delete;
+
+        // Wakes wait() with `token` whenever fd is readable. The caller keeps owning fd.
+        bool watch(int fd, uint64_t token) { return add(fd, token, Kind::Plain); }
+
+        // Blocks until something happens (or timeout_ms passes; -1 waits forever) and
+        // stores up to max tokens. The signal fd is drained here.
+        size_t wait(int timeout_ms, uint64_t* tokens, size_t max) {
+            epoll_event evs[16];
+            int n = epoll_wait(epfd, evs, (int)std::min(max, (size_t)16), timeout_ms);
+            if (n < 0)
+                return 0;
+            for (int i = 0; i < n; ++i) {
+                uint64_t token = evs[i].data.u64;
+                tokens[i] = token;
+                for (const Watch& w : watches) {
+                    if (w.token != token || w.kind == Kind::Plain)
+                        continue;
+                    signalfd_siginfo info;
+                    while (read(w.fd, &info, sizeof(info)) == sizeof(info)) {
+                    }
+                    break;
+                }
+            }
+            return (size_t)n;
+        }
+
+    private:
+        enum class Kind : uint8_t { Plain, Signal };
+        struct Watch {
+            int fd;
+            uint64_t token;
+            Kind kind;
+        };
+
+        int epfd = -1;
+        std::vector<Watch> watches;
+
+        bool add(int fd, uint64_t token, Kind kind) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = token;
+            if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                return false;
+            watches.push_back({fd, token, kind});
+            return true;
+        }
+    };
+
+} // namespace honeymoon::driver
@@ -0,0 +1,523 @@
+/*
+ * File Index.
+ * Every file under the working directory, walked once on all cores and then kept honest
+ * by inotify. A change rescans its directory, not the tree. Saved on the way out, so next
+ * time only the directories that moved get read at all.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fuzzy.hpp"
+#include "walk.hpp"
+
+namespace honeymoon::util {
+
+    class FileIndex {
+    public:
+        static constexpr int DEBOUNCE_MS = 50; // a checkout is one rescan, not thousands
+
+        FileIndex() {
+            wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+        ~FileIndex() {
+            stop();
+            if (wake_fd_ >= 0)
+                close(wake_fd_);
+            if (stop_fd_ >= 0)
+                close(stop_fd_);
+        }
+        FileIndex(const FileIndex&) = delete;
+        FileIndex& operator=(const FileIndex&) = delete;
+
+        // Builds in the background; later calls do nothing. With a cache file, what it held is
+        // published straight away and then checked against the disk.
+        void start(const std::string& root, const std::string& cache = {}) {
+            if (worker_.joinable())
+                return;
+            root_ = root;
+            cache_ = cache;
+            rel_off_ = root_offset(root);
+            worker_ = std::thread([this] { run(); });
+        }
+
+        void stop() {
+            cancel_ = true;
+            uint64_t one = 1;
+            (void)!write(stop_fd_, &one, sizeof(one));
+            if (worker_.joinable())
+                worker_.join();
+        }
+
+        // Readable whenever a new list has been published.
+        int wake_fd() const noexcept { return wake_fd_; }
+        bool ready() const noexcept { return ready_; }
+
+        // The latest list, or null before the first walk finishes.
+        std::shared_ptr<const search::PathList> paths() {
+            uint64_t count;
+            while (read(wake_fd_, &count, sizeof(count)) == sizeof(count)) {
+            }
+            std::lock_guard lock(m_);
+            return list_;
+        }
+
+    private:
+        struct Dir {
+            std::vector<std::string> files;
+            std::vector<std::string> dirs;
+            std::shared_ptr<const IgnoreRules> ignore; // in force below it
+            int64_t mtime_ns = 0;
+            int64_t ignore_mtime_ns = 0;
+            int wd = -1;
+        };
+
+        // The cache: a header, one record per directory in path order, the names in each (files
+        // first, sorted), then every string back to back. A file's path is its directory's path
+        // plus its name, so the directory table is also the prefix table.
+        struct CacheHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t dirs;
+            uint32_t names;
+            uint32_t strings;
+        };
+        struct CacheDir {
+            int64_t mtime_ns;
+            int64_t ignore_mtime_ns;
+            uint32_t path, path_len; // into the strings
+            uint32_t first_name, files, subdirs;
+            uint32_t pad;
+        };
+        struct CacheName {
+            uint32_t offset, length;
+        };
+        // load_cache reads the tables in place from a page-aligned mapping, so each has to start
+        // aligned for its records.
+        static_assert(sizeof(CacheHeader) % alignof(CacheDir) == 0);
+        static_assert(sizeof(CacheDir) % alignof(CacheName) == 0);
+        static constexpr char CACHE_MAGIC[8] = {'H', 'M', 'I', 'N', 'D', 'E', 'X', 0};
+        static constexpr uint32_t CACHE_VERSION = 1;
+
+        static constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE |
+                                               IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+        // Everything below is the worker's alone.
+        void run() {
+            inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            std::map<std::string, Dir> saved;
+            if (load_cache(saved)) {
+                publish(saved);
+                revalidate(saved);
+                if (dirty_)
+                    publish(dirs_);
+            } else {
+                scan(root_, nullptr);
+                dirty_ = true;
+                publish(dirs_);
+            }
+            if (dirty_ && !partial_)
+                save_cache();
+            while (!cancel_) {
+                pollfd fds[2] = {{stop_fd_, POLLIN, 0}, {inotify_fd_, POLLIN, 0}};
+                if (poll(fds, inotify_fd_ >= 0 ? 2 : 1, -1) < 0 || (fds[0].revents & POLLIN))
+                    break;
+                std::set<std::string> changed, rules_changed;
+                bool overflow = false;
+                // Keep reading until it's been quiet for a moment.
+                do {
+                    read_events(changed, rules_changed, overflow);
+                } while (!cancel_ && poll(&fds[1], 1, DEBOUNCE_MS) > 0);
+                if (cancel_)
+                    break;
+                if (overflow) {
+                    drop(root_);
+                    scan(root_, nullptr);
+                } else {
+                    // A new .gitignore can hide or reveal anything below it.
+                    for (const auto& path : rules_changed) {
+                        if (!dirs_.count(path))
+                            continue;
+                        auto parent = parent_ignore(path);
+                        drop(path);
+                        scan(path, parent);
+                    }
+                    for (const auto& path : changed)
+                        if (!rules_changed.count(path))
+                            refresh(path);
+                }
+                dirty_ = true;
+                publish(dirs_);
+            }
+            if (dirty_ && !partial_)
+                save_cache();
+            for (auto& [path, d] : dirs_)
+                if (d.wd >= 0)
+                    inotify_rm_watch(inotify_fd_, d.wd);
+            if (inotify_fd_ >= 0)
+                close(inotify_fd_);
+        }
+
+        void read_events(std::set<std::string>& changed, std::set<std::string>& rules_changed, bool& overflow) {
+            alignas(inotify_event) char buf[16384];
+            ssize_t n;
+            while ((n = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+                for (char* p = buf; p < buf + n;) {
+                    auto* e = reinterpret_cast<inotify_event*>(p);
+                    p += sizeof(inotify_event) + e->len;
+                    if (e->mask & IN_Q_OVERFLOW) {
+                        overflow = true;
+                        continue;
+                    }
+                    auto it = watches_.find(e->wd);
+                    if (it == watches_.end())
+                        continue;
+                    if (e->mask & IN_IGNORED) { // the directory itself went away; its parent says so too
+                        watches_.erase(it);
+                        continue;
+                    }
+                    if (e->len && is_cache(join_path(it->second, e->name)))
+                        continue; // our own save
+                    bool rules = e->len && std::string_view(e->name) == ".gitignore";
+                    if ((e->mask & IN_CLOSE_WRITE) && !rules)
+                        continue; // contents changed, names didn't
+                    (rules ? rules_changed : changed).insert(it->second);
+                }
+            }
+        }
+
+        // Walks `top` in parallel and records every directory under it.
+        void scan(const std::string& top, std::shared_ptr<const IgnoreRules> parent) {
+            std::mutex m;
+            std::vector<std::pair<std::string, Dir>> found;
+            unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+            walk_tree(top, rel_off_, std::move(parent), threads, cancel_, nullptr,
+                      [&](unsigned, const std::string& path, const DirListing& ls) {
+                          Dir d{ls.files, ls.dirs, ls.ignore, ls.mtime_ns, ls.ignore_mtime_ns};
+                          std::lock_guard lock(m);
+                          found.emplace_back(path, std::move(d));
+                      });
+            if (cancel_)
+                partial_ = true;
+            for (auto& [path, d] : found) {
+                watch(path, d);
+                dirs_[path] = std::move(d);
+            }
+        }
+
+        void watch(const std::string& path, Dir& d) {
+            if (inotify_fd_ >= 0 && (d.wd = inotify_add_watch(inotify_fd_, path.c_str(), WATCH_MASK)) >= 0)
+                watches_[d.wd] = path;
+        }
+
+        // Checks the cached tree against the disk, parents before children. A directory whose
+        // mtime hasn't moved has the same entries, so it's taken as saved; one that has is
+        // re-read; a .gitignore that changed means everything below it is walked again.
+        void revalidate(std::map<std::string, Dir>& saved) {
+            auto check = [&](const std::string& path, Dir& d) {
+                auto above = parent_ignore(path);
+                watch(path, d); // before looking, so nothing slips in between
+                struct stat st;
+                if (lstat(path.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+                    unwatch(d);
+                    dirty_ = true;
+                    return;
+                }
+                int64_t mtime = mtime_of(st), ignore_mtime = 0;
+                if (d.ignore_mtime_ns || mtime != d.mtime_ns)
+                    ignore_mtime = stat((path + "/.gitignore").c_str(), &st) == 0 ? mtime_of(st) : 0;
+                if (ignore_mtime != d.ignore_mtime_ns) {
+                    unwatch(d);
+                    scan(path, above);
+                    dirty_ = true;
+                    return;
+                }
+                Dir* now;
+                if (mtime != d.mtime_ns) {
+                    DirListing ls;
+                    if (!list_dir(path, rel_off_, above, ls)) {
+                        unwatch(d);
+                        dirty_ = true;
+                        return;
+                    }
+                    // Saving the cache touches its own directory, so an mtime alone isn't a change.
+                    dirty_ |= !same_entries(path, d.files, ls.files) || !same_entries(path, d.dirs, ls.dirs);
+                    now = &(dirs_[path] = Dir{std::move(ls.files), std::move(ls.dirs), ls.ignore, ls.mtime_ns,
+                                              ls.ignore_mtime_ns, d.wd});
+                } else {
+                    d.ignore = d.ignore_mtime_ns ? IgnoreRules::load(path, rule_base(path, rel_off_), above) : above;
+                    now = &(dirs_[path] = std::move(d));
+                }
+                // New since the save, or never saved because the last walk was cut short.
+                for (const auto& name : now->dirs) {
+                    std::string sub = join_path(path, name);
+                    if (!saved.count(sub)) {
+                        scan(sub, now->ignore);
+                        dirty_ = true;
+                    }
+                }
+            };
+
+            // The root goes first: "-x" sorts before ".".
+            check(root_, saved[root_]);
+            for (auto& [path, d] : saved) {
+                if (cancel_) {
+                    partial_ = true;
+                    return;
+                }
+                if (path == root_ || dirs_.count(path))
+                    continue;
+                // Still there only if its parent came through and still lists it.
+                size_t slash = path.rfind('/');
+                auto parent = dirs_.find(slash == path.npos ? "." : path.substr(0, slash));
+                std::string_view name = std::string_view(path).substr(slash == path.npos ? 0 : slash + 1);
+                if (parent != dirs_.end() &&
+                    std::find(parent->second.dirs.begin(), parent->second.dirs.end(), name) != parent->second.dirs.end())
+                    check(path, d);
+            }
+        }
+
+        // False if there's no cache, it's for another root, or it doesn't add up.
+        bool load_cache(std::map<std::string, Dir>& out) {
+            if (cache_.empty())
+                return false;
+            int fd = open(cache_.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+                close(fd);
+                return false;
+            }
+            size_t size = st.st_size;
+            void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED)
+                return false;
+            const char* base = static_cast<const char*>(addr);
+            CacheHeader h;
+            std::memcpy(&h, base, sizeof(h));
+            size_t dirs_at = sizeof(CacheHeader);
+            size_t names_at = dirs_at + size_t(h.dirs) * sizeof(CacheDir);
+            size_t strings_at = names_at + size_t(h.names) * sizeof(CacheName);
+            bool ok = std::memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) == 0 && h.version == CACHE_VERSION &&
+                      strings_at + h.strings == size;
+            const auto* dirs = reinterpret_cast<const CacheDir*>(base + dirs_at);
+            const auto* names = reinterpret_cast<const CacheName*>(base + names_at);
+            std::string_view strings(base + strings_at, ok ? h.strings : 0);
+            auto str = [&](uint32_t offset, uint32_t length) -> std::string_view {
+                if (offset > strings.size() || length > strings.size() - offset) {
+                    ok = false;
+                    return {};
+                }
+                return strings.substr(offset, length);
+            };
+            for (uint32_t i = 0; ok && i < h.dirs; ++i) {
+                const CacheDir& c = dirs[i];
+                if (uint64_t(c.first_name) + c.files + c.subdirs > h.names) {
+                    ok = false;
+                    break;
+                }
+                Dir& d = out[std::string(str(c.path, c.path_len))];
+                d.mtime_ns = c.mtime_ns;
+                d.ignore_mtime_ns = c.ignore_mtime_ns;
+                d.files.reserve(c.files);
+                d.dirs.reserve(c.subdirs);
+                for (uint32_t k = 0; k < c.files + c.subdirs; ++k) {
+                    const CacheName& n = names[c.first_name + k];
+                    (k < c.files ? d.files : d.dirs).emplace_back(str(n.offset, n.length));
+                }
+            }
+            munmap(addr, size);
+            if (!ok || !out.count(root_)) {
+                out.clear();
+                return false;
+            }
+            return true;
+        }
+
+        bool same_entries(const std::string& dir, std::vector<std::string> a, std::vector<std::string> b) const {
+            for (auto* names : {&a, &b}) {
+                std::erase_if(*names, [&](const std::string& name) { return is_cache(join_path(dir, name)); });
+                std::sort(names->begin(), names->end());
+            }
+            return a == b;
+        }
+
+        bool is_cache(std::string_view path) const {
+            return !cache_.empty() && path.starts_with(cache_) && (path.size() == cache_.size() || path.substr(cache_.size()) == ".tmp");
+        }
+
+        // Written beside the old one and renamed over it, so a crash leaves one or the other.
+        void save_cache() {
+            dirty_ = false;
+            if (cache_.empty())
+                return;
+            std::vector<CacheDir> dirs;
+            std::vector<CacheName> names;
+            std::string strings;
+            std::vector<std::string_view> sorted;
+            auto add = [&](std::string_view s) {
+                uint32_t at = strings.size();
+                strings.append(s);
+                return CacheName{at, (uint32_t)s.size()};
+            };
+            dirs.reserve(dirs_.size());
+            for (const auto& [path, d] : dirs_) {
+                CacheName p = add(path);
+                dirs.push_back({d.mtime_ns, d.ignore_mtime_ns, p.offset, p.length, (uint32_t)names.size(),
+                                (uint32_t)d.files.size(), (uint32_t)d.dirs.size(), 0});
+                for (const auto* list : {&d.files, &d.dirs}) {
+                    sorted.assign(list->begin(), list->end());
+                    std::sort(sorted.begin(), sorted.end());
+                    for (std::string_view name : sorted)
+                        names.push_back(add(name));
+                }
+            }
+            CacheHeader h;
+            std::memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+            h.version = CACHE_VERSION;
+            h.dirs = dirs.size();
+            h.names = names.size();
+            h.strings = strings.size();
+
+            std::string tmp = cache_ + ".tmp";
+            int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+                return;
+            auto put = [&](const void* p, size_t n) {
+                for (const char* c = static_cast<const char*>(p); n > 0;) {
+                    ssize_t w = write(fd, c, n);
+                    if (w <= 0)
+                        return false;
+                    c += w;
+                    n -= w;
+                }
+                return true;
+            };
+            bool ok = put(&h, sizeof(h)) && put(dirs.data(), dirs.size() * sizeof(CacheDir)) &&
+                      put(names.data(), names.size() * sizeof(CacheName)) && put(strings.data(), strings.size());
+            close(fd);
+            if (!ok || rename(tmp.c_str(), cache_.c_str()) < 0)
+                unlink(tmp.c_str());
+        }
+
+        // Re-reads one directory: new subdirectories get walked, vanished ones dropped.
+        void refresh(const std::string& path) {
+            auto it = dirs_.find(path);
+            if (it == dirs_.end())
+                return;
+            DirListing ls;
+            if (!list_dir(path, rel_off_, parent_ignore(path), ls)) {
+                drop(path);
+                return;
+            }
+            std::set<std::string> before(it->second.dirs.begin(), it->second.dirs.end());
+            it->second.files = std::move(ls.files);
+            it->second.dirs = ls.dirs;
+            it->second.mtime_ns = ls.mtime_ns;
+            it->second.ignore_mtime_ns = ls.ignore_mtime_ns;
+            for (const auto& name : ls.dirs)
+                if (!before.erase(name))
+                    scan(join_path(path, name), ls.ignore);
+            for (const auto& name : before)
+                drop(join_path(path, name));
+        }
+
+        // Forgets path and everything below it.
+        void drop(const std::string& path) {
+            if (path == ".") {
+                for (auto& [p, d] : dirs_)
+                    unwatch(d);
+                dirs_.clear();
+                return;
+            }
+            if (auto it = dirs_.find(path); it != dirs_.end()) {
+                unwatch(it->second);
+                dirs_.erase(it);
+            }
+            std::string prefix = path + "/";
+            for (auto it = dirs_.lower_bound(prefix); it != dirs_.end() && it->first.starts_with(prefix);) {
+                unwatch(it->second);
+                it = dirs_.erase(it);
+            }
+        }
+
+        void unwatch(Dir& d) {
+            if (d.wd < 0)
+                return;
+            inotify_rm_watch(inotify_fd_, d.wd);
+            watches_.erase(d.wd);
+            d.wd = -1;
+        }
+
+        std::shared_ptr<const IgnoreRules> parent_ignore(const std::string& path) const {
+            if (path == root_)
+                return nullptr;
+            size_t slash = path.rfind('/');
+            auto it = dirs_.find(slash == path.npos ? "." : path.substr(0, slash));
+            return it == dirs_.end() ? nullptr : it->second.ignore;
+        }
+
+        void publish(const std::map<std::string, Dir>& dirs) {
+            size_t count = 0, bytes = 0;
+            for (const auto& [path, d] : dirs) {
+                count += d.files.size();
+                for (const auto& f : d.files)
+                    bytes += path.size() + 1 + f.size();
+            }
+            auto list = std::make_shared<search::PathList>();
+            list->reserve(count, bytes);
+            std::string full;
+            for (const auto& [path, d] : dirs) {
+                for (const auto& f : d.files) {
+                    full = join_path(path, f);
+                    if (!is_cache(full))
+                        list->add(full);
+                }
+            }
+            list->seal();
+            {
+                std::lock_guard lock(m_);
+                list_ = std::move(list);
+            }
+            ready_ = true;
+            uint64_t one = 1;
+            (void)!write(wake_fd_, &one, sizeof(one));
+        }
+
+        std::string root_ = ".";
+        std::string cache_;
+        size_t rel_off_ = 0;
+        bool dirty_ = false;   // changed since the cache was written
+        bool partial_ = false; // a walk was cut short, so there's nothing worth saving
+        std::map<std::string, Dir> dirs_;
+        std::unordered_map<int, std::string> watches_;
+        int inotify_fd_ = -1;
+
+        std::thread worker_;
+        std::atomic<bool> cancel_{false};
+        std::atomic<bool> ready_{false};
+        int wake_fd_ = -1;
+        int stop_fd_ = -1;
+        std::mutex m_;
+        std::shared_ptr<const search::PathList> list_;
+    };
+
+} // namespace honeymoon::util
@@ -0,0 +1,282 @@
+/*
+ * Fuzzy Matching.
+ * "edhpp" finds src/editor.hpp. A 64-bit mask of which characters a path contains throws
+ * out most candidates before anything looks at a byte, and each key typed only rescans
+ * what matched the key before it.
+ */
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+namespace honeymoon::search {
+
+    // Paths packed end to end, with a lowercased copy and a character mask for each.
+    class PathList {
+    public:
+        void reserve(size_t paths, size_t bytes) {
+            starts_.reserve(paths + 1);
+            masks_.reserve(paths);
+            text_.reserve(bytes);
+            lower_.reserve(bytes);
+        }
+
+        void add(std::string_view path) {
+            text_.append(path);
+            for (char c : path)
+                lower_.push_back(fold(c));
+            starts_.push_back(text_.size());
+            masks_.push_back(mask_of(std::string_view(lower_).substr(lower_.size() - path.size())));
+        }
+
+        // Pads the end so every path has WIDE readable bytes behind its start. Call once, after the last add().
+        void seal() {
+            sealed_ = text_.size();
+            text_.append(WIDE, '\0');
+            lower_.append(WIDE, '\0');
+        }
+
+        static constexpr size_t WIDE = 64;
+
+        size_t size() const { return masks_.size(); }
+        bool wide(size_t i) const { return starts_[i] + WIDE <= lower_.size() && starts_[i + 1] - starts_[i] <= WIDE; }
+        size_t bytes() const { return sealed_ ? sealed_ : text_.size(); }
+        std::string_view path(size_t i) const { return std::string_view(text_).substr(starts_[i], starts_[i + 1] - starts_[i]); }
+        std::string_view lower(size_t i) const { return std::string_view(lower_).substr(starts_[i], starts_[i + 1] - starts_[i]); }
+        const uint64_t* masks() const { return masks_.data(); }
+
+        static char fold(char c) { return c >= 'A' && c <= 'Z' ? c + 32 : c; }
+
+        // Letters and digits get a bit each; everything else shares the rest by value.
+        static uint64_t mask_of(std::string_view lower) {
+            uint64_t m = 0;
+            for (unsigned char c : lower)
+                m |= uint64_t(1) << bit_of(c);
+            return m;
+        }
+
+    private:
+        std::string text_;
+        std::string lower_;
+        std::vector<uint32_t> starts_{0};
+        std::vector<uint64_t> masks_;
+        size_t sealed_ = 0;
+
+        static unsigned bit_of(unsigned char c) {
+            if (c >= 'a' && c <= 'z')
+                return c - 'a';
+            if (c >= '0' && c <= '9')
+                return 26 + (c - '0');
+            return 36 + c % 28;
+        }
+    };
+
+    struct FuzzyHit {
+        uint32_t index; // into the PathList
+        int32_t score;
+    };
+
+    class FuzzyMatcher {
+    public:
+        static constexpr int NO_MATCH = INT32_MIN;
+
+        // The best `limit` paths for the query, best first. If the list is the one matched last
+        // time and the query only grew, just the previous matches are looked at again.
+        const std::vector<FuzzyHit>& match(const std::shared_ptr<const PathList>& list, std::string_view query, size_t limit) {
+            std::string q;
+            for (char c : query)
+                if (c != ' ')
+                    q.push_back(PathList::fold(c));
+            top_.clear();
+            if (!list) {
+                reset();
+                return top_;
+            }
+            bool narrowing = list == list_ && !query_.empty() && q.starts_with(query_);
+            list_ = list;
+            query_ = q;
+            if (q.empty()) {
+                reset();
+                matched_ = list->size();
+                for (size_t i = 0; i < std::min(limit, list->size()); ++i)
+                    top_.push_back({(uint32_t)i, 0});
+                return top_;
+            }
+
+            uint64_t qm = PathList::mask_of(q);
+            const uint64_t* masks = list->masks();
+            scored_.clear();
+            auto consider = [&](uint32_t i) {
+                if ((masks[i] & qm) != qm)
+                    return;
+                int s = list->wide(i) ? score_wide(list->path(i), list->lower(i), q) : score(list->path(i), list->lower(i), q);
+                if (s != NO_MATCH)
+                    scored_.push_back({i, s});
+            };
+            if (narrowing) {
+                for (uint32_t i : cands_)
+                    consider(i);
+            } else {
+                for (uint32_t i = 0, n = (uint32_t)list->size(); i < n; ++i)
+                    consider(i);
+            }
+            cands_.clear();
+            for (const FuzzyHit& h : scored_)
+                cands_.push_back(h.index);
+            matched_ = scored_.size();
+
+            auto better = [&](const FuzzyHit& a, const FuzzyHit& b) {
+                if (a.score != b.score)
+                    return a.score > b.score;
+                size_t la = list->path(a.index).size(), lb = list->path(b.index).size();
+                return la != lb ? la < lb : a.index < b.index;
+            };
+            size_t k = std::min(limit, scored_.size());
+            std::partial_sort(scored_.begin(), scored_.begin() + k, scored_.end(), better);
+            top_.assign(scored_.begin(), scored_.begin() + k);
+            return top_;
+        }
+
+        size_t matched() const noexcept { return matched_; }
+
+        void reset() {
+            list_.reset();
+            query_.clear();
+            cands_.clear();
+            matched_ = 0;
+        }
+
+        // fzf's v1 scheme: the leftmost match, then shrunk from its end to the shortest window,
+        // scored on word boundaries, runs and gaps. NO_MATCH if q isn't a subsequence.
+        static int score(std::string_view path, std::string_view lower, std::string_view q) {
+            size_t pos = 0;
+            for (char c : q) {
+                const void* hit = pos < lower.size() ? std::memchr(lower.data() + pos, c, lower.size() - pos) : nullptr;
+                if (!hit)
+                    return NO_MATCH;
+                pos = static_cast<const char*>(hit) - lower.data() + 1;
+            }
+            size_t last = pos - 1, start = pos;
+            for (size_t j = q.size(); j > 0;)
+                if (lower[--start] == q[j - 1])
+                    --j;
+
+            int s = 0, run = 0;
+            bool gap = false;
+            size_t qi = 0;
+            for (size_t i = start; i <= last; ++i) {
+                if (qi < q.size() && lower[i] == q[qi]) {
+                    int b = bonus_at(path, i);
+                    s += SCORE_MATCH + (qi == 0 ? b * 2 : b) + run * BONUS_RUN;
+                    run++;
+                    qi++;
+                    gap = false;
+                } else {
+                    s -= gap ? PENALTY_GAP_EXTEND : PENALTY_GAP_START;
+                    run = 0;
+                    gap = true;
+                }
+            }
+            size_t slash = path.rfind('/');
+            if (slash == path.npos || start > slash)
+                s += BONUS_BASENAME;
+            return s;
+        }
+
+        // The same score, a bit per byte of the path: where each query character occurs is one
+        // compare per 16 bytes, and finding the next one is a count of trailing zeros. Paths up
+        // to 64 bytes, with 64 readable bytes behind `lower`.
+        static int score_wide(std::string_view path, std::string_view lower, std::string_view q) {
+#if defined(__x86_64__)
+            if (q.size() > MAX_WIDE_QUERY)
+                return score(path, lower, q);
+            __m128i lo[4];
+            for (int k = 0; k < 4; ++k)
+                lo[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lower.data() + 16 * k));
+            size_t n = lower.size();
+            uint64_t valid = n == 64 ? ~0ull : (1ull << n) - 1;
+            auto eq = [&](char c) {
+                __m128i b = _mm_set1_epi8(c);
+                uint64_t m = 0;
+                for (int k = 0; k < 4; ++k)
+                    m |= uint64_t((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(lo[k], b))) << (16 * k);
+                return m & valid;
+            };
+            auto above = [](int p) { return p >= 63 ? 0 : ~0ull << (p + 1); };
+
+            uint64_t occ[MAX_WIDE_QUERY];
+            int p = -1;
+            for (size_t i = 0; i < q.size(); ++i) {
+                occ[i] = eq(q[i]);
+                uint64_t c = occ[i] & above(p);
+                if (!c)
+                    return NO_MATCH;
+                p = __builtin_ctzll(c);
+            }
+            int start = p + 1; // up to 64, when the last character is the last byte
+            for (size_t j = q.size(); j-- > 0;)
+                start = 63 - __builtin_clzll(occ[j] & (start >= 64 ? ~0ull : (1ull << start) - 1));
+
+            // Bonuses are only ever read where a character matched, so they're looked up there.
+            int s = 0, run = 0;
+            p = start - 1;
+            for (size_t i = 0; i < q.size(); ++i) {
+                int at = __builtin_ctzll(occ[i] & above(p));
+                if (i > 0 && at > p + 1) {
+                    s -= PENALTY_GAP_START + (at - p - 2) * PENALTY_GAP_EXTEND;
+                    run = 0;
+                }
+                int b = bonus_at(path, at);
+                s += SCORE_MATCH + (i == 0 ? b * 2 : b) + run * BONUS_RUN;
+                run++;
+                p = at;
+            }
+            uint64_t slashes = eq('/');
+            if (!slashes || start > 63 - __builtin_clzll(slashes))
+                s += BONUS_BASENAME;
+            return s;
+#else
+            return score(path, lower, q);
+#endif
+        }
+
+    private:
+        static constexpr size_t MAX_WIDE_QUERY = 32;
+        static constexpr int SCORE_MATCH = 16;
+        static constexpr int BONUS_BOUNDARY = 8;
+        static constexpr int BONUS_SLASH = 10;
+        static constexpr int BONUS_CAMEL = 7;
+        static constexpr int BONUS_RUN = 4;
+        static constexpr int BONUS_BASENAME = 12;
+        static constexpr int PENALTY_GAP_START = 3;
+        static constexpr int PENALTY_GAP_EXTEND = 1;
+
+        static int bonus_at(std::string_view path, size_t i) {
+            if (i == 0)
+                return BONUS_SLASH;
+            char p = path[i - 1], c = path[i];
+            if (p == '/')
+                return BONUS_SLASH;
+            if (p == '_' || p == '-' || p == '.' || p == ' ')
+                return BONUS_BOUNDARY;
+            if (p >= 'a' && p <= 'z' && c >= 'A' && c <= 'Z')
+                return BONUS_CAMEL;
+            return 0;
+        }
+
+        std::shared_ptr<const PathList> list_;
+        std::string query_;
+        std::vector<uint32_t> cands_; // everything the last query matched
+        std::vector<FuzzyHit> scored_;
+        std::vector<FuzzyHit> top_;
+        size_t matched_ = 0;
+    };
+
+} // namespace honeymoon::search
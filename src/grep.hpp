@@ -0,0 +1,232 @@
+/*
+ * Project Grep.
+ * Every file under the working directory, mmapped and searched on every core.
+ * Hits trickle back to the editor while the rest of the tree is still being read.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "regex.hpp"
+#include "search.hpp"
+#include "walk.hpp"
+
+namespace honeymoon::search {
+
+    struct GrepHit {
+        std::string path;
+        size_t line;   // 1-based
+        size_t column; // 0-based byte offset into the line
+        std::string text; // the line, tabs and control bytes turned into spaces, cut at MAX_LINE
+    };
+
+    struct GrepStats {
+        size_t files = 0;   // searched
+        size_t binary = 0;  // skipped
+        size_t bytes = 0;
+        size_t hits = 0;
+        double first_ms = -1; // until the first hit reached the editor's queue
+        double total_ms = 0;
+        bool done = false;
+        bool truncated = false; // stopped at MAX_HITS
+    };
+
+    class ProjectGrep {
+    public:
+        static constexpr size_t MAX_HITS = 100000;
+        static constexpr size_t MAX_LINE = 256;
+        static constexpr size_t BINARY_PROBE = 8000; // git looks this far for a NUL, so do we
+
+        ProjectGrep() { wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); }
+        ~ProjectGrep() {
+            stop();
+            if (wake_fd_ >= 0)
+                close(wake_fd_);
+        }
+        ProjectGrep(const ProjectGrep&) = delete;
+        ProjectGrep& operator=(const ProjectGrep&) = delete;
+
+        // Readable whenever new hits are queued or the search has finished.
+        int wake_fd() const noexcept { return wake_fd_; }
+        const std::string& error() const noexcept { return regex_.error(); }
+
+        // Cancels whatever was running. False if the regexp doesn't compile.
+        bool start(const std::string& root, std::string_view query, bool regex) {
+            stop();
+            needle_.assign(query);
+            use_regex_ = regex;
+            if (regex && !regex_.compile(query))
+                return false;
+            {
+                std::lock_guard lock(m_);
+                queue_.clear();
+                stats_ = GrepStats{};
+            }
+            files_ = binary_ = bytes_ = hits_ = 0;
+            first_ms_ = -1;
+            cancel_ = false;
+            running_ = true;
+            started_ = Clock::now();
+            worker_ = std::thread([this, root] { run(root); });
+            return true;
+        }
+
+        void stop() {
+            cancel_ = true;
+            if (worker_.joinable())
+                worker_.join();
+            running_ = false;
+        }
+
+        bool running() const noexcept { return running_; }
+
+        // Moves the hits found since the last call to the end of `out`.
+        GrepStats take(std::vector<GrepHit>& out) {
+            uint64_t count;
+            while (read(wake_fd_, &count, sizeof(count)) == sizeof(count)) {
+            }
+            std::lock_guard lock(m_);
+            std::move(queue_.begin(), queue_.end(), std::back_inserter(out));
+            queue_.clear();
+            GrepStats s = stats_;
+            if (!s.done) {
+                s.files = files_.load(std::memory_order_relaxed);
+                s.binary = binary_.load(std::memory_order_relaxed);
+                s.bytes = bytes_.load(std::memory_order_relaxed);
+                s.hits = hits_.load(std::memory_order_relaxed);
+                s.first_ms = first_ms_.load(std::memory_order_relaxed);
+                s.total_ms = ms_since(started_);
+            }
+            return s;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        // What the regexp engine needs to read a mapped file.
+        struct TextView {
+            std::string_view text;
+            size_t size() const { return text.size(); }
+            std::string_view chunk_at(size_t pos) const { return pos < text.size() ? text.substr(pos) : std::string_view(); }
+        };
+
+        static double ms_since(Clock::time_point t) {
+            return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+        }
+
+        void run(const std::string& root) {
+            unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+            // The DFA caches are filled as they're used, so each worker gets its own copy.
+            std::vector<Regex> regexes(use_regex_ ? threads : 0, regex_);
+            util::walk(root, threads, cancel_, [&](unsigned me, const std::string& path) {
+                std::vector<GrepHit> hits;
+                grep_file(path, use_regex_ ? &regexes[me] : nullptr, hits);
+                if (hits.empty())
+                    return;
+                size_t total = hits_.fetch_add(hits.size(), std::memory_order_relaxed) + hits.size();
+                {
+                    std::lock_guard lock(m_);
+                    if (first_ms_.load(std::memory_order_relaxed) < 0)
+                        first_ms_.store(ms_since(started_), std::memory_order_relaxed);
+                    std::move(hits.begin(), hits.end(), std::back_inserter(queue_));
+                }
+                if (total >= MAX_HITS)
+                    cancel_ = true;
+                wake();
+            });
+            std::lock_guard lock(m_);
+            stats_ = {files_.load(), binary_.load(), bytes_.load(), hits_.load(),
+                      first_ms_.load(), ms_since(started_), true, hits_.load() >= MAX_HITS};
+            running_ = false;
+            wake();
+        }
+
+        void wake() {
+            uint64_t one = 1;
+            (void)!write(wake_fd_, &one, sizeof(one));
+        }
+
+        void grep_file(const std::string& path, Regex* re, std::vector<GrepHit>& out) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return;
+            struct stat st;
+            if (fstat(fd, &st) < 0 || st.st_size == 0) {
+                close(fd);
+                return;
+            }
+            size_t size = st.st_size;
+            void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED)
+                return;
+            madvise(addr, size, MADV_SEQUENTIAL);
+            std::string_view text(static_cast<const char*>(addr), size);
+            if (std::memchr(text.data(), 0, std::min(size, BINARY_PROBE))) {
+                binary_.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                scan_text(path, text, re, out);
+                files_.fetch_add(1, std::memory_order_relaxed);
+                bytes_.fetch_add(size, std::memory_order_relaxed);
+            }
+            munmap(addr, size);
+        }
+
+        // One hit per matching line; the search resumes at the next line.
+        void scan_text(const std::string& path, std::string_view text, Regex* re, std::vector<GrepHit>& out) {
+            TextView view{text};
+            size_t pos = 0, line = 1, counted = 0; // `line` is the line `counted` is on
+            while (pos < text.size() && !cancel_.load(std::memory_order_relaxed)) {
+                size_t at;
+                if (re) {
+                    at = re->search_forward(view, pos).start;
+                } else {
+                    at = find_in(text.substr(pos), needle_);
+                    if (at != npos)
+                        at += pos;
+                }
+                if (at == npos || at >= text.size())
+                    return;
+                line += std::count(text.begin() + counted, text.begin() + at, '\n');
+                counted = at;
+                size_t start = at == 0 ? npos : text.rfind('\n', at - 1);
+                start = start == npos ? 0 : start + 1;
+                size_t end = text.find('\n', at);
+                if (end == npos)
+                    end = text.size();
+                GrepHit& h = out.emplace_back(GrepHit{path, line, at - start, std::string(text.substr(start, std::min(end - start, MAX_LINE)))});
+                for (char& c : h.text)
+                    if ((unsigned char)c < 0x20 || c == 0x7f)
+                        c = ' ';
+                pos = end + 1;
+            }
+        }
+
+        std::thread worker_;
+        std::atomic<bool> cancel_{false};
+        std::atomic<bool> running_{false};
+        std::string needle_;
+        bool use_regex_ = false;
+        Regex regex_;
+        int wake_fd_ = -1;
+
+        std::mutex m_;
+        std::vector<GrepHit> queue_; // found, not yet taken
+        GrepStats stats_;            // final, once done
+        Clock::time_point started_;
+        std::atomic<size_t> files_{0}, binary_{0}, bytes_{0}, hits_{0};
+        std::atomic<double> first_ms_{-1};
+    };
+
+} // namespace honeymoon::search
@@ -9,7 +9,7 @@
 #include <string_view>
 
 enum class Key : int {
-  None = -999,
+  None = -2000, // clear of the special keys below (ArrowRight used to land on it)
   Null = 0,
   Ctrl_Space = 0,
   Ctrl_2 = 0,
@@ -53,6 +53,15 @@ enum class Key : int {
   End,
   PageUp,
   PageDown,
+  Insert,
+  CtrlLeft,
+  CtrlRight,
+  CtrlUp,
+  CtrlDown,
+  CtrlHome,
+  CtrlEnd,
+  CtrlDel,
+  Paste, // bracketed paste; the text comes from TerminalDevice::take_paste
   ShiftTab = -1001
 };
 
@@ -85,6 +94,22 @@ inline std::string to_string(Key k) {
     return "PageUp";
   case Key::PageDown:
     return "PageDown";
+  case Key::Insert:
+    return "Insert";
+  case Key::CtrlLeft:
+    return "C-Left";
+  case Key::CtrlRight:
+    return "C-Right";
+  case Key::CtrlUp:
+    return "C-Up";
+  case Key::CtrlDown:
+    return "C-Down";
+  case Key::CtrlHome:
+    return "C-Home";
+  case Key::CtrlEnd:
+    return "C-End";
+  case Key::CtrlDel:
+    return "C-Del";
   case Key::Enter:
     return "Enter";
   case Key::Tab:
@@ -175,6 +200,22 @@ inline Key key_from_string(std::string_view s) {
     return Key::PageUp;
   if (s == "PageDown")
     return Key::PageDown;
+  if (s == "Insert")
+    return Key::Insert;
+  if (s == "C-Left")
+    return Key::CtrlLeft;
+  if (s == "C-Right")
+    return Key::CtrlRight;
+  if (s == "C-Up")
+    return Key::CtrlUp;
+  if (s == "C-Down")
+    return Key::CtrlDown;
+  if (s == "C-Home")
+    return Key::CtrlHome;
+  if (s == "C-End")
+    return Key::CtrlEnd;
+  if (s == "C-Del")
+    return Key::CtrlDel;
   if (s == "Enter")
     return Key::Enter;
   if (s == "Tab")
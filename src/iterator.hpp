@@ -0,0 +1,66 @@
+/*
+ * Text Iterator.
+ * Walks the buffer one character at a time without ever asking for a copy of it.
+ * Holds one contiguous run at a time and only goes back to the buffer at the run edges.
+ */
+#pragma once
+#include <cstddef>
+#include <iterator>
+#include <string_view>
+
+namespace honeymoon::mem {
+
+    template <typename Buf>
+    class TextIterator {
+    public:
+        using CharT = typename Buf::value_type;
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = CharT;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const CharT *;
+        using reference = CharT;
+
+        TextIterator() = default;
+        TextIterator(const Buf& b, size_t pos) : buf(&b), pos(pos) { load_forward(); }
+
+        CharT operator*() const { return *cur; }
+        size_t position() const { return pos; }
+
+        TextIterator& operator++() {
+            ++pos;
+            if (++cur == end)
+                load_forward();
+            return *this;
+        }
+
+        TextIterator& operator--() {
+            if (cur == begin) {
+                std::basic_string_view<CharT> run = buf->chunk_before(pos);
+                begin = run.data();
+                end = cur = run.data() + run.size();
+            }
+            --cur;
+            --pos;
+            return *this;
+        }
+
+        TextIterator operator++(int) { TextIterator t = *this; ++*this; return t; }
+        TextIterator operator--(int) { TextIterator t = *this; --*this; return t; }
+
+        bool operator==(const TextIterator& o) const { return pos == o.pos; }
+
+    private:
+        const Buf* buf = nullptr;
+        size_t pos = 0;
+        const CharT* begin = nullptr;
+        const CharT* cur = nullptr;
+        const CharT* end = nullptr;
+
+        void load_forward() {
+            std::basic_string_view<CharT> run = buf->chunk_at(pos);
+            begin = cur = run.data();
+            end = run.data() + run.size();
+        }
+    };
+
+} // namespace honeymoon::mem
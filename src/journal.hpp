@@ -0,0 +1,420 @@
+/*
+ * Edit Journal.
+ * Every insert and erase since the last save, appended to .name.hmj beside the file, so a
+ * crash or a dropped ssh session costs half a second of typing instead of the afternoon.
+ * The editor only appends to a string; a thread of its own does the writes and the fsyncs.
+ */
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "save.hpp"
+
+namespace honeymoon::mem {
+
+    // src/editor.hpp journals to src/.editor.hpp.hmj.
+    inline std::string journal_path(const std::string& path) {
+        size_t name = path.rfind('/') + 1; // npos + 1 is 0
+        return path.substr(0, name) + "." + path.substr(name) + ".hmj";
+    }
+
+    // On disk: a header naming the file the edits apply to, then records, each
+    //   u32 checksum | u8 op | u64 pos | u64 len | len bytes of text, for an insert
+    // with the checksum over everything after it. A torn or garbled record ends the journal.
+    namespace journal_format {
+        constexpr char MAGIC[8] = {'H', 'M', 'J', 'R', 'N', 'L', '0', '1'};
+        constexpr size_t HEADER = sizeof(MAGIC) + 4 * sizeof(int64_t);
+        constexpr size_t RECORD = 4 + 1 + 2 * sizeof(uint64_t);
+        constexpr uint8_t INSERT = 'i';
+        constexpr uint8_t ERASE = 'e';
+
+        inline uint32_t checksum(const char* p, size_t n) { // FNV-1a
+            uint32_t h = 2166136261u;
+            for (size_t i = 0; i < n; ++i)
+                h = (h ^ (unsigned char)p[i]) * 16777619u;
+            return h;
+        }
+
+        inline std::string header(const FileStamp& base) {
+            int64_t v[4] = {(int64_t)base.dev, (int64_t)base.ino, base.size, base.mtime_ns};
+            std::string h(MAGIC, sizeof(MAGIC));
+            h.append(reinterpret_cast<const char*>(v), sizeof(v));
+            return h;
+        }
+
+        inline size_t body_of(const char* record) {
+            uint64_t len;
+            memcpy(&len, record + 13, sizeof(len));
+            return record[4] == (char)INSERT ? len : 0;
+        }
+    } // namespace journal_format
+
+    struct JournalRecord {
+        bool insert;
+        size_t pos;
+        size_t len;
+        std::string text; // inserts only
+        size_t end;       // where the next record starts, counted from the first
+    };
+
+    // What a journal left behind: the file it was written against and the records that made
+    // it to disk whole.
+    struct JournalFile {
+        FileStamp base;
+        std::vector<JournalRecord> records;
+    };
+
+    // False if there's no journal at path, or it isn't one.
+    inline bool read_journal(const std::string& path, JournalFile& out) {
+        using namespace journal_format;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        std::string data;
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            data.append(buf, n);
+        close(fd);
+        if (data.size() < HEADER || memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0)
+            return false;
+        int64_t v[4];
+        memcpy(v, data.data() + sizeof(MAGIC), sizeof(v));
+        out.base = {(dev_t)v[0], (ino_t)v[1], v[2], v[3]};
+        out.records.clear();
+        for (size_t at = HEADER; data.size() - at >= RECORD;) {
+            const char* p = data.data() + at;
+            uint32_t sum;
+            uint64_t pos, len;
+            memcpy(&sum, p, 4);
+            memcpy(&pos, p + 5, 8);
+            memcpy(&len, p + 13, 8);
+            if (p[4] != (char)INSERT && p[4] != (char)ERASE)
+                break;
+            size_t body = body_of(p);
+            if (body > data.size() - at - RECORD || checksum(p + 4, RECORD - 4 + body) != sum)
+                break;
+            at += RECORD + body;
+            out.records.push_back({p[4] == (char)INSERT, pos, len, std::string(p + RECORD, body), at - HEADER});
+        }
+        return true;
+    }
+
+    // Appends a buffer's edits to its journal from a thread of its own. Keystrokes that come
+    // within SYNC_MS of each other share one write and one fdatasync. Once a save is on disk,
+    // the journal keeps only what came after it, and goes away if that's nothing.
+    class Journal {
+    public:
+        static constexpr int SYNC_MS = 500;          // the most typing a crash can take with it
+        static constexpr size_t BATCH_MAX = 4 << 20; // written straight away past this
+
+        Journal() = default;
+        ~Journal() {
+            {
+                std::lock_guard lock(m_);
+                stop_ = true;
+            }
+            wake_.notify_one();
+            if (worker_.joinable())
+                worker_.join();
+        }
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+
+        // Journals the edits to path from here on, against the file `base` describes. A journal
+        // already there is thrown away, unless `keep` says how many bytes of its records were
+        // replayed into the buffer; those stay, and the new ones go after them.
+        void start(const std::string& path, const FileStamp& base, size_t keep = 0) {
+            if (!worker_.joinable())
+                worker_ = std::thread([this] { run(); });
+            post({Op::START, journal_path(path), base, posted_, keep});
+            posted_ += keep;
+            active_ = true;
+        }
+
+        // Stops journaling. What's there stays for the next open to find.
+        void close() {
+            if (active_)
+                post({Op::CLOSE});
+            active_ = false;
+        }
+
+        // Stops journaling and deletes the journal: the edits in it were thrown away on purpose.
+        void discard() {
+            if (active_)
+                post({Op::DISCARD});
+            active_ = false;
+        }
+
+        void inserted(size_t pos, const char* s, size_t n) {
+            if (active_ && n)
+                append(journal_format::INSERT, pos, n, s);
+        }
+        void erased(size_t pos, size_t n) {
+            if (active_ && n)
+                append(journal_format::ERASE, pos, n, nullptr);
+        }
+
+        // Where the journal has got to. Hand it to saved() once the text as it is now is on disk.
+        uint64_t mark() {
+            std::lock_guard lock(m_);
+            run_ = NO_RUN; // a record mustn't straddle it
+            return posted_;
+        }
+
+        // Everything before `at` is in the file `stamp` describes; only what came after is kept.
+        void saved(uint64_t at, const FileStamp& stamp) {
+            if (active_)
+                post({Op::SAVED, {}, stamp, at});
+        }
+
+    private:
+        struct Op {
+            enum Kind : uint8_t { RECORDS, START, CLOSE, DISCARD, SAVED } kind;
+            std::string bytes = {}; // RECORDS: the records; START: the journal's path
+            FileStamp stamp = {};   // START: the base; SAVED: the file saved
+            uint64_t at = 0;        // START, SAVED: the stream offset it happens at
+            size_t keep = 0;        // START
+        };
+
+        void post(Op op) {
+            {
+                std::lock_guard lock(m_);
+                ops_.push_back(std::move(op));
+            }
+            wake_.notify_one();
+        }
+
+        // The checksum is left for the writer to fill in. Typing runs in the same batch become
+        // one record.
+        void append(uint8_t op, uint64_t pos, uint64_t len, const char* text) {
+            using namespace journal_format;
+            size_t body = text ? len : 0;
+            bool first, urgent;
+            {
+                std::lock_guard lock(m_);
+                first = ops_.empty();
+                if (first || ops_.back().kind != Op::RECORDS) {
+                    ops_.push_back({Op::RECORDS});
+                    run_ = NO_RUN;
+                }
+                std::string& b = ops_.back().bytes;
+                if (op == INSERT && run_ != NO_RUN && run_end_ == pos) {
+                    uint64_t n;
+                    memcpy(&n, b.data() + run_ + 13, 8);
+                    n += len;
+                    memcpy(b.data() + run_ + 13, &n, 8);
+                    b.append(text, len);
+                    run_end_ += len;
+                    posted_ += len;
+                    return;
+                }
+                size_t at = b.size();
+                b.resize(at + RECORD + body);
+                char* p = b.data() + at;
+                p[4] = (char)op;
+                memcpy(p + 5, &pos, 8);
+                memcpy(p + 13, &len, 8);
+                if (body)
+                    memcpy(p + RECORD, text, body);
+                run_ = op == INSERT ? at : NO_RUN;
+                run_end_ = pos + len;
+                urgent = urgent_ = urgent_ || b.size() >= BATCH_MAX;
+            }
+            posted_ += RECORD + body;
+            if (first || urgent)
+                wake_.notify_one();
+        }
+
+        void run() {
+            for (;;) {
+                std::vector<Op> ops;
+                {
+                    std::unique_lock lock(m_);
+                    wake_.wait(lock, [this] { return stop_ || !ops_.empty(); });
+                    if (ops_.empty())
+                        break;
+                    // The keystrokes after this one get a moment to join the same write.
+                    wake_.wait_for(lock, std::chrono::milliseconds(SYNC_MS), [this] { return stop_ || urgent_; });
+                    ops.swap(ops_);
+                    urgent_ = false;
+                }
+                for (Op& op : ops)
+                    apply(op);
+                if (unsynced_) {
+                    fdatasync(fd_);
+                    unsynced_ = false;
+                }
+            }
+            finish();
+        }
+
+        void apply(Op& op) {
+            switch (op.kind) {
+            case Op::START:
+                finish();
+                path_ = std::move(op.bytes);
+                base_ = op.stamp;
+                from_ = op.at;
+                size_ = op.keep;
+                broken_ = false;
+                if (size_ == 0) {
+                    unlink(path_.c_str());
+                } else {
+                    fd_ = open(path_.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+                    broken_ = fd_ < 0 || ftruncate(fd_, journal_format::HEADER + size_) < 0;
+                }
+                break;
+            case Op::CLOSE:
+            case Op::DISCARD:
+                finish();
+                if (op.kind == Op::DISCARD && !path_.empty())
+                    unlink(path_.c_str());
+                path_.clear();
+                break;
+            case Op::RECORDS:
+                write_records(op.bytes);
+                break;
+            case Op::SAVED:
+                if (!path_.empty() && !broken_ && op.at >= from_)
+                    rebase(op.at - from_, op.stamp);
+                break;
+            }
+        }
+
+        void write_records(std::string& b) {
+            using namespace journal_format;
+            if (path_.empty() || broken_)
+                return;
+            for (size_t at = 0; at < b.size(); at += RECORD + body_of(b.data() + at)) {
+                uint32_t sum = checksum(b.data() + at + 4, RECORD - 4 + body_of(b.data() + at));
+                memcpy(b.data() + at, &sum, 4);
+            }
+            if (fd_ < 0 && !create()) {
+                broken_ = true;
+                return;
+            }
+            if (!write_all(b.data(), b.size())) {
+                broken_ = true;
+                return;
+            }
+            size_ += b.size();
+            unsynced_ = true;
+        }
+
+        // The file now holds the text as it was `drop` bytes of records in.
+        void rebase(size_t drop, const FileStamp& stamp) {
+            if (drop == 0 && stamp == base_)
+                return; // heard about twice
+            base_ = stamp;
+            from_ += drop;
+            if (fd_ < 0)
+                return; // the header is written when the first record is, with the new base
+            if (drop >= size_) {
+                finish();
+                unlink(path_.c_str());
+                size_ = 0;
+                return;
+            }
+            std::vector<std::string> runs{journal_format::header(base_), std::string(size_ - drop, '\0')};
+            bool ok = pread_all(runs[1].data(), runs[1].size(), journal_format::HEADER + drop);
+            finish();
+            std::string error;
+            if (!ok || !write_file(path_, runs, error)) {
+                broken_ = true;
+                return;
+            }
+            size_ = runs[1].size();
+            fd_ = open(path_.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+            broken_ = fd_ < 0;
+        }
+
+        bool create() {
+            fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+            if (fd_ < 0)
+                return false;
+            std::string h = journal_format::header(base_);
+            if (!write_all(h.data(), h.size()))
+                return false;
+            size_ = 0;
+            // A journal a crash can't find is no use, so its name goes to disk too.
+            size_t slash = path_.rfind('/');
+            std::string dir = slash == path_.npos ? "." : slash == 0 ? "/" : path_.substr(0, slash);
+            int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dfd >= 0) {
+                fsync(dfd);
+                ::close(dfd);
+            }
+            return true;
+        }
+
+        bool write_all(const char* p, size_t n) {
+            while (n > 0) {
+                ssize_t w = write(fd_, p, n);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                    return false;
+                p += w;
+                n -= w;
+            }
+            return true;
+        }
+
+        bool pread_all(char* p, size_t n, off_t off) {
+            while (n > 0) {
+                ssize_t r = pread(fd_, p, n, off);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    return false;
+                p += r;
+                n -= r;
+                off += r;
+            }
+            return true;
+        }
+
+        void finish() {
+            if (fd_ < 0)
+                return;
+            if (unsynced_)
+                fdatasync(fd_);
+            ::close(fd_);
+            fd_ = -1;
+            unsynced_ = false;
+        }
+
+        // The editor's side.
+        bool active_ = false;
+        uint64_t posted_ = 0; // bytes of records handed over, ever
+
+        std::thread worker_;
+        std::mutex m_;
+        std::condition_variable wake_;
+        std::vector<Op> ops_;
+        static constexpr size_t NO_RUN = SIZE_MAX;
+        size_t run_ = NO_RUN; // the insert at the end of ops_.back(), if it's one
+        uint64_t run_end_ = 0;
+        bool urgent_ = false;
+        bool stop_ = false;
+
+        // The writer's side.
+        std::string path_; // empty: not journaling
+        FileStamp base_;
+        uint64_t from_ = 0; // the stream offset of the first record in the file
+        size_t size_ = 0;   // bytes of records in the file
+        int fd_ = -1;
+        bool unsynced_ = false;
+        bool broken_ = false; // a write failed; nothing more goes in until the next start
+    };
+
+} // namespace honeymoon::mem
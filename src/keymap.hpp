@@ -0,0 +1,108 @@
+/*
+ * Key Map.
+ * The keybinding tree, flattened into one table when the bindings are loaded.
+ * A key press is a single array read. The tree traversals are gone.
+ */
+#pragma once
+#include "input.hpp"
+#include "keybinder.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace honeymoon::config {
+
+    class KeyMap {
+    public:
+        // ASCII, then the special keys from ShiftTab upwards.
+        static constexpr int NUM_SLOTS = 128 + 32;
+        static constexpr uint16_t ROOT = 0;
+
+        struct Step {
+            enum Kind : uint8_t { Miss, Prefix, Action, Unknown } kind;
+            uint16_t value; // Prefix: next state, Action: action id, Unknown: index for unknown_action()
+        };
+
+        KeyMap() { clear(); }
+
+        void clear() {
+            table.assign(NUM_SLOTS, 0);
+            unknown.clear();
+        }
+
+        // Builds the table from bindings. `resolve(name)` maps an action name to a non-zero id,
+        // or 0 if there's no such action. Later bindings override earlier ones; a key sequence
+        // that is also a prefix of a longer binding acts as the prefix.
+        template <typename Resolve>
+        void compile(const std::vector<KeyBinder::Binding>& bindings, Resolve resolve) {
+            clear();
+            for (const KeyBinder::Binding& b : bindings) {
+                uint16_t state = ROOT;
+                bool ok = true;
+                for (size_t i = 0; ok && i + 1 < b.keys.size(); ++i) {
+                    int s = slot(b.keys[i]);
+                    if (s < 0 || states() >= MAX_STATES) {
+                        ok = false;
+                        break;
+                    }
+                    uint16_t& cell = table[(size_t)state * NUM_SLOTS + s];
+                    if ((cell & KIND_MASK) != PREFIX) {
+                        cell = PREFIX | states();
+                        table.resize(table.size() + NUM_SLOTS, 0); // invalidates `cell`
+                    }
+                    state = table[(size_t)state * NUM_SLOTS + s] & VALUE_MASK;
+                }
+                int s = b.keys.empty() ? -1 : slot(b.keys.back());
+                if (!ok || s < 0)
+                    continue;
+                uint16_t& cell = table[(size_t)state * NUM_SLOTS + s];
+                if ((cell & KIND_MASK) == PREFIX)
+                    continue;
+                uint16_t id = resolve(b.action);
+                if (id != 0) {
+                    cell = ACTION | id;
+                } else {
+                    cell = UNKNOWN | (uint16_t)unknown.size();
+                    unknown.push_back(b.action);
+                }
+            }
+        }
+
+        Step step(uint16_t state, Key k) const {
+            int s = slot(k);
+            if (s < 0)
+                return {Step::Miss, 0};
+            uint16_t cell = table[(size_t)state * NUM_SLOTS + s];
+            if (cell == 0)
+                return {Step::Miss, 0};
+            return {static_cast<Step::Kind>(cell >> 14), static_cast<uint16_t>(cell & VALUE_MASK)};
+        }
+
+        const std::string& unknown_action(uint16_t i) const { return unknown[i]; }
+
+    private:
+        // Cell layout: two kind bits, fourteen value bits. Zero means unbound.
+        static constexpr uint16_t KIND_MASK = 0xC000;
+        static constexpr uint16_t VALUE_MASK = 0x3FFF;
+        static constexpr uint16_t PREFIX = uint16_t(Step::Prefix) << 14;
+        static constexpr uint16_t ACTION = uint16_t(Step::Action) << 14;
+        static constexpr uint16_t UNKNOWN = uint16_t(Step::Unknown) << 14;
+        static constexpr uint16_t MAX_STATES = VALUE_MASK;
+
+        std::vector<uint16_t> table; // states x NUM_SLOTS
+        std::vector<std::string> unknown;
+
+        uint16_t states() const { return static_cast<uint16_t>(table.size() / NUM_SLOTS); }
+
+        static int slot(Key k) {
+            int c = static_cast<int>(k);
+            if (c >= 0 && c < 128)
+                return c;
+            int special = c - static_cast<int>(Key::ShiftTab);
+            if (special >= 0 && special < NUM_SLOTS - 128)
+                return 128 + special;
+            return -1;
+        }
+    };
+
+} // namespace honeymoon::config
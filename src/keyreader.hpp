@@ -0,0 +1,263 @@
+/*
+ * Key Reader.
+ * Slurps whatever the tty has into a ring and decodes keys out of it with a small state machine.
+ * One read(2) per burst, not one per byte.
+ */
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include "input.hpp"
+
+namespace honeymoon::driver {
+
+    class KeyReader {
+    public:
+        static constexpr size_t RING_SIZE = 64 * 1024; // power of two
+        static constexpr int ESC_TIMEOUT_MS = 100;
+
+        // Reads everything fd has right now (up to the free space). Returns bytes read.
+        size_t fill(int fd) {
+            size_t got = 0;
+            while (head - tail < RING_SIZE) {
+                size_t at = head & MASK;
+                size_t room = std::min(RING_SIZE - (head - tail), RING_SIZE - at);
+                ssize_t n = read(fd, ring + at, room);
+                if (n <= 0)
+                    break;
+                head += (size_t)n;
+                got += (size_t)n;
+            }
+            return got;
+        }
+
+        // Next decoded key, or Key::None if the ring is empty or only holds the start of
+        // an escape sequence that hasn't timed out yet.
+        Key next() {
+            while (queued_n == 0) {
+                if (pasting) {
+                    if (!collect_paste())
+                        return Key::None;
+                    queue(Key::Paste);
+                    break;
+                }
+                if (tail == head)
+                    return Key::None;
+                if (decode()) {
+                    waiting = false;
+                    continue;
+                }
+                if (!waiting) {
+                    waiting = true;
+                    waiting_since = Clock::now();
+                }
+                if (timeout_ms() > 0)
+                    return Key::None;
+                // Nothing else came: the ESC was a key of its own, the rest is plain text.
+                waiting = false;
+                tail++;
+                return Key::Esc;
+            }
+            return pop_queued();
+        }
+
+        bool empty() const { return tail == head && queued_n == 0; }
+
+        // The text of the last Key::Paste, exactly as the terminal sent it.
+        std::string take_paste() { return std::move(paste); }
+
+        // How long the event loop may sleep before next() has to give up on a partial sequence.
+        int timeout_ms() const {
+            if (!waiting)
+                return -1;
+            auto spent = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - waiting_since).count();
+            return spent >= ESC_TIMEOUT_MS ? 0 : ESC_TIMEOUT_MS - (int)spent;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+        static constexpr size_t MASK = RING_SIZE - 1;
+        // Parameters saturate here, so a long digit run can't overflow; no key gets that far.
+        static constexpr int MAX_PARAM = 9999;
+
+        unsigned char ring[RING_SIZE];
+        size_t head = 0, tail = 0; // free-running; only masked on access
+        Key queued[2];
+        int queued_n = 0, queued_at = 0;
+        bool waiting = false;
+        Clock::time_point waiting_since;
+        bool pasting = false;   // inside ESC [ 200 ~ ... ESC [ 201 ~
+        size_t paste_match = 0; // how much of PASTE_END the newest bytes matched
+        std::string paste;
+        static constexpr std::string_view PASTE_END = "\x1b[201~";
+
+        // Input classes and states of the decoder. Anything that isn't part of an escape
+        // sequence is a key by itself.
+        enum Class : uint8_t { C_ESC, C_CSI, C_SS3, C_DIGIT, C_SEMI, C_FINAL, C_MID, C_OTHER, C_COUNT };
+        enum State : uint8_t { S_GROUND, S_ESC, S_CSI, S_SS3, S_COUNT };
+        enum Action : uint8_t {
+            A_BYTE,      // plain key
+            A_NEXT,      // consume and keep going
+            A_PARAM,     // CSI parameter byte
+            A_CSI,       // CSI final byte
+            A_SS3,       // SS3 final byte
+            A_META,      // ESC + key: Alt held, delivered as the Esc prefix the keymaps already use
+            A_BAD,       // malformed sequence, swallowed
+        };
+        struct Step {
+            State next;
+            Action act;
+        };
+
+        static constexpr Class classify(unsigned char c) {
+            if (c == 0x1b) return C_ESC;
+            if (c == '[') return C_CSI;
+            if (c == 'O') return C_SS3;
+            if (c >= '0' && c <= '9') return C_DIGIT;
+            if (c == ';') return C_SEMI;
+            if (c >= 0x40 && c <= 0x7e) return C_FINAL;
+            if (c >= 0x20 && c <= 0x3f) return C_MID; // private markers and intermediates
+            return C_OTHER;
+        }
+
+        //                                 C_ESC               C_CSI               C_SS3               C_DIGIT             C_SEMI              C_FINAL             C_MID               C_OTHER
+        static constexpr Step TABLE[S_COUNT][C_COUNT] = {
+            /* S_GROUND */ {{S_ESC, A_NEXT},    {S_GROUND, A_BYTE}, {S_GROUND, A_BYTE}, {S_GROUND, A_BYTE}, {S_GROUND, A_BYTE}, {S_GROUND, A_BYTE}, {S_GROUND, A_BYTE}, {S_GROUND, A_BYTE}},
+            /* S_ESC    */ {{S_GROUND, A_META}, {S_CSI, A_NEXT},    {S_SS3, A_NEXT},    {S_GROUND, A_META}, {S_GROUND, A_META}, {S_GROUND, A_META}, {S_GROUND, A_META}, {S_GROUND, A_META}},
+            /* S_CSI    */ {{S_GROUND, A_BAD},  {S_GROUND, A_CSI},  {S_GROUND, A_CSI},  {S_CSI, A_PARAM},   {S_CSI, A_PARAM},   {S_GROUND, A_CSI},  {S_CSI, A_NEXT},    {S_GROUND, A_BAD}},
+            /* S_SS3    */ {{S_GROUND, A_BAD},  {S_GROUND, A_SS3},  {S_GROUND, A_SS3},  {S_SS3, A_NEXT},    {S_SS3, A_NEXT},    {S_GROUND, A_SS3},  {S_GROUND, A_BAD},  {S_GROUND, A_BAD}},
+        };
+
+        // CSI n ~ keys, indexed by n.
+        static constexpr Key TILDE_KEYS[] = {Key::None, Key::Home, Key::Insert, Key::Del, Key::End,
+                                             Key::PageUp, Key::PageDown, Key::Home, Key::End};
+
+        // Decodes one key at tail. Returns false if the sequence there isn't complete yet.
+        bool decode() {
+            State s = S_GROUND;
+            int params[2] = {0, 0};
+            int nparams = 0;
+            for (size_t i = tail; i != head; ++i) {
+                unsigned char c = ring[i & MASK];
+                Step step = TABLE[s][classify(c)];
+                size_t used = i - tail + 1;
+                switch (step.act) {
+                case A_NEXT:
+                    break;
+                case A_PARAM:
+                    if (c == ';') {
+                        nparams = std::min(nparams + 1, 1);
+                    } else {
+                        params[nparams] = std::min(params[nparams] * 10 + (c - '0'), MAX_PARAM);
+                    }
+                    break;
+                case A_BYTE:
+                    return finish(used, static_cast<Key>(static_cast<char>(c)));
+                case A_META:
+                    // The byte after ESC starts its own key; only the ESC is consumed here.
+                    return finish(1, Key::Esc);
+                case A_CSI:
+                    if (params[0] == MAX_PARAM || params[1] == MAX_PARAM)
+                        return finish(used, Key::None); // saturated: not a key anything sends
+                    return finish(used, csi_key(c, params[0], params[1]));
+                case A_SS3:
+                    return finish(used, csi_key(c, 1, 0));
+                case A_BAD:
+                    return finish(used, Key::None);
+                }
+                s = step.next;
+            }
+            return false;
+        }
+
+        // xterm modifier parameter: 1 + (shift | alt << 1 | ctrl << 2).
+        Key csi_key(unsigned char final, int p0, int mod) {
+            bool ctrl = mod > 1 && ((mod - 1) & 4);
+            bool alt = mod > 1 && ((mod - 1) & 2);
+            Key k = Key::None;
+            switch (final) {
+            case 'A': k = ctrl ? Key::CtrlUp : Key::ArrowUp; break;
+            case 'B': k = ctrl ? Key::CtrlDown : Key::ArrowDown; break;
+            case 'C': k = ctrl ? Key::CtrlRight : Key::ArrowRight; break;
+            case 'D': k = ctrl ? Key::CtrlLeft : Key::ArrowLeft; break;
+            case 'H': k = ctrl ? Key::CtrlHome : Key::Home; break;
+            case 'F': k = ctrl ? Key::CtrlEnd : Key::End; break;
+            case 'Z': k = Key::ShiftTab; break;
+            case '~':
+                if (p0 == 200)
+                    pasting = true;
+                if (p0 > 0 && p0 < (int)std::size(TILDE_KEYS))
+                    k = TILDE_KEYS[p0];
+                if (k == Key::Del && ctrl)
+                    k = Key::CtrlDel;
+                break;
+            }
+            if (alt && k != Key::None)
+                queue(Key::Esc);
+            return k;
+        }
+
+        // Moves paste bytes out of the ring, a contiguous run at a time. Returns true once
+        // the end marker has gone by.
+        bool collect_paste() {
+            while (tail != head) {
+                const char* run = reinterpret_cast<const char*>(ring + (tail & MASK));
+                size_t len = std::min(head - tail, RING_SIZE - (tail & MASK));
+                size_t i = 0;
+                while (i < len) {
+                    if (paste_match == 0) {
+                        const void* esc = memchr(run + i, 0x1b, len - i);
+                        size_t stop = esc ? (size_t)(static_cast<const char*>(esc) - run) : len;
+                        paste.append(run + i, stop - i);
+                        i = stop;
+                        if (i == len)
+                            break;
+                    }
+                    if (run[i] == PASTE_END[paste_match]) {
+                        i++;
+                        if (++paste_match == PASTE_END.size()) {
+                            tail += i;
+                            pasting = false;
+                            paste_match = 0;
+                            return true;
+                        }
+                    } else {
+                        // Not the end marker after all; what matched so far is paste text and this
+                        // byte gets looked at again from scratch (ESC only starts the marker).
+                        paste.append(PASTE_END.data(), paste_match);
+                        paste_match = 0;
+                    }
+                }
+                tail += len;
+            }
+            return false;
+        }
+
+        bool finish(size_t used, Key k) {
+            tail += used;
+            if (k != Key::None)
+                queue(k);
+            return true;
+        }
+
+        void queue(Key k) {
+            if (queued_n == 0)
+                queued_at = 0;
+            queued[queued_at + queued_n++] = k;
+        }
+
+        Key pop_queued() {
+            if (queued_n == 0)
+                return Key::None;
+            queued_n--;
+            return queued[queued_at++];
+        }
+    };
+
+} // namespace honeymoon::driver
@@ -0,0 +1,461 @@
+/*
+ * Fallback Lexer.
+ * For when tree-sitter isn't around, which is most places.
+ * One transition table per language, built at compile time. The state at each line start
+ * is cached, so an edit re-lexes from its line until the states agree again.
+ */
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "edit.hpp"
+#include "treesitter.hpp"
+
+namespace honeymoon::syntax {
+
+    namespace lexing {
+
+        enum class Lang : uint8_t { None, CFamily, Python, Shell, Json, Yaml, Log, Count };
+
+        // Character classes and states shared by every language; a language only changes
+        // which transitions exist.
+        enum Class : uint8_t {
+            C_SPACE, C_WORD, C_DIGIT, C_DOT, C_DQ, C_SQ, C_ESC, C_SLASH, C_STAR, C_HASH, C_DOLLAR, C_OTHER,
+            C_COUNT
+        };
+        enum State : uint8_t {
+            S_BOL,          // line start, before anything but blanks
+            S_CODE,
+            S_WORD,
+            S_NUMBER,
+            S_VAR,          // $name
+            S_DQ,
+            S_SQ,
+            S_SLASH,        // saw '/', might start a comment
+            S_LINE_COMMENT,
+            S_PREPROC,
+            S_BLOCK,        // /* ... (spans lines)
+            S_BLOCK_STAR,   // /* ... *
+            S_TDQ,          // """ ... (spans lines)
+            S_TSQ,          // ''' ... (spans lines)
+            S_COUNT
+        };
+        enum Action : uint8_t {
+            A_PAINT,    // paint the byte, move on
+            A_OPEN,     // starts a word or number
+            A_QUOTE,    // opens a string, or a triple-quoted one
+            A_CLOSE,    // closes a string
+            A_SKIP,     // escape: this byte and the next
+            A_COMMENT2, // second byte of // or /*, repaints the first
+            A_TRIPLE,   // quote inside a triple-quoted string, maybe the end
+            A_REDO,     // the token ended before this byte; look at it again in the next state
+        };
+        struct Step {
+            State next = S_CODE;
+            HighlightKind kind = HighlightKind::None;
+            Action act = A_PAINT;
+        };
+        using Table = std::array<std::array<Step, C_COUNT>, S_COUNT>;
+        using Classes = std::array<Class, 256>;
+
+        struct Spec {
+            std::span<const std::string_view> keywords{}, types{}, constants{};
+            std::string_view word_extra{}; // besides [A-Za-z0-9_]
+            bool slash_comments = false, hash_comment = false, hash_preproc = false;
+            bool hash_in_words = false;  // shell and YAML only start a comment after a blank
+            bool dq = true, sq = true, sq_escapes = true, triple = false, dollar_vars = false;
+            bool calls = false;          // name( is a function
+            bool keys = false;           // name: and "name": are keys
+        };
+
+        struct Grammar {
+            Spec spec;
+            Classes classes;
+            Table table;
+        };
+
+        constexpr Classes build_classes(const Spec& s) {
+            Classes c{};
+            for (int i = 0; i < 256; ++i) {
+                char ch = static_cast<char>(i);
+                Class k = C_OTHER;
+                if (ch == ' ' || ch == '\t' || ch == '\r') k = C_SPACE;
+                else if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_' || i >= 0x80) k = C_WORD;
+                else if (ch >= '0' && ch <= '9') k = C_DIGIT;
+                else if (s.word_extra.find(ch) != std::string_view::npos) k = C_WORD;
+                else if (ch == '.') k = C_DOT;
+                else if (ch == '"') k = C_DQ;
+                else if (ch == '\'') k = C_SQ;
+                else if (ch == '\\') k = C_ESC;
+                else if (ch == '/') k = C_SLASH;
+                else if (ch == '*') k = C_STAR;
+                else if (ch == '#') k = C_HASH;
+                else if (ch == '$') k = C_DOLLAR;
+                c[i] = k;
+            }
+            return c;
+        }
+
+        constexpr Table build_table(const Spec& s) {
+            using K = HighlightKind;
+            constexpr Step redo{S_CODE, K::None, A_REDO};
+            Table t{};
+            for (auto& row : t)
+                row.fill(redo);
+
+            auto& code = t[S_CODE];
+            code.fill({S_CODE, K::None, A_PAINT});
+            code[C_WORD] = {S_WORD, K::None, A_OPEN};
+            code[C_DIGIT] = {S_NUMBER, K::Number, A_OPEN};
+            if (s.dq) code[C_DQ] = {S_DQ, K::String, A_QUOTE};
+            if (s.sq) code[C_SQ] = {S_SQ, K::String, A_QUOTE};
+            if (s.slash_comments) code[C_SLASH] = {S_SLASH, K::None, A_PAINT};
+            if (s.hash_comment) code[C_HASH] = {S_LINE_COMMENT, K::Comment, A_PAINT};
+            if (s.dollar_vars) code[C_DOLLAR] = {S_VAR, K::Type, A_OPEN};
+
+            t[S_BOL][C_SPACE] = {S_BOL, K::None, A_PAINT};
+            if (s.hash_preproc) t[S_BOL][C_HASH] = {S_PREPROC, K::Preprocessor, A_PAINT};
+
+            t[S_WORD][C_WORD] = t[S_WORD][C_DIGIT] = {S_WORD, K::None, A_PAINT};
+            if (s.hash_in_words) t[S_WORD][C_HASH] = {S_WORD, K::None, A_PAINT};
+            t[S_NUMBER][C_WORD] = t[S_NUMBER][C_DIGIT] = t[S_NUMBER][C_DOT] = {S_NUMBER, K::Number, A_PAINT};
+            t[S_VAR][C_WORD] = t[S_VAR][C_DIGIT] = {S_VAR, K::Type, A_PAINT};
+
+            t[S_DQ].fill({S_DQ, K::String, A_PAINT});
+            t[S_DQ][C_ESC] = {S_DQ, K::String, A_SKIP};
+            t[S_DQ][C_DQ] = {S_CODE, K::String, A_CLOSE};
+            t[S_SQ].fill({S_SQ, K::String, A_PAINT});
+            if (s.sq_escapes) t[S_SQ][C_ESC] = {S_SQ, K::String, A_SKIP};
+            t[S_SQ][C_SQ] = {S_CODE, K::String, A_CLOSE};
+
+            t[S_SLASH][C_SLASH] = {S_LINE_COMMENT, K::Comment, A_COMMENT2};
+            t[S_SLASH][C_STAR] = {S_BLOCK, K::Comment, A_COMMENT2};
+            t[S_LINE_COMMENT].fill({S_LINE_COMMENT, K::Comment, A_PAINT});
+            t[S_PREPROC].fill({S_PREPROC, K::Preprocessor, A_PAINT});
+            t[S_BLOCK].fill({S_BLOCK, K::Comment, A_PAINT});
+            t[S_BLOCK][C_STAR] = {S_BLOCK_STAR, K::Comment, A_PAINT};
+            t[S_BLOCK_STAR].fill({S_BLOCK, K::Comment, A_PAINT});
+            t[S_BLOCK_STAR][C_STAR] = {S_BLOCK_STAR, K::Comment, A_PAINT};
+            t[S_BLOCK_STAR][C_SLASH] = {S_CODE, K::Comment, A_PAINT};
+
+            t[S_TDQ].fill({S_TDQ, K::String, A_PAINT});
+            t[S_TDQ][C_ESC] = {S_TDQ, K::String, A_SKIP};
+            t[S_TDQ][C_DQ] = {S_TDQ, K::String, A_TRIPLE};
+            t[S_TSQ].fill({S_TSQ, K::String, A_PAINT});
+            t[S_TSQ][C_ESC] = {S_TSQ, K::String, A_SKIP};
+            t[S_TSQ][C_SQ] = {S_TSQ, K::String, A_TRIPLE};
+            return t;
+        }
+
+        template <size_t N>
+        constexpr std::array<std::string_view, N> sorted(std::array<std::string_view, N> words) {
+            std::ranges::sort(words);
+            return words;
+        }
+
+        constexpr auto C_KEYWORDS = sorted<58>({
+            "alignas", "alignof", "asm", "break", "case", "catch", "class", "co_await", "co_return",
+            "co_yield", "concept", "const", "const_cast", "consteval", "constexpr", "constinit", "continue",
+            "decltype", "default", "delete", "do", "dynamic_cast", "else", "enum", "explicit", "export",
+            "extern", "for", "friend", "goto", "if", "inline", "mutable", "namespace", "new", "noexcept",
+            "operator", "private", "protected", "public", "register", "reinterpret_cast", "requires",
+            "return", "sizeof", "static", "static_assert", "static_cast", "struct", "switch", "template",
+            "this", "throw", "try", "typedef", "typename", "union", "using"});
+        constexpr auto C_TYPES = sorted<27>({
+            "auto", "bool", "char", "char16_t", "char32_t", "char8_t", "double", "float", "int",
+            "int16_t", "int32_t", "int64_t", "int8_t", "long", "ptrdiff_t", "short", "signed", "size_t",
+            "ssize_t", "uint16_t", "uint32_t", "uint64_t", "uint8_t", "unsigned", "virtual", "void",
+            "wchar_t"});
+        constexpr auto C_CONSTANTS = sorted<4>({"NULL", "false", "nullptr", "true"});
+
+        constexpr auto PY_KEYWORDS = sorted<33>({
+            "and", "as", "assert", "async", "await", "break", "case", "class", "continue", "def", "del",
+            "elif", "else", "except", "finally", "for", "from", "global", "if", "import", "in", "is",
+            "lambda", "match", "nonlocal", "not", "or", "pass", "raise", "return", "try", "while",
+            "with"});
+        constexpr auto PY_TYPES = sorted<12>({
+            "bool", "bytes", "dict", "float", "frozenset", "int", "list", "object", "self", "set", "str",
+            "tuple"});
+        constexpr auto PY_CONSTANTS = sorted<3>({"False", "None", "True"});
+
+        constexpr auto SH_KEYWORDS = sorted<30>({
+            "break", "case", "cd", "continue", "declare", "do", "done", "echo", "elif", "else", "esac",
+            "eval", "exec", "exit", "export", "fi", "for", "function", "if", "in", "local", "printf",
+            "read", "readonly", "return", "set", "shift", "then", "unset", "while"});
+        constexpr std::array<std::string_view, 0> NO_WORDS{};
+
+        constexpr auto JSON_CONSTANTS = sorted<3>({"false", "null", "true"});
+        constexpr auto YAML_CONSTANTS = sorted<9>({
+            "False", "No", "Null", "True", "Yes", "false", "no", "null", "true"});
+
+        constexpr auto LOG_ALERTS = sorted<12>({
+            "CRIT", "CRITICAL", "ERR", "ERROR", "FAIL", "FAILED", "FATAL", "PANIC", "WARN", "WARNING",
+            "error", "warning"});
+        constexpr auto LOG_LEVELS = sorted<6>({"DEBUG", "INFO", "NOTICE", "TRACE", "debug", "info"});
+
+        constexpr Grammar make(const Spec& s) { return {s, build_classes(s), build_table(s)}; }
+
+        constexpr std::array<Grammar, (size_t)Lang::Count> GRAMMARS = {
+            make({}), // None, never used
+            make({.keywords = C_KEYWORDS, .types = C_TYPES, .constants = C_CONSTANTS,
+                  .slash_comments = true, .hash_preproc = true, .calls = true}),
+            make({.keywords = PY_KEYWORDS, .types = PY_TYPES, .constants = PY_CONSTANTS,
+                  .hash_comment = true, .triple = true, .calls = true}),
+            make({.keywords = SH_KEYWORDS, .types = NO_WORDS, .constants = NO_WORDS,
+                  .hash_comment = true, .hash_in_words = true, .sq_escapes = false, .dollar_vars = true}),
+            make({.keywords = NO_WORDS, .types = NO_WORDS, .constants = JSON_CONSTANTS,
+                  .sq = false, .keys = true}),
+            make({.keywords = NO_WORDS, .types = NO_WORDS, .constants = YAML_CONSTANTS,
+                  .word_extra = "-", .hash_comment = true, .hash_in_words = true, .sq_escapes = false,
+                  .keys = true}),
+            make({.keywords = LOG_ALERTS, .types = LOG_LEVELS, .constants = NO_WORDS,
+                  .sq = false}),
+        };
+
+        inline void paint(HighlightKind* out, size_t at, size_t n, HighlightKind k) {
+            if (out)
+                std::fill_n(out + at, n, k);
+        }
+
+        inline bool triple_at(std::string_view line, size_t i) {
+            return i + 2 < line.size() && line[i + 1] == line[i] && line[i + 2] == line[i];
+        }
+
+        // Is the token ending at `end` followed by a ':'? A bare word also needs a blank after
+        // it, or every URL would be a key.
+        inline bool colon_at(std::string_view line, size_t end, bool bare) {
+            size_t j = line.find_first_not_of(" \t", end);
+            if (j == std::string_view::npos || line[j] != ':')
+                return false;
+            return !bare || j + 1 == line.size() || line[j + 1] == ' ' || line[j + 1] == '\t';
+        }
+
+        // Colors a word once it's complete: the language's word lists first, then what follows it.
+        inline void finish_token(const Grammar& g, std::string_view line, State s, size_t token, size_t end,
+                                 HighlightKind* out) {
+            if (s != S_WORD)
+                return;
+            std::string_view word = line.substr(token, end - token);
+            HighlightKind k = HighlightKind::None;
+            if (std::ranges::binary_search(g.spec.keywords, word))
+                k = HighlightKind::Keyword;
+            else if (std::ranges::binary_search(g.spec.types, word))
+                k = HighlightKind::Type;
+            else if (std::ranges::binary_search(g.spec.constants, word))
+                k = HighlightKind::Number;
+            else if (g.spec.keys && colon_at(line, end, true))
+                k = HighlightKind::Keyword;
+            else if (g.spec.calls) {
+                size_t j = line.find_first_not_of(" \t", end);
+                if (j != std::string_view::npos && line[j] == '(')
+                    k = HighlightKind::Function;
+            }
+            paint(out, token, end - token, k);
+        }
+
+        // Lexes one line starting in `state` and returns the state the next line starts in.
+        // Without `out` nothing is painted and words aren't looked up.
+        inline uint8_t lex(const Grammar& g, std::string_view line, uint8_t state, HighlightKind* out) {
+            State s = static_cast<State>(state);
+            size_t token = 0;
+            size_t i = 0;
+            while (i < line.size()) {
+                Step step = g.table[s][g.classes[static_cast<unsigned char>(line[i])]];
+                switch (step.act) {
+                case A_PAINT:
+                    paint(out, i++, 1, step.kind);
+                    break;
+                case A_OPEN:
+                    token = i;
+                    paint(out, i++, 1, step.kind);
+                    break;
+                case A_QUOTE:
+                    token = i;
+                    if (g.spec.triple && triple_at(line, i)) {
+                        s = line[i] == '"' ? S_TDQ : S_TSQ;
+                        paint(out, i, 3, step.kind);
+                        i += 3;
+                        continue;
+                    }
+                    paint(out, i++, 1, step.kind);
+                    break;
+                case A_CLOSE:
+                    paint(out, i++, 1, step.kind);
+                    if (out && g.spec.keys && colon_at(line, i, false))
+                        paint(out, token, i - token, HighlightKind::Keyword);
+                    break;
+                case A_SKIP: {
+                    size_t n = std::min<size_t>(2, line.size() - i);
+                    paint(out, i, n, step.kind);
+                    i += n;
+                    break;
+                }
+                case A_COMMENT2:
+                    paint(out, i - 1, 2, step.kind);
+                    i++;
+                    break;
+                case A_TRIPLE:
+                    if (triple_at(line, i)) {
+                        s = S_CODE;
+                        paint(out, i, 3, step.kind);
+                        i += 3;
+                        continue;
+                    }
+                    paint(out, i++, 1, step.kind);
+                    break;
+                case A_REDO:
+                    if (out)
+                        finish_token(g, line, s, token, i, out);
+                    break;
+                }
+                s = step.next;
+            }
+            if (out)
+                finish_token(g, line, s, token, i, out);
+            switch (s) {
+            case S_BLOCK:
+            case S_BLOCK_STAR: return S_BLOCK;
+            case S_TDQ:
+            case S_TSQ:        return s;
+            default:           return S_BOL;
+            }
+        }
+
+    } // namespace lexing
+
+    class Lexer {
+    public:
+        using Lang = lexing::Lang;
+
+        static constexpr Lang lang_for_filename(std::string_view f) noexcept {
+            for (std::string_view ext : {".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp", ".hxx"})
+                if (f.ends_with(ext))
+                    return Lang::CFamily;
+            if (f.ends_with(".py") || f.ends_with(".pyi"))
+                return Lang::Python;
+            if (f.ends_with(".sh") || f.ends_with(".bash") || f.ends_with(".zsh"))
+                return Lang::Shell;
+            if (f.ends_with(".json"))
+                return Lang::Json;
+            if (f.ends_with(".yaml") || f.ends_with(".yml"))
+                return Lang::Yaml;
+            if (f.ends_with(".log"))
+                return Lang::Log;
+            return Lang::None;
+        }
+
+        bool set_language_for_file(const std::string& filename) {
+            if (filename == last_filename_)
+                return lang_ != Lang::None;
+            last_filename_ = filename;
+            Lang next = lang_for_filename(filename);
+            if (next != lang_)
+                invalidate();
+            lang_ = next;
+            return lang_ != Lang::None;
+        }
+
+        bool active() const noexcept { return lang_ != Lang::None; }
+
+        void invalidate() {
+            starts_.clear();
+            valid_ = 0;
+        }
+
+        // Keeps the cached line-start states lined up with the rows they belong to. Rows from
+        // the edit on are only trusted again once re-lexing reaches a state that matches.
+        void edit(const honeymoon::mem::EditRecord& e) {
+            size_t a = e.start_point.row, b = e.old_end_point.row, c = e.new_end_point.row;
+            bool clean = valid_ >= starts_.size();
+            if (b + 1 > starts_.size()) {
+                starts_.resize(std::min(starts_.size(), a + 1));
+            } else {
+                starts_.erase(starts_.begin() + (a + 1), starts_.begin() + (b + 1));
+                starts_.insert(starts_.begin() + (a + 1), c - a, lexing::S_BOL);
+            }
+            if (!clean && stale_to_ > b)
+                stale_to_ = stale_to_ - b + c;
+            stale_to_ = clean ? c : std::max(stale_to_, c);
+            valid_ = std::min(valid_, a + 1);
+        }
+
+        // Highlight kinds for the first `len` bytes of `row`, or nullptr if the lexer is off.
+        template <typename Buf>
+        const HighlightKind* line_kinds(const Buf& buffer, size_t row, size_t len) {
+            if (!active())
+                return nullptr;
+            uint8_t state = state_at(buffer, row);
+            size_t start = buffer.line_start(row);
+            if (start == std::string::npos)
+                return nullptr;
+            read_line(buffer, start, len);
+            kinds_.assign(line_.size(), HighlightKind::None);
+            lexing::lex(grammar(), line_, state, kinds_.data());
+            return kinds_.data();
+        }
+
+    private:
+
+        const lexing::Grammar& grammar() const { return lexing::GRAMMARS[(size_t)lang_]; }
+
+        // Walks forward from the last trusted row, caching line-start states, until `row`'s
+        // start state is known. Stops early once it agrees with the cache past the edits.
+        template <typename Buf>
+        uint8_t state_at(const Buf& buffer, size_t row) {
+            if (starts_.empty()) {
+                starts_.push_back(lexing::S_BOL);
+                valid_ = 1;
+            }
+            while (valid_ <= row) {
+                size_t start = buffer.line_start(valid_ - 1);
+                if (start == std::string::npos)
+                    break;
+                read_line(buffer, start, std::string::npos);
+                uint8_t end = lexing::lex(grammar(), line_, starts_[valid_ - 1], nullptr);
+                if (valid_ < starts_.size()) {
+                    if (starts_[valid_] == end && valid_ > stale_to_) {
+                        valid_ = starts_.size();
+                        continue;
+                    }
+                    starts_[valid_] = end;
+                } else {
+                    starts_.push_back(end);
+                }
+                valid_++;
+            }
+            return starts_[std::min(row, valid_ - 1)];
+        }
+
+        // Copies at most `limit` bytes of the line at `start` into line_, without the newline.
+        template <typename Buf>
+        void read_line(const Buf& buffer, size_t start, size_t limit) {
+            line_.clear();
+            size_t pos = start;
+            while (line_.size() < limit) {
+                auto chunk = buffer.chunk_at(pos);
+                if (chunk.empty())
+                    break;
+                chunk = chunk.substr(0, limit - line_.size());
+                size_t nl = chunk.find('\n');
+                line_.append(chunk.data(), nl == std::string_view::npos ? chunk.size() : nl);
+                if (nl != std::string_view::npos)
+                    break;
+                pos += chunk.size();
+            }
+        }
+
+        Lang lang_ = Lang::None;
+        std::string last_filename_;
+        std::vector<uint8_t> starts_; // start state of each row
+        size_t valid_ = 0;            // starts_[0, valid_) are trusted
+        size_t stale_to_ = 0;         // last row touched by edits not yet re-lexed
+        std::string line_;
+        std::vector<HighlightKind> kinds_;
+    };
+
+} // namespace honeymoon::syntax
@@ -0,0 +1,123 @@
+/*
+ * Line Index.
+ * The gap buffer trick, applied to newlines. Starts before the gap are absolute, starts after
+ * it are counted back from the scan frontier, so an edit never touches the far side.
+ */
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace honeymoon::mem {
+
+    template <typename CharT = char>
+    class LineIndex {
+    public:
+        static constexpr size_t npos = static_cast<size_t>(-1);
+        static constexpr size_t SCAN_STEP = 64 * 1024;
+
+        void reset() {
+            before.clear();
+            after.clear();
+            frontier = 0;
+        }
+
+        // Offset of the first character of `line`, or npos if the text has fewer lines.
+        // `src(pos)` must return the contiguous run of text starting at pos.
+        template <typename Source>
+        size_t line_start(size_t line, const Source& src, size_t total) {
+            if (line == 0)
+                return 0;
+            while (known_starts() < line) {
+                if (frontier >= total)
+                    return npos;
+                scan_step(src, total);
+            }
+            size_t k = line - 1;
+            if (k < before.size())
+                return before[k];
+            return frontier - after[after.size() - 1 - (k - before.size())];
+        }
+
+        // Zero-based line containing `offset`. O(log lines) once that far has been scanned.
+        template <typename Source>
+        size_t line_of(size_t offset, const Source& src, size_t total) {
+            while (frontier <= offset && frontier < total)
+                scan_step(src, total);
+            size_t n = std::upper_bound(before.begin(), before.end(), offset) - before.begin();
+            if (offset < frontier)
+                n += after.end() - std::lower_bound(after.begin(), after.end(), frontier - offset);
+            else
+                n += after.size();
+            return n;
+        }
+
+        template <typename Source>
+        size_t line_count(const Source& src, size_t total) {
+            while (frontier < total)
+                scan_step(src, total);
+            return known_starts() + 1;
+        }
+
+        // Must be called before the text is inserted at pos.
+        void on_insert(size_t pos, const CharT* s, size_t n) {
+            if (pos > frontier)
+                return;
+            move_gap(pos);
+            std::basic_string_view<CharT> text(s, n);
+            for (size_t i = text.find(CharT('\n')); i != text.npos; i = text.find(CharT('\n'), i + 1))
+                before.push_back(pos + i + 1);
+            frontier += n;
+        }
+
+        // Must be called before [start, end) is erased.
+        void on_erase(size_t start, size_t end) {
+            if (start >= frontier || start >= end)
+                return;
+            move_gap(start);
+            if (end > frontier) {
+                after.clear();
+                frontier = start;
+                return;
+            }
+            while (!after.empty() && after.back() >= frontier - end)
+                after.pop_back();
+            frontier -= end - start;
+        }
+
+    private:
+        std::vector<size_t> before; // absolute line starts <= gap position, ascending
+        std::vector<size_t> after;  // frontier - start for starts past the gap, ascending
+        size_t frontier = 0;        // text before this offset has been scanned
+
+        size_t known_starts() const { return before.size() + after.size(); }
+
+        void move_gap(size_t pos) {
+            while (!before.empty() && before.back() > pos) {
+                after.push_back(frontier - before.back());
+                before.pop_back();
+            }
+            while (!after.empty() && frontier - after.back() <= pos) {
+                before.push_back(frontier - after.back());
+                after.pop_back();
+            }
+        }
+
+        template <typename Source>
+        void scan_step(const Source& src, size_t total) {
+            move_gap(frontier);
+            std::basic_string_view<CharT> run = src(frontier);
+            size_t n = std::min({run.size(), SCAN_STEP, total - frontier});
+            if (n == 0) {
+                frontier = total;
+                return;
+            }
+            run = run.substr(0, n);
+            for (size_t i = run.find(CharT('\n')); i != run.npos; i = run.find(CharT('\n'), i + 1))
+                before.push_back(frontier + i + 1);
+            frontier += n;
+        }
+    };
+
+} // namespace honeymoon::mem
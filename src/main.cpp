@@ -1,17 +1,40 @@
 /*
  * Bootstrapper. Wires Buffer + Terminal -> Kernel.
+ * Small files get the gap buffer, big ones get mapped into a piece table.
  */
 #include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
 #include "editor.hpp"
 #include "buffer.hpp"
+#include "piecetable.hpp"
 #include "terminal.hpp"
 
-int main(int argc, char* argv[]) {
-    using Buf = honeymoon::mem::GapBuffer<char>;
+static constexpr off_t PIECE_TABLE_THRESHOLD = 16 * 1024 * 1024;
+
+template <typename Buf>
+static int run_editor(const char* path) {
     using Term = honeymoon::driver::Terminal;
     honeymoon::kernel::Editor<Buf, Term> editor;
-    
-    if (argc >= 2) editor.open(argv[1]);
+
+    if (path) editor.open(path);
     editor.run();
     return 0;
 }
+
+int main(int argc, char* argv[]) {
+    enum class Engine { Auto, Gap, Piece } engine = Engine::Auto;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--piece-table") == 0 || strcmp(argv[i], "-P") == 0) engine = Engine::Piece;
+        else if (strcmp(argv[i], "--gap-buffer") == 0 || strcmp(argv[i], "-G") == 0) engine = Engine::Gap;
+        else if (!path) path = argv[i];
+    }
+    if (engine == Engine::Auto) {
+        struct stat st;
+        engine = (path && stat(path, &st) == 0 && st.st_size >= PIECE_TABLE_THRESHOLD) ? Engine::Piece : Engine::Gap;
+    }
+
+    if (engine == Engine::Piece) return run_editor<honeymoon::mem::PieceTable<char>>(path);
+    return run_editor<honeymoon::mem::GapBuffer<char>>(path);
+}
@@ -0,0 +1,352 @@
+/*
+ * Piece Table.
+ * The file stays in the page cache where it belongs. We only remember what you changed.
+ */
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "concepts.hpp"
+#include "edit.hpp"
+#include "lines.hpp"
+#include "save.hpp"
+#include "snapshot.hpp"
+
+namespace honeymoon::mem {
+    // Read-only private mapping of the file we opened. Owns the munmap.
+    struct MappedFile {
+        void* addr = nullptr;
+        size_t length = 0;
+
+        MappedFile() = default;
+        MappedFile(MappedFile&& o) noexcept : addr(std::exchange(o.addr, nullptr)), length(std::exchange(o.length, 0)) {}
+        MappedFile& operator=(MappedFile&& o) noexcept {
+            if (this != &o) { reset(); addr = std::exchange(o.addr, nullptr); length = std::exchange(o.length, 0); }
+            return *this;
+        }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile() { reset(); }
+
+        bool map(int fd, size_t len) {
+            reset();
+            if (len == 0) return true;
+            void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) return false;
+            addr = p; length = len;
+            return true;
+        }
+
+        void reset() {
+            if (addr) munmap(addr, length);
+            addr = nullptr; length = 0;
+        }
+    };
+
+    template <typename CharT = char>
+    requires honeymoon::kernel::CharType<CharT>
+    class PieceTable {
+    public:
+        using value_type = CharT;
+        using size_type = size_t;
+        static constexpr size_type ADD_BLOCK_SIZE = 64 * 1024;
+
+        PieceTable() = default;
+        PieceTable(PieceTable&&) noexcept = default;
+        PieceTable& operator=(PieceTable&&) noexcept = default;
+        PieceTable(const PieceTable&) = delete;
+        PieceTable& operator=(const PieceTable&) = delete;
+        ~PieceTable() = default;
+
+        // O(1): map the file and describe it with a single piece. Nothing is read yet.
+        void load_from_file(const std::string& filename) {
+            *this = PieceTable();
+            edit_log.reset();
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            struct stat st;
+            if (fstat(fd, &st) < 0) { close(fd); return; }
+            size_type bytes = st.st_size;
+            original = std::make_shared<MappedFile>();
+            bool ok = original->map(fd, bytes);
+            close(fd);
+            if (!ok) return;
+            size_type count = bytes / sizeof(CharT);
+            if (count) pieces.push_back({static_cast<const CharT*>(original->addr), count});
+            total = count;
+            stamp = FileStamp::of(st);
+            tracking = true;
+        }
+
+        // The original file is still mapped, so truncating it in place would pull the rug out
+        // from under our own pieces. Write a sibling and rename over it instead.
+        void save_to_file(const std::string& filename) {
+            std::vector<std::basic_string_view<CharT>> runs;
+            runs.reserve(pieces.size());
+            for (const Piece& p : pieces) runs.emplace_back(p.data, p.len);
+            std::string error;
+            if (write_file(filename, runs, error)) dirty = false;
+        }
+
+        void insert_char(CharT c) { insert_string(&c, 1); }
+        void insert_string(const std::string& s) { insert_string(s.data(), s.size()); }
+
+        void insert_string(const CharT* s, size_t n) {
+            if (n == 0) return;
+            TextPoint at = point_at(cursor);
+            edit_log.inserted(cursor, at, EditLog::advance(at, s, n), n);
+            lines.on_insert(cursor, s, n);
+            const CharT* stored = append_add(s, n);
+            size_type idx = split_at(cursor);
+            // Typing at the end of the previous insertion just grows that piece.
+            if (idx > 0 && stored != add_blocks.back().get() &&
+                pieces[idx - 1].data + pieces[idx - 1].len == stored) {
+                pieces[idx - 1].len += n;
+                hint_idx = idx - 1; hint_start = cursor - (pieces[idx - 1].len - n);
+            } else {
+                pieces.insert(pieces.begin() + idx, Piece{stored, n});
+                hint_idx = idx; hint_start = cursor;
+            }
+            total += n;
+            cursor += n;
+            dirty = true;
+        }
+
+        void delete_char() {
+            if (cursor > 0) delete_range(cursor - 1, cursor);
+        }
+
+        void delete_forward() {
+            if (cursor < total) delete_range(cursor, cursor + 1);
+        }
+
+        void delete_range(size_type start, size_type end) {
+            if (start > end) std::swap(start, end);
+            if (end > total) end = total;
+            cursor = std::min(start, total);
+            if (start >= end) return;
+            edit_log.erased(start, end, point_at(start), point_at(end));
+            lines.on_erase(start, end);
+            size_type first = split_at(start);
+            size_type last = split_at(end);
+            pieces.erase(pieces.begin() + first, pieces.begin() + last);
+            total -= end - start;
+            hint_idx = first; hint_start = start;
+            dirty = true;
+        }
+
+        // No gap to move; the name is kept so the editor can stay buffer-agnostic.
+        void move_gap(size_type position) { cursor = std::min(position, total); }
+
+        std::string get_content() const {
+            std::string res;
+            res.reserve(total);
+            for (const Piece& p : pieces)
+                res.append(reinterpret_cast<const char*>(p.data), p.len);
+            return res;
+        }
+
+        std::string get_range(size_type start, size_type end) const {
+            if (start > end) std::swap(start, end);
+            if (end > total) end = total;
+            std::string res;
+            if (start >= end) return res;
+            res.reserve(end - start);
+            auto [idx, off] = locate(start);
+            for (; idx < pieces.size() && res.size() < end - start; ++idx, off = 0) {
+                size_type take = std::min(pieces[idx].len - off, end - start - res.size());
+                res.append(reinterpret_cast<const char*>(pieces[idx].data + off), take);
+            }
+            return res;
+        }
+
+        CharT get_char_at(size_t index) const {
+            auto [idx, off] = locate(index);
+            return idx < pieces.size() ? pieces[idx].data[off] : CharT{};
+        }
+
+        // Contiguous text from pos to the end of its piece. Valid until the next edit.
+        std::basic_string_view<CharT> chunk_at(size_type pos) const {
+            auto [idx, off] = locate(pos);
+            if (idx >= pieces.size()) return {};
+            return {pieces[idx].data + off, pieces[idx].len - off};
+        }
+
+        // Contiguous text ending at pos, starting at the beginning of its piece.
+        std::basic_string_view<CharT> chunk_before(size_type pos) const {
+            if (pos == 0) return {};
+            auto [idx, off] = locate(pos - 1);
+            return {pieces[idx].data, off + 1};
+        }
+
+        // Line queries are O(log lines); the mapped file is only scanned as far as anyone has looked.
+        size_type line_start(size_type line) const { return lines.line_start(line, run_reader(), total); }
+        size_type line_of(size_type offset) const { return lines.line_of(offset, run_reader(), total); }
+        size_type line_count() const { return lines.line_count(run_reader(), total); }
+
+        void take_edits(EditBatch& out) { edit_log.take(out); }
+
+        // O(pieces), no text copied: the pieces point into add blocks that are never rewritten
+        // and the mapped file, and the snapshot holds on to both. An in-place save does write
+        // under the mapping: it pins what the live pieces need, and whoever holds an older
+        // snapshot has to be done reading it first.
+        TextSnapshot<CharT> snapshot() const {
+            TextSnapshot<CharT> snap;
+            for (const Piece& p : pieces) snap.add_run(p.data, p.len);
+            if (original) snap.keep(original);
+            for (const auto& b : add_blocks) snap.keep(b);
+            return snap;
+        }
+
+        size_type size() const { return total; }
+        size_type get_cursor() const { return cursor; }
+        bool is_dirty() const { return dirty; }
+        void set_dirty(bool d) { dirty = d; }
+
+        // A piece of the mapped file that sits at its old offset matches the file there;
+        // added text and shifted pieces may not. False if nothing is mapped, or the mapping
+        // is no longer the file.
+        bool dirty_extents(std::vector<Extent>& out) const {
+            out.clear();
+            if (!tracking) return false;
+            size_type pos = 0;
+            for (const Piece& p : pieces) {
+                if (!from_file(p) || file_offset(p) != pos) {
+                    if (!out.empty() && out.back().end == pos) out.back().end += p.len;
+                    else out.push_back({pos, pos + p.len});
+                }
+                pos += p.len;
+            }
+            return true;
+        }
+        const FileStamp& disk_stamp() const { return stamp; }
+
+        // Writing the extents in place changes the mapped bytes under them. A shifted piece
+        // that reads from there gets its own copy first. (A piece at its own offset is clean,
+        // so it never overlaps an extent.)
+        void pin_extents(const std::vector<Extent>& extents) {
+            for (Piece& p : pieces) {
+                if (!from_file(p)) continue;
+                size_type from = file_offset(p), to = from + p.len;
+                auto it = std::upper_bound(extents.begin(), extents.end(), from,
+                                           [](size_type v, const Extent& e) { return v < e.end; });
+                if (it != extents.end() && it->start < to) p.data = append_add(p.data, p.len);
+            }
+        }
+
+        // The file, as s describes it, now holds exactly this text: map it again and start
+        // over from one piece, so the next save compares against what's really there.
+        void mark_saved(const std::string& filename, const FileStamp& s) {
+            stamp = {};
+            tracking = false;
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            struct stat st;
+            auto file = std::make_shared<MappedFile>();
+            bool ok = fstat(fd, &st) == 0 && FileStamp::of(st) == s && (size_t)st.st_size == total * sizeof(CharT) &&
+                      file->map(fd, st.st_size);
+            close(fd);
+            if (!ok) return;
+            original = std::move(file);
+            pieces.clear();
+            if (total) pieces.push_back({static_cast<const CharT*>(original->addr), total});
+            add_blocks.clear();
+            add_used = add_capacity = 0;
+            hint_idx = hint_start = 0;
+            stamp = s;
+            tracking = true;
+        }
+
+        // The file, as s describes it, holds the text as it was some edits ago. The pieces
+        // still read the old file's mapping, so they can't say what differs from the new one
+        // until the next full save maps that.
+        void mark_saved_earlier(const FileStamp& s) {
+            stamp = s;
+            tracking = false;
+        }
+
+    private:
+        struct Piece {
+            const CharT* data;
+            size_type len;
+        };
+
+        // Shared so snapshots can outlive edits, reloads and the table itself.
+        std::shared_ptr<MappedFile> original;
+        std::vector<std::shared_ptr<CharT[]>> add_blocks;
+        size_type add_used = 0;
+        size_type add_capacity = 0;
+        std::vector<Piece> pieces;
+        size_type total = 0;
+        size_type cursor = 0;
+        bool dirty = false;
+        mutable LineIndex<CharT> lines;
+        EditLog edit_log;
+        FileStamp stamp; // of the file on disk as last loaded or saved
+        bool tracking = false; // the mapping is that file, so pieces at their own offset match it
+        // Edits cluster around the cursor, so remember where the last lookup landed.
+        // Invariant: hint_start is the offset of pieces[hint_idx] (or total at the end).
+        mutable size_type hint_idx = 0;
+        mutable size_type hint_start = 0;
+
+        bool from_file(const Piece& p) const {
+            const CharT* base = original ? static_cast<const CharT*>(original->addr) : nullptr;
+            return base && p.data >= base && p.data < base + original->length / sizeof(CharT);
+        }
+        size_type file_offset(const Piece& p) const { return p.data - static_cast<const CharT*>(original->addr); }
+
+        // Append-only: blocks are never reallocated, so pieces can point straight into them.
+        const CharT* append_add(const CharT* s, size_type n) {
+            if (add_used + n > add_capacity) {
+                add_capacity = std::max(ADD_BLOCK_SIZE, n);
+                add_blocks.push_back(std::make_shared_for_overwrite<CharT[]>(add_capacity));
+                add_used = 0;
+            }
+            CharT* dst = add_blocks.back().get() + add_used;
+            std::copy(s, s + n, dst);
+            add_used += n;
+            return dst;
+        }
+
+        TextPoint point_at(size_type pos) const {
+            size_type row = line_of(pos);
+            return {(uint32_t)row, (uint32_t)(pos - line_start(row))};
+        }
+
+        auto run_reader() const {
+            return [this](size_type pos) { return chunk_at(pos); };
+        }
+
+        // Returns {piece index, offset within piece}; {pieces.size(), 0} at end of text.
+        std::pair<size_type, size_type> locate(size_type pos) const {
+            if (pos >= total) return {pieces.size(), 0};
+            size_type idx = hint_idx, start = hint_start;
+            if (idx > pieces.size()) { idx = 0; start = 0; }
+            while (pos < start) { --idx; start -= pieces[idx].len; }
+            while (pos >= start + pieces[idx].len) { start += pieces[idx].len; ++idx; }
+            hint_idx = idx; hint_start = start;
+            return {idx, pos - start};
+        }
+
+        // Ensures a piece boundary at pos and returns the index of the piece starting there.
+        size_type split_at(size_type pos) {
+            auto [idx, off] = locate(pos);
+            if (off == 0) return idx;
+            Piece& p = pieces[idx];
+            Piece tail{p.data + off, p.len - off};
+            p.len = off;
+            pieces.insert(pieces.begin() + idx + 1, tail);
+            return idx + 1;
+        }
+    };
+
+    static_assert(honeymoon::kernel::EditableBuffer<PieceTable<char>>);
+}
@@ -0,0 +1,713 @@
+/*
+ * Regex.
+ * Thompson NFA, turned into a DFA one state at a time as the text asks for it.
+ * No backtracking, so no pattern can make it go exponential: every byte is one table
+ * lookup, or one NFA step when the table hasn't seen it yet.
+ */
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace honeymoon::search {
+
+    struct Match {
+        size_t start = std::string_view::npos;
+        size_t end = std::string_view::npos;
+        bool found() const noexcept { return start != std::string_view::npos; }
+    };
+
+    // Bytes, not code points. Supports . [] [^] \d \w \s (and negations) ^ $ | () (?:)
+    // * + ? {m,n} and lazy quantifiers. ^ and $ match at line boundaries.
+    class Regex {
+    public:
+        static constexpr size_t MAX_INSTS = 20000;
+        static constexpr int MAX_REPEAT = 1000;
+        static constexpr size_t DFA_CACHE_STATES = 1024; // per automaton; about 1 KB each
+
+        Regex() = default;
+        // The automata point into the programs, so a copy rebinds them to its own, caches empty.
+        Regex(const Regex& other) { *this = other; }
+        Regex(Regex&& other) noexcept { *this = std::move(other); }
+        Regex& operator=(const Regex& other) {
+            if (this != &other) {
+                error_ = other.error_;
+                sets_ = other.sets_;
+                forward_ = other.forward_;
+                reverse_ = other.reverse_;
+                valid_ = other.valid_;
+                bind();
+            }
+            return *this;
+        }
+        Regex& operator=(Regex&& other) noexcept {
+            if (this != &other) {
+                error_ = std::move(other.error_);
+                sets_ = std::move(other.sets_);
+                forward_ = std::move(other.forward_);
+                reverse_ = std::move(other.reverse_);
+                valid_ = std::exchange(other.valid_, false);
+                bind();
+                other.bind();
+            }
+            return *this;
+        }
+
+        bool compile(std::string_view pattern) {
+            *this = Regex();
+            src_ = pattern;
+            at_ = 0;
+            int root = parse_alt();
+            if (root >= 0 && at_ < src_.size())
+                fail(src_[at_] == ')' ? "unmatched )" : "syntax error");
+            if (!error_.empty())
+                return false;
+            if (!build(forward_, root, false) || !build(reverse_, root, true))
+                return false;
+            ast_.clear();
+            src_ = {};
+            valid_ = true;
+            bind();
+            return true;
+        }
+
+        bool valid() const noexcept { return valid_; }
+        const std::string& error() const noexcept { return error_; }
+
+        // The leftmost match starting at or after `from`.
+        template <typename Buf>
+        Match search_forward(const Buf& buffer, size_t from) {
+            if (!valid_ || from > buffer.size())
+                return {};
+            size_t end = scan_forward(buffer, fwd_, from, buffer.size());
+            if (end == NONE)
+                return {};
+            // The end is known; the reversed pattern, run back from it, finds where it started.
+            size_t start = scan_backward(buffer, rev_, end, from, false);
+            return {start == NONE ? end : start, end};
+        }
+
+        // The match starting last that ends at or before `from`, as Emacs does it.
+        template <typename Buf>
+        Match search_backward(const Buf& buffer, size_t from) {
+            if (!valid_)
+                return {};
+            from = std::min(from, buffer.size());
+            size_t start = scan_backward(buffer, rev_unanchored_, from, 0, true);
+            if (start == NONE)
+                return {};
+            // Bounded like Emacs's search limit, so the longest match from there can't run past `from`.
+            size_t end = scan_forward(buffer, fwd_anchored_, start, from);
+            return {start, end == NONE ? start : end};
+        }
+
+    private:
+        static constexpr size_t NONE = std::string_view::npos;
+        static constexpr int INF = -1;
+        static constexpr int END_OF_TEXT = 256;
+
+        using ByteSet = std::array<uint64_t, 4>;
+
+        static bool has(const ByteSet& s, int c) { return (s[(unsigned)c >> 6] >> (c & 63)) & 1; }
+        static void add(ByteSet& s, int c) { s[(unsigned)c >> 6] |= uint64_t(1) << (c & 63); }
+        static void add_range(ByteSet& s, int lo, int hi) {
+            for (int c = lo; c <= hi; ++c)
+                add(s, c);
+        }
+        static void invert(ByteSet& s) {
+            for (uint64_t& w : s)
+                w = ~w;
+        }
+
+        // -- Parsing --------------------------------------------------------------------------
+
+        struct Node {
+            enum Kind : uint8_t { Empty, Set, Bol, Eol, Concat, Alt, Repeat } kind;
+            uint32_t set = 0;
+            int min = 0, max = 0;
+            bool greedy = true;
+            std::vector<int> kids;
+        };
+
+        std::string_view src_;
+        size_t at_ = 0;
+        std::string error_;
+        std::vector<Node> ast_;
+        std::vector<ByteSet> sets_;
+
+        int fail(const char* msg) {
+            if (error_.empty())
+                error_ = msg;
+            return -1;
+        }
+
+        bool more() const { return at_ < src_.size(); }
+        char peek() const { return src_[at_]; }
+
+        int node(Node n) {
+            ast_.push_back(std::move(n));
+            return (int)ast_.size() - 1;
+        }
+
+        int set_node(const ByteSet& s) {
+            sets_.push_back(s);
+            return node({Node::Set, (uint32_t)sets_.size() - 1, 0, 0, true, {}});
+        }
+
+        int parse_alt() {
+            int first = parse_concat();
+            if (first < 0 || !more() || peek() != '|')
+                return first;
+            Node alt{Node::Alt, 0, 0, 0, true, {first}};
+            while (more() && peek() == '|') {
+                at_++;
+                int next = parse_concat();
+                if (next < 0)
+                    return -1;
+                alt.kids.push_back(next);
+            }
+            return node(std::move(alt));
+        }
+
+        int parse_concat() {
+            Node cat{Node::Concat, 0, 0, 0, true, {}};
+            while (more() && peek() != '|' && peek() != ')') {
+                int item = parse_repeat();
+                if (item < 0)
+                    return -1;
+                cat.kids.push_back(item);
+            }
+            if (cat.kids.empty())
+                return node({Node::Empty, 0, 0, 0, true, {}});
+            if (cat.kids.size() == 1)
+                return cat.kids[0];
+            return node(std::move(cat));
+        }
+
+        int parse_repeat() {
+            int atom = parse_atom();
+            while (atom >= 0 && more()) {
+                int lo, hi;
+                char c = peek();
+                if (c == '*') {
+                    lo = 0, hi = INF;
+                } else if (c == '+') {
+                    lo = 1, hi = INF;
+                } else if (c == '?') {
+                    lo = 0, hi = 1;
+                } else if (c == '{') {
+                    size_t save = at_;
+                    if (!parse_bounds(lo, hi)) {
+                        if (!error_.empty())
+                            return -1;
+                        at_ = save; // not a bound after all; '{' is a literal
+                        break;
+                    }
+                    at_--; // parse_bounds stops on the '}', which is consumed below
+                } else {
+                    break;
+                }
+                at_++;
+                bool greedy = true;
+                if (more() && peek() == '?') {
+                    greedy = false;
+                    at_++;
+                }
+                atom = node({Node::Repeat, 0, lo, hi, greedy, {atom}});
+            }
+            return atom;
+        }
+
+        // {m}, {m,}, {m,n}. Leaves at_ just past the '}' on success.
+        bool parse_bounds(int& lo, int& hi) {
+            at_++;
+            auto number = [this](int& out) {
+                size_t begin = at_;
+                out = 0;
+                while (more() && peek() >= '0' && peek() <= '9' && out <= MAX_REPEAT)
+                    out = out * 10 + (src_[at_++] - '0');
+                return at_ > begin;
+            };
+            if (!number(lo))
+                return false;
+            hi = lo;
+            if (more() && peek() == ',') {
+                at_++;
+                if (!number(hi))
+                    hi = INF;
+            }
+            if (!more() || peek() != '}')
+                return false;
+            at_++;
+            if (lo > MAX_REPEAT || hi > MAX_REPEAT)
+                return fail("repeat count too large") >= 0;
+            if (hi != INF && hi < lo)
+                return fail("bad repeat range") >= 0;
+            return true;
+        }
+
+        int parse_atom() {
+            char c = src_[at_++];
+            switch (c) {
+            case '(': {
+                if (src_.substr(at_, 2) == "?:")
+                    at_ += 2;
+                int inner = parse_alt();
+                if (inner < 0)
+                    return -1;
+                if (!more() || peek() != ')')
+                    return fail("missing )");
+                at_++;
+                return inner;
+            }
+            case '[':
+                return parse_class();
+            case '.': {
+                ByteSet s{};
+                add(s, '\n');
+                invert(s);
+                return set_node(s);
+            }
+            case '^':
+                return node({Node::Bol, 0, 0, 0, true, {}});
+            case '$':
+                return node({Node::Eol, 0, 0, 0, true, {}});
+            case '*':
+            case '+':
+            case '?':
+                return fail("nothing to repeat");
+            case '\\': {
+                ByteSet s{};
+                if (!parse_escape(s))
+                    return -1;
+                return set_node(s);
+            }
+            default: {
+                ByteSet s{};
+                add(s, (unsigned char)c);
+                return set_node(s);
+            }
+            }
+        }
+
+        // After a backslash: a class shorthand or an escaped byte.
+        bool parse_escape(ByteSet& s) {
+            if (!more())
+                return fail("trailing \\") >= 0;
+            char c = src_[at_++];
+            ByteSet t{};
+            switch (c) {
+            case 'd': case 'D':
+                add_range(t, '0', '9');
+                break;
+            case 'w': case 'W':
+                add_range(t, '0', '9'), add_range(t, 'a', 'z'), add_range(t, 'A', 'Z'), add(t, '_');
+                break;
+            case 's': case 'S':
+                for (char w : {' ', '\t', '\n', '\r', '\f', '\v'})
+                    add(t, w);
+                break;
+            case 'n': add(t, '\n'); break;
+            case 't': add(t, '\t'); break;
+            case 'r': add(t, '\r'); break;
+            case 'f': add(t, '\f'); break;
+            case 'v': add(t, '\v'); break;
+            case 'b': case 'B': case 'A': case 'z': case 'Z':
+                return fail("assertion not supported") >= 0;
+            default:
+                if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+                    return fail("unknown escape") >= 0;
+                add(t, (unsigned char)c);
+            }
+            if (c == 'D' || c == 'W' || c == 'S')
+                invert(t);
+            for (size_t i = 0; i < 4; ++i)
+                s[i] |= t[i];
+            return true;
+        }
+
+        int parse_class() {
+            ByteSet s{};
+            bool negate = more() && peek() == '^';
+            if (negate)
+                at_++;
+            bool first = true;
+            while (more() && (peek() != ']' || first)) {
+                first = false;
+                int lo = (unsigned char)src_[at_++];
+                if (lo == '\\') {
+                    ByteSet e{};
+                    if (!parse_escape(e))
+                        return -1;
+                    for (size_t i = 0; i < 4; ++i)
+                        s[i] |= e[i];
+                    continue;
+                }
+                if (at_ + 1 < src_.size() && peek() == '-' && src_[at_ + 1] != ']') {
+                    at_++;
+                    int hi = (unsigned char)src_[at_++];
+                    if (hi == '\\') {
+                        if (!more())
+                            return fail("trailing \\");
+                        hi = (unsigned char)src_[at_++];
+                    }
+                    if (hi < lo)
+                        return fail("bad character range");
+                    add_range(s, lo, hi);
+                } else {
+                    add(s, lo);
+                }
+            }
+            if (!more())
+                return fail("missing ]");
+            at_++;
+            if (negate)
+                invert(s);
+            return set_node(s);
+        }
+
+        // -- NFA ------------------------------------------------------------------------------
+
+        struct Inst {
+            enum Op : uint8_t { Byte, Split, Bol, Eol, Match } op;
+            uint32_t out = 0, out1 = 0; // Split prefers out
+            uint32_t set = 0;
+        };
+
+        struct Program {
+            std::vector<Inst> insts;
+            std::vector<ByteSet> sets;
+            uint32_t start = 0;
+        };
+
+        Program forward_, reverse_;
+
+        // The reverse program reads the text backwards: concatenations run the other way and
+        // ^ and $ trade places.
+        bool build(Program& p, int root, bool reversed) {
+            p.sets = sets_;
+            p.insts.push_back({Inst::Match});
+            long start = emit(p, root, 0, reversed);
+            if (start < 0)
+                return false;
+            p.start = (uint32_t)start;
+            return true;
+        }
+
+        long push(Program& p, Inst in) {
+            if (p.insts.size() >= MAX_INSTS)
+                return fail("regexp too big");
+            p.insts.push_back(in);
+            return (long)p.insts.size() - 1;
+        }
+
+        // Emits `n` followed by `next`; returns where it starts. Built back to front.
+        long emit(Program& p, int n, uint32_t next, bool reversed) {
+            const Node& nd = ast_[n];
+            switch (nd.kind) {
+            case Node::Empty:
+                return next;
+            case Node::Set:
+                return push(p, {Inst::Byte, next, 0, nd.set});
+            case Node::Bol:
+                return push(p, {reversed ? Inst::Eol : Inst::Bol, next});
+            case Node::Eol:
+                return push(p, {reversed ? Inst::Bol : Inst::Eol, next});
+            case Node::Concat: {
+                long at = next;
+                for (size_t i = 0; i < nd.kids.size() && at >= 0; ++i)
+                    at = emit(p, reversed ? nd.kids[i] : nd.kids[nd.kids.size() - 1 - i], (uint32_t)at, reversed);
+                return at;
+            }
+            case Node::Alt: {
+                long at = emit(p, nd.kids.back(), next, reversed);
+                for (size_t i = nd.kids.size() - 1; i-- > 0 && at >= 0;) {
+                    long kid = emit(p, nd.kids[i], next, reversed);
+                    if (kid < 0)
+                        return -1;
+                    at = push(p, {Inst::Split, (uint32_t)kid, (uint32_t)at});
+                }
+                return at;
+            }
+            case Node::Repeat: {
+                int kid = nd.kids[0];
+                auto split = [&](long body, uint32_t skip) -> long {
+                    if (body < 0)
+                        return -1;
+                    return nd.greedy ? push(p, {Inst::Split, (uint32_t)body, skip})
+                                     : push(p, {Inst::Split, skip, (uint32_t)body});
+                };
+                long tail;
+                if (nd.max == INF) {
+                    // The loop's split is patched once the body exists.
+                    long loop = push(p, {Inst::Split, 0, 0});
+                    if (loop < 0)
+                        return -1;
+                    long body = emit(p, kid, (uint32_t)loop, reversed);
+                    if (body < 0)
+                        return -1;
+                    Inst& s = p.insts[loop];
+                    s.out = nd.greedy ? (uint32_t)body : next;
+                    s.out1 = nd.greedy ? next : (uint32_t)body;
+                    tail = loop;
+                } else {
+                    // x{0,2} is (x(x)?)?
+                    tail = next;
+                    for (int i = 0; i < nd.max - nd.min && tail >= 0; ++i)
+                        tail = split(emit(p, kid, (uint32_t)tail, reversed), next);
+                }
+                for (int i = 0; i < nd.min && tail >= 0; ++i)
+                    tail = emit(p, kid, (uint32_t)tail, reversed);
+                return tail;
+            }
+            }
+            return -1;
+        }
+
+        // -- Lazy DFA -------------------------------------------------------------------------
+
+        // A DFA state is an ordered list of NFA threads, highest priority first. Leftmost-first
+        // automata drop everything behind a match, which is what makes the first match win.
+        class Dfa {
+        public:
+            void init(const Program* p, bool unanchored, bool leftmost_first) {
+                prog = p;
+                this->unanchored = unanchored;
+                this->leftmost_first = leftmost_first;
+                reset();
+            }
+
+            static constexpr int32_t UNKNOWN = -1;
+            static constexpr int32_t DEAD = -1;
+
+            int32_t start(bool bol) {
+                list.clear();
+                mark.assign(prog->insts.size(), 0);
+                follow(list, prog->start, bol, false);
+                return intern(list, bol ? F_BOL : 0);
+            }
+
+            // Low bit: a match ends before this byte. The rest: next state + 1, 0 for dead.
+            int32_t step(int32_t s, int c) {
+                int32_t t = trans[(size_t)s * 257 + c];
+                return t != UNKNOWN ? t : compute(s, c);
+            }
+
+            static int32_t next_of(int32_t t) { return (t >> 1) - 1; }
+
+        private:
+            enum : uint8_t { F_BOL = 1, F_MATCHED = 2 };
+
+            const Program* prog = nullptr;
+            bool unanchored = false, leftmost_first = false;
+            std::vector<std::vector<uint32_t>> lists;
+            std::vector<uint8_t> flags;
+            std::vector<int32_t> trans;
+            std::unordered_map<std::string, int32_t> index;
+            std::vector<uint32_t> list, next_list;
+            std::vector<uint8_t> mark;
+            uint32_t generation = 0;
+
+            void reset() {
+                lists.clear();
+                flags.clear();
+                trans.clear();
+                index.clear();
+                generation++;
+            }
+
+            // Adds inst and everything reachable from it without reading a byte. Pending $
+            // assertions stay in the list until the next byte shows whether they hold.
+            void follow(std::vector<uint32_t>& out, uint32_t i, bool bol, bool eol) {
+                std::vector<uint32_t>& stack = follow_stack;
+                stack.assign(1, i);
+                while (!stack.empty()) {
+                    uint32_t at = stack.back();
+                    stack.pop_back();
+                    if (mark[at])
+                        continue;
+                    mark[at] = 1;
+                    const Inst& in = prog->insts[at];
+                    switch (in.op) {
+                    case Inst::Split:
+                        stack.push_back(in.out1);
+                        stack.push_back(in.out);
+                        break;
+                    case Inst::Bol:
+                        if (bol)
+                            stack.push_back(in.out);
+                        break;
+                    case Inst::Eol:
+                        if (eol)
+                            stack.push_back(in.out);
+                        else
+                            out.push_back(at);
+                        break;
+                    default:
+                        out.push_back(at);
+                    }
+                }
+            }
+            std::vector<uint32_t> follow_stack;
+
+            int32_t intern(const std::vector<uint32_t>& l, uint8_t f) {
+                std::string key(1, (char)f);
+                key.append(reinterpret_cast<const char*>(l.data()), l.size() * sizeof(uint32_t));
+                auto it = index.find(key);
+                if (it != index.end())
+                    return it->second;
+                if (lists.size() >= DFA_CACHE_STATES)
+                    reset(); // start over rather than grow without bound
+                int32_t id = (int32_t)lists.size();
+                lists.push_back(l);
+                flags.push_back(f);
+                trans.resize(trans.size() + 257, UNKNOWN);
+                index.emplace(std::move(key), id);
+                return id;
+            }
+
+            int32_t compute(int32_t s, int c) {
+                bool bol = flags[s] & F_BOL;
+                bool matched = flags[s] & F_MATCHED;
+                mark.assign(prog->insts.size(), 0);
+                list.clear();
+                // A '\n' or the end of the text satisfies the pending $ threads.
+                bool eol = c == '\n' || c == END_OF_TEXT;
+                for (uint32_t i : lists[s]) {
+                    if (eol && prog->insts[i].op == Inst::Eol)
+                        follow(list, prog->insts[i].out, bol, true);
+                    else if (!mark[i])
+                        mark[i] = 1, list.push_back(i);
+                }
+                bool match_here = false;
+                for (size_t k = 0; k < list.size(); ++k) {
+                    if (prog->insts[list[k]].op == Inst::Match) {
+                        match_here = true;
+                        if (leftmost_first) {
+                            list.resize(k); // lower-priority threads can't win any more
+                            matched = true;
+                        }
+                        break;
+                    }
+                }
+                int32_t result = match_here ? 1 : 0;
+                if (c == END_OF_TEXT)
+                    return result;
+
+                bool nbol = c == '\n';
+                mark.assign(prog->insts.size(), 0);
+                next_list.clear();
+                for (uint32_t i : list) {
+                    const Inst& in = prog->insts[i];
+                    if (in.op == Inst::Byte && has(prog->sets[in.set], c))
+                        follow(next_list, in.out, nbol, false);
+                }
+                bool searching = unanchored && !matched;
+                if (searching)
+                    follow(next_list, prog->start, nbol, false);
+                if (next_list.empty() && !searching)
+                    return result; // dead
+
+                uint32_t gen = generation;
+                int32_t target = intern(next_list, (nbol ? F_BOL : 0) | (matched ? F_MATCHED : 0));
+                result |= (target + 1) << 1;
+                if (gen == generation)
+                    trans[(size_t)s * 257 + c] = result;
+                return result;
+            }
+        };
+
+        Dfa fwd_;            // unanchored, leftmost-first: where the first match ends
+        Dfa fwd_anchored_;   // the same from a known start
+        Dfa rev_;            // reversed, anchored, longest: where that match starts
+        Dfa rev_unanchored_; // reversed, first hit: the last match before a point
+        bool valid_ = false;
+
+        void bind() {
+            fwd_ = fwd_anchored_ = rev_ = rev_unanchored_ = Dfa();
+            if (!valid_)
+                return;
+            fwd_.init(&forward_, true, true);
+            fwd_anchored_.init(&forward_, false, true);
+            rev_.init(&reverse_, false, false);
+            rev_unanchored_.init(&reverse_, true, false);
+        }
+
+        template <typename Buf>
+        static int byte_at(const Buf& buffer, size_t pos) {
+            return (unsigned char)buffer.chunk_at(pos)[0];
+        }
+
+        // Returns the end, at or before `limit`, of the match the automaton settles on, or NONE.
+        template <typename Buf>
+        static size_t scan_forward(const Buf& buffer, Dfa& dfa, size_t from, size_t limit) {
+            size_t n = buffer.size();
+            int32_t s = dfa.start(from == 0 || byte_at(buffer, from - 1) == '\n');
+            size_t last = NONE;
+            for (size_t pos = from; pos < limit;) {
+                std::string_view run = buffer.chunk_at(pos).substr(0, limit - pos);
+                for (size_t i = 0; i < run.size(); ++i) {
+                    int32_t t = dfa.step(s, (unsigned char)run[i]);
+                    if (t & 1)
+                        last = pos + i;
+                    s = Dfa::next_of(t);
+                    if (s < 0)
+                        return last;
+                }
+                pos += run.size();
+            }
+            // As in scan_backward, whether it matches at the limit depends on the byte beyond it.
+            if (dfa.step(s, limit == n ? END_OF_TEXT : byte_at(buffer, limit)) & 1)
+                last = limit;
+            return last;
+        }
+
+        // Runs the reversed program from `from` down to `bound`. Returns the lowest position
+        // where it matched, or with `first` the highest.
+        template <typename Buf>
+        size_t scan_backward(const Buf& buffer, Dfa& dfa, size_t from, size_t bound, bool first) {
+            static constexpr size_t BLOCK = 64 * 1024;
+            size_t n = buffer.size();
+            int32_t s = dfa.start(from == n || byte_at(buffer, from) == '\n');
+            size_t last = NONE;
+            size_t pos = from;
+            while (pos > bound) {
+                size_t lo = pos - std::min(pos - bound, BLOCK);
+                // chunk_at only hands out runs forwards; collect them, then walk them backwards.
+                views_.clear();
+                for (size_t p = lo; p < pos;) {
+                    std::string_view run = buffer.chunk_at(p).substr(0, pos - p);
+                    views_.push_back(run);
+                    p += run.size();
+                }
+                for (size_t v = views_.size(); v-- > 0;) {
+                    std::string_view run = views_[v];
+                    for (size_t i = run.size(); i-- > 0;) {
+                        int32_t t = dfa.step(s, (unsigned char)run[i]);
+                        if (t & 1) {
+                            last = pos;
+                            if (first)
+                                return last;
+                        }
+                        s = Dfa::next_of(t);
+                        pos--;
+                        if (s < 0)
+                            return last;
+                    }
+                }
+            }
+            // Whether it matches at the bound depends on the byte beyond it.
+            if (dfa.step(s, bound == 0 ? END_OF_TEXT : byte_at(buffer, bound - 1)) & 1)
+                last = bound;
+            return last;
+        }
+        std::vector<std::string_view> views_;
+    };
+
+} // namespace honeymoon::search
@@ -0,0 +1,122 @@
+/*
+ * Replace.
+ * Find every match first, then write the new text out in one go.
+ * Two million replacements cost one copy of the region, not two million gap moves.
+ */
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "regex.hpp"
+#include "search.hpp"
+
+namespace honeymoon::search {
+
+    // What a match gets replaced with. The matched text goes between consecutive parts,
+    // so a literal template is a single part.
+    struct Template {
+        std::vector<std::string> parts;
+
+        static Template literal(std::string_view s) { return {{std::string(s)}}; }
+
+        // `\&` is the whole match and `\\` a backslash; any other backslash is kept as typed.
+        static Template parse(std::string_view s) {
+            Template t{{std::string()}};
+            for (size_t i = 0; i < s.size(); ++i) {
+                if (s[i] == '\\' && i + 1 < s.size() && s[i + 1] == '&') {
+                    t.parts.emplace_back();
+                    ++i;
+                } else {
+                    if (s[i] == '\\' && i + 1 < s.size() && s[i + 1] == '\\')
+                        ++i;
+                    t.parts.back().push_back(s[i]);
+                }
+            }
+            return t;
+        }
+
+        size_t copies() const { return parts.size() - 1; }
+        size_t fixed_size() const {
+            size_t n = 0;
+            for (const auto& p : parts)
+                n += p.size();
+            return n;
+        }
+    };
+
+    // Non-overlapping matches of needle in [from, to), leftmost first.
+    template <typename Buf>
+    std::vector<Match> find_all(const Buf& buffer, std::string_view needle, size_t from, size_t to) {
+        std::vector<Match> out;
+        size_t m = needle.size();
+        if (m == 0 || to < from + m)
+            return out;
+        scan(buffer, from, to - m + 1, needle, [&](size_t at) {
+            if (out.empty() || at >= out.back().end)
+                out.push_back({at, at + m});
+            return true;
+        });
+        return out;
+    }
+
+    // Same for a regexp. An empty match right where the previous match ended doesn't count,
+    // so `a*` over "baac" replaces before b, the aa, and before c, like Emacs does.
+    template <typename Buf>
+    std::vector<Match> find_all(const Buf& buffer, Regex& re, size_t from, size_t to) {
+        std::vector<Match> out;
+        while (from <= to) {
+            Match m = re.search_forward(buffer, from);
+            if (!m.found() || m.end > to)
+                break;
+            if (m.start == m.end && !out.empty() && out.back().end == m.start && out.back().start != m.start) {
+                from = m.start + 1;
+                continue;
+            }
+            out.push_back(m);
+            from = m.end > m.start ? m.end : m.end + 1;
+        }
+        return out;
+    }
+
+    namespace detail {
+
+        template <typename Buf>
+        void append_range(std::string& out, const Buf& buffer, size_t from, size_t to) {
+            while (from < to) {
+                std::string_view run = buffer.chunk_at(from);
+                if (run.empty())
+                    return;
+                run = run.substr(0, to - from);
+                out.append(run.data(), run.size());
+                from += run.size();
+            }
+        }
+
+    } // namespace detail
+
+    // The new text of [matches.front().start, matches.back().end), built in one pass over the runs.
+    template <typename Buf>
+    std::string splice(const Buf& buffer, const std::vector<Match>& matches, const Template& with) {
+        std::string out;
+        if (matches.empty())
+            return out;
+        size_t lo = matches.front().start, hi = matches.back().end;
+        size_t matched = 0;
+        for (const Match& m : matches)
+            matched += m.end - m.start;
+        out.reserve(hi - lo - matched + matches.size() * with.fixed_size() + matched * with.copies());
+        size_t pos = lo;
+        for (const Match& m : matches) {
+            detail::append_range(out, buffer, pos, m.start);
+            out += with.parts[0];
+            for (size_t i = 1; i < with.parts.size(); ++i) {
+                detail::append_range(out, buffer, m.start, m.end);
+                out += with.parts[i];
+            }
+            pos = m.end;
+        }
+        return out;
+    }
+
+} // namespace honeymoon::search
@@ -0,0 +1,440 @@
+/*
+ * Saving.
+ * Write a sibling, fsync it, rename it over the original. A crash leaves the old file or the
+ * new one, never half of each. The big ones are written on their own thread so typing goes on,
+ * and a big one with a typo fixed just gets the typo fixed.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "snapshot.hpp"
+
+namespace honeymoon::mem {
+
+    // [start, end) of the text, which may not match the same bytes of the file.
+    struct Extent {
+        size_t start = 0;
+        size_t end = 0;
+    };
+
+    // Enough of a stat to tell whether the file is still the one a buffer was read from.
+    struct FileStamp {
+        dev_t dev = 0;
+        ino_t ino = 0;
+        int64_t size = -1; // -1: no file known
+        int64_t mtime_ns = 0;
+
+        static FileStamp of(const struct stat& st) {
+            return {st.st_dev, st.st_ino, st.st_size, int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec};
+        }
+        bool known() const { return size >= 0; }
+        bool operator==(const FileStamp&) const = default;
+    };
+
+    inline FileStamp stamp_of(const std::string& path) {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 ? FileStamp::of(st) : FileStamp{};
+    }
+
+    // Whether two spellings of a path ("src/x.cpp", "./src/x.cpp", an absolute one) name the
+    // same file. Paths that don't exist are only the same if they're spelled the same.
+    inline bool same_file(const std::string& a, const std::string& b) {
+        if (a == b)
+            return true;
+        FileStamp sa = stamp_of(a), sb = stamp_of(b);
+        return sa.known() && sb.known() && sa.dev == sb.dev && sa.ino == sb.ino;
+    }
+
+    // Which stretches of a text still sit where they did in the file. Inserted text belongs to
+    // no file offset, and everything after an insert or erase sits somewhere new until the
+    // sizes even out again. Kept for the gap buffer, which otherwise has no memory of the file.
+    class ExtentMap {
+    public:
+        void reset(size_t size) {
+            segs_.clear();
+            if (size)
+                segs_.push_back({size, 0});
+        }
+
+        void insert(size_t pos, size_t n) {
+            size_t i = split(pos);
+            if (i > 0 && segs_[i - 1].from == NEW)
+                segs_[i - 1].len += n;
+            else
+                segs_.insert(segs_.begin() + i, {n, NEW});
+        }
+
+        void erase(size_t start, size_t end) {
+            size_t a = split(start), b = split(end);
+            segs_.erase(segs_.begin() + a, segs_.begin() + b);
+            if (a > 0 && a < segs_.size() && segs_[a - 1].from == NEW && segs_[a].from == NEW) {
+                segs_[a - 1].len += segs_[a].len;
+                segs_.erase(segs_.begin() + a);
+            }
+        }
+
+        void dirty(std::vector<Extent>& out) const {
+            size_t pos = 0;
+            for (const Seg& s : segs_) {
+                if (s.from != pos) {
+                    if (!out.empty() && out.back().end == pos)
+                        out.back().end += s.len;
+                    else
+                        out.push_back({pos, pos + s.len});
+                }
+                pos += s.len;
+            }
+        }
+
+    private:
+        static constexpr size_t NEW = SIZE_MAX;
+        struct Seg {
+            size_t len;
+            size_t from; // offset in the file, or NEW
+        };
+        std::vector<Seg> segs_;
+
+        // Ensures a segment starts at pos and returns its index.
+        size_t split(size_t pos) {
+            size_t at = 0;
+            for (size_t i = 0; i < segs_.size(); ++i) {
+                if (pos == at)
+                    return i;
+                if (pos < at + segs_[i].len) {
+                    size_t off = pos - at;
+                    Seg tail{segs_[i].len - off, segs_[i].from == NEW ? NEW : segs_[i].from + off};
+                    segs_[i].len = off;
+                    segs_.insert(segs_.begin() + i + 1, tail);
+                    return i + 1;
+                }
+                at += segs_[i].len;
+            }
+            return segs_.size();
+        }
+    };
+
+    // Writes the extents of the buffer over the file where it lies, growing it if the last one
+    // runs past the end. Not atomic: a crash halfway leaves some extents written and some not,
+    // which is why it's kept for a few changes to a big file. stamp is the file afterwards.
+    template <typename Buf>
+    bool patch_file(const std::string& path, const Buf& buffer, const std::vector<Extent>& extents, FileStamp& stamp,
+                    std::string& error) {
+        using CharT = typename Buf::value_type;
+        auto fail = [&](const char* what) {
+            error = std::string(what) + ": " + strerror(errno);
+            return false;
+        };
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0)
+            return fail("open");
+        bool ok = true;
+        for (const Extent& e : extents) {
+            for (size_t pos = e.start; ok && pos < e.end;) {
+                auto run = buffer.chunk_at(pos).substr(0, e.end - pos);
+                if (run.empty()) {
+                    errno = EINVAL;
+                    ok = fail("write");
+                    break;
+                }
+                const char* p = reinterpret_cast<const char*>(run.data());
+                size_t left = run.size() * sizeof(CharT);
+                off_t off = pos * sizeof(CharT);
+                while (left > 0) {
+                    ssize_t w = pwrite(fd, p, left, off);
+                    if (w < 0 && errno == EINTR)
+                        continue;
+                    if (w <= 0) {
+                        if (w == 0)
+                            errno = EIO;
+                        ok = fail("write");
+                        break;
+                    }
+                    p += w;
+                    off += w;
+                    left -= w;
+                }
+                pos += run.size();
+            }
+        }
+        if (ok)
+            ok = fdatasync(fd) == 0 || fail("fsync");
+        struct stat st;
+        if (ok)
+            ok = fstat(fd, &st) == 0 || fail("stat");
+        if (close(fd) < 0 && ok)
+            ok = fail("close");
+        if (ok)
+            stamp = FileStamp::of(st);
+        return ok;
+    }
+
+    namespace detail {
+
+        // writev() in batches of at most WRITE_CHUNK bytes, so progress can be reported as it goes.
+        template <typename Runs, typename OnProgress>
+        bool write_runs(int fd, const Runs& runs, OnProgress&& on_progress) {
+            constexpr size_t WRITE_CHUNK = 8 << 20;
+            constexpr int MAX_IOV = 64;
+            iovec iov[MAX_IOV];
+            int n = 0;
+            size_t batch = 0, written = 0;
+            auto flush = [&] {
+                for (int i = 0; i < n;) {
+                    ssize_t w = writev(fd, iov + i, n - i);
+                    if (w < 0 && errno == EINTR)
+                        continue;
+                    if (w <= 0) {
+                        if (w == 0)
+                            errno = EIO;
+                        return false;
+                    }
+                    written += w;
+                    for (size_t left = w; left > 0;) {
+                        size_t take = std::min(left, iov[i].iov_len);
+                        iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + take;
+                        iov[i].iov_len -= take;
+                        left -= take;
+                        if (iov[i].iov_len == 0)
+                            i++;
+                    }
+                }
+                n = 0;
+                batch = 0;
+                on_progress(written);
+                return true;
+            };
+            for (const auto& run : runs) {
+                const char* p = reinterpret_cast<const char*>(run.data());
+                size_t left = run.size() * sizeof(run[0]);
+                while (left > 0) {
+                    size_t take = std::min(left, WRITE_CHUNK - batch);
+                    iov[n++] = {const_cast<char*>(p), take};
+                    batch += take;
+                    p += take;
+                    left -= take;
+                    if ((n == MAX_IOV || batch == WRITE_CHUNK) && !flush())
+                        return false;
+                }
+            }
+            return flush();
+        }
+
+    } // namespace detail
+
+    // Writes the runs to path by way of a temporary file in the same directory, keeping the
+    // original's mode and owner. A symlink is followed, not replaced. On failure the original
+    // is untouched and error says why.
+    template <typename Runs, typename OnProgress>
+    bool write_file(const std::string& path, const Runs& runs, std::string& error, OnProgress&& on_progress,
+                    FileStamp* stamp = nullptr) {
+        std::string target = path;
+        if (char* real = realpath(path.c_str(), nullptr)) {
+            target = real;
+            free(real);
+        }
+        size_t slash = target.rfind('/');
+        std::string dir = slash == target.npos ? "." : slash == 0 ? "/" : target.substr(0, slash);
+        std::string name = target.substr(slash == target.npos ? 0 : slash + 1);
+        auto fail = [&](const char* what) {
+            error = std::string(what) + ": " + strerror(errno);
+            return false;
+        };
+
+        // A new file gets 0666 less the umask, like any other program's.
+        struct stat st;
+        bool existed = stat(target.c_str(), &st) == 0;
+        static std::atomic<unsigned> serial{0};
+        std::string tmp;
+        int fd;
+        do {
+            tmp = dir + "/." + name + "." + std::to_string(getpid()) + "-" + std::to_string(serial++) + ".tmp";
+            fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        } while (fd < 0 && errno == EEXIST);
+        if (fd < 0)
+            return fail("create");
+        if (existed)
+            (void)!fchown(fd, st.st_uid, st.st_gid); // not ours to give away: it ends up the saver's
+
+        bool ok = !existed || fchmod(fd, st.st_mode & 07777) == 0 || fail("chmod");
+        if (ok)
+            ok = detail::write_runs(fd, runs, on_progress) || fail("write");
+        if (ok)
+            ok = fsync(fd) == 0 || fail("fsync");
+        if (ok && stamp && fstat(fd, &st) == 0)
+            *stamp = FileStamp::of(st);
+        if (close(fd) < 0 && ok)
+            ok = fail("close");
+        if (ok)
+            ok = rename(tmp.c_str(), target.c_str()) == 0 || fail("rename");
+        if (!ok) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        // The rename is only durable once the directory is.
+        int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+        return true;
+    }
+
+    template <typename Runs>
+    bool write_file(const std::string& path, const Runs& runs, std::string& error) {
+        return write_file(path, runs, error, [](size_t) {});
+    }
+
+    struct SaveProgress {
+        uint64_t id = 0; // as save() returned it
+        std::string path;
+        size_t written = 0;
+        size_t total = 0;
+        double ms = 0;
+        bool done = false;
+        bool ok = false;
+        std::string error = {}; // when done and not ok
+        FileStamp stamp = {};   // of the file written, when done and ok
+    };
+
+    // Saves snapshots on a thread of its own. A save asked for while another is writing
+    // waits its turn; if several pile up, only the newest is written. Whatever is queued
+    // is still written when the saver is destroyed.
+    class FileSaver {
+    public:
+        static constexpr int PROGRESS_MS = 50; // how often a long save wakes the editor
+
+        FileSaver() { wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); }
+        ~FileSaver() {
+            {
+                std::lock_guard lock(m_);
+                stop_ = true;
+            }
+            wake_worker_.notify_one();
+            if (worker_.joinable())
+                worker_.join();
+            if (wake_fd_ >= 0)
+                close(wake_fd_);
+        }
+        FileSaver(const FileSaver&) = delete;
+        FileSaver& operator=(const FileSaver&) = delete;
+
+        // Readable whenever progress() has something new.
+        int wake_fd() const noexcept { return wake_fd_; }
+
+        uint64_t save(const std::string& path, TextSnapshot<char> text) {
+            if (!worker_.joinable())
+                worker_ = std::thread([this] { run(); });
+            uint64_t id;
+            {
+                std::lock_guard lock(m_);
+                id = ++posted_;
+                job_ = Job{id, path, std::move(text)};
+            }
+            wake_worker_.notify_one();
+            return id;
+        }
+
+        bool busy() {
+            std::lock_guard lock(m_);
+            return busy_ || job_;
+        }
+
+        // The save being written, or the last one to finish.
+        SaveProgress progress() {
+            uint64_t count;
+            while (read(wake_fd_, &count, sizeof(count)) == sizeof(count)) {
+            }
+            std::lock_guard lock(m_);
+            SaveProgress p = progress_;
+            p.written = written_.load(std::memory_order_relaxed);
+            if (!p.done)
+                p.ms = std::chrono::duration<double, std::milli>(Clock::now() - started_).count();
+            return p;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Job {
+            uint64_t id = 0;
+            std::string path;
+            TextSnapshot<char> text;
+        };
+
+        void run() {
+            for (;;) {
+                Job job;
+                {
+                    std::unique_lock lock(m_);
+                    wake_worker_.wait(lock, [this] { return stop_ || job_; });
+                    if (!job_)
+                        return;
+                    job = std::move(*job_);
+                    job_.reset();
+                    busy_ = true;
+                    progress_ = {job.id, job.path, 0, job.text.size()};
+                    written_ = 0;
+                    started_ = Clock::now();
+                }
+                wake();
+                auto last = Clock::now();
+                std::string error;
+                FileStamp stamp;
+                bool ok = write_file(
+                    job.path, job.text.runs(), error,
+                    [&](size_t written) {
+                        written_.store(written, std::memory_order_relaxed);
+                        if (Clock::now() - last >= std::chrono::milliseconds(PROGRESS_MS)) {
+                            last = Clock::now();
+                            wake();
+                        }
+                    },
+                    &stamp);
+                {
+                    std::lock_guard lock(m_);
+                    busy_ = false;
+                    progress_.done = true;
+                    progress_.ok = ok;
+                    progress_.error = std::move(error);
+                    progress_.stamp = stamp;
+                    progress_.ms = std::chrono::duration<double, std::milli>(Clock::now() - started_).count();
+                }
+                wake();
+            }
+        }
+
+        void wake() {
+            uint64_t one = 1;
+            (void)!write(wake_fd_, &one, sizeof(one));
+        }
+
+        std::thread worker_;
+        std::mutex m_;
+        std::condition_variable wake_worker_;
+        std::optional<Job> job_;
+        bool busy_ = false;
+        bool stop_ = false;
+        uint64_t posted_ = 0;
+        SaveProgress progress_;
+        std::atomic<size_t> written_{0};
+        Clock::time_point started_;
+        int wake_fd_ = -1;
+    };
+
+} // namespace honeymoon::mem
@@ -0,0 +1,220 @@
+/*
+ * Screen.
+ * Two cell grids: what the terminal is showing and what we want it to show.
+ * Only the difference goes over the wire, and SGR only goes out when the style changes.
+ */
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace honeymoon::driver {
+
+    class Screen {
+    public:
+        // A style is a static SGR string (or nullptr for plain text); cells compare it by identity.
+        struct Cell {
+            const char* style = nullptr;
+            char glyph[4] = {' ', 0, 0, 0};
+            uint8_t len = 1;
+            bool operator==(const Cell&) const = default;
+        };
+
+        int rows() const { return height; }
+        int cols() const { return width; }
+
+        // A resize invalidates whatever the terminal was showing, so the next flush starts from a clear.
+        void resize(int r, int c) {
+            if (r == height && c == width)
+                return;
+            height = std::max(r, 1);
+            width = std::max(c, 1);
+            front.assign((size_t)height * width, Cell{});
+            back.assign((size_t)height * width, Cell{});
+            full_redraw = true;
+        }
+
+        void invalidate() { full_redraw = true; }
+
+        // Starts a new frame: everything blank, cursor hidden until someone places it.
+        void begin_frame() {
+            std::fill(back.begin(), back.end(), Cell{});
+            cursor_visible = false;
+        }
+
+        // Writes UTF-8 text at (row, col), one code point per cell, clipped at the edge. A cell is
+        // a byte and the continuation bytes after it, so a caller can count columns without decoding.
+        // Control characters become blanks so they can't move the real cursor behind our back.
+        // Returns the column after the last cell written.
+        int put(int row, int col, std::string_view text, const char* style = nullptr) {
+            if (row < 0 || row >= height)
+                return col;
+            Cell* line = &back[(size_t)row * width];
+            size_t i = 0;
+            while (i < text.size() && col < width) {
+                unsigned char lead = static_cast<unsigned char>(text[i]);
+                size_t n = 1;
+                while (i + n < text.size() && (static_cast<unsigned char>(text[i + n]) & 0xC0) == 0x80)
+                    n++;
+                if (col >= 0) {
+                    Cell& cell = line[col];
+                    cell = Cell{};
+                    cell.style = style;
+                    if (lead < 0x20 || lead == 0x7f) {
+                        cell.glyph[0] = ' ';
+                    } else {
+                        size_t keep = std::min(n, sizeof(cell.glyph)); // anything longer isn't UTF-8
+                        std::copy(text.begin() + i, text.begin() + i + keep, cell.glyph);
+                        cell.len = (uint8_t)keep;
+                    }
+                }
+                i += n;
+                col++;
+            }
+            return col;
+        }
+
+        int fill(int row, int col, int n, char c, const char* style = nullptr) {
+            for (int i = 0; i < n; ++i)
+                col = put(row, col, std::string_view(&c, 1), style);
+            return col;
+        }
+
+        void set_cursor(int row, int col) {
+            cursor_row = std::clamp(row, 0, height - 1);
+            cursor_col = std::clamp(col, 0, width - 1);
+            cursor_visible = true;
+        }
+
+        // Appends the escape sequences that turn the old frame into the new one.
+        // Returns false (and appends nothing) when the terminal is already up to date.
+        template <typename Out>
+        bool flush(Out& out) {
+            bool emitted = false;
+            auto begin_update = [&] {
+                if (emitted)
+                    return;
+                emitted = true;
+                out.append("\x1b[?2026h\x1b[?25l");
+                if (full_redraw) {
+                    out.append("\x1b[m\x1b[H\x1b[2J");
+                    std::fill(front.begin(), front.end(), Cell{});
+                }
+                term_row = term_col = -1;
+                pen = nullptr;
+            };
+            if (full_redraw)
+                begin_update();
+
+            for (int r = 0; r < height; ++r) {
+                const Cell* want = &back[(size_t)r * width];
+                const Cell* have = &front[(size_t)r * width];
+                if (std::equal(want, want + width, have))
+                    continue;
+                begin_update();
+                int blank_from = width;
+                while (blank_from > 0 && want[blank_from - 1] == Cell{})
+                    blank_from--;
+                for (int c = 0; c < width; ++c) {
+                    if (want[c] == have[c])
+                        continue;
+                    if (c >= blank_from) {
+                        move_to(out, r, c);
+                        set_pen(out, nullptr); // EL paints with the current background
+                        out.append("\x1b[K");
+                        break;
+                    }
+                    // Rewriting a few unchanged cells is cheaper than a cursor move.
+                    if (r == term_row && term_col >= 0 && term_col < c && c - term_col <= MAX_BRIDGE) {
+                        for (int b = term_col; b < c; ++b)
+                            emit(out, want[b]);
+                    }
+                    move_to(out, r, c);
+                    emit(out, want[c]);
+                }
+            }
+            set_pen(out, nullptr);
+
+            bool cursor_moved = cursor_visible != shown_visible ||
+                                (cursor_visible && (cursor_row != shown_row || cursor_col != shown_col));
+            if (!emitted && !cursor_moved)
+                return false;
+            if (cursor_visible) {
+                term_row = term_col = -1;
+                move_to(out, cursor_row, cursor_col);
+                out.append("\x1b[?25h");
+            } else if (!emitted) {
+                out.append("\x1b[?25l");
+            }
+            if (emitted)
+                out.append("\x1b[?2026l");
+
+            std::swap(front, back);
+            full_redraw = false;
+            shown_visible = cursor_visible;
+            shown_row = cursor_row;
+            shown_col = cursor_col;
+            return true;
+        }
+
+    private:
+        int height = 0, width = 0;
+        std::vector<Cell> front; // what the terminal shows
+        std::vector<Cell> back;  // the frame being drawn
+        bool full_redraw = true;
+        int cursor_row = 0, cursor_col = 0;
+        bool cursor_visible = false;
+        int shown_row = -1, shown_col = -1;
+        bool shown_visible = false;
+        int term_row = -1, term_col = -1; // where the real cursor is, -1 if unknown
+        const char* pen = nullptr;        // style the terminal is currently drawing with
+        static constexpr int MAX_BRIDGE = 4;
+
+        template <typename Out>
+        static void append_num(Out& out, int n) {
+            char digits[12];
+            int len = 0;
+            do {
+                digits[len++] = char('0' + n % 10);
+                n /= 10;
+            } while (n > 0);
+            while (len > 0)
+                out.append(digits[--len]);
+        }
+
+        template <typename Out>
+        void move_to(Out& out, int r, int c) {
+            if (r == term_row && c == term_col)
+                return;
+            out.append("\x1b[");
+            append_num(out, r + 1);
+            out.append(';');
+            append_num(out, c + 1);
+            out.append('H');
+            term_row = r;
+            term_col = c;
+        }
+
+        template <typename Out>
+        void set_pen(Out& out, const char* style) {
+            if (style == pen)
+                return;
+            if (pen || !style)
+                out.append("\x1b[m");
+            if (style)
+                out.append(style);
+            pen = style;
+        }
+
+        template <typename Out>
+        void emit(Out& out, const Cell& cell) {
+            set_pen(out, cell.style);
+            out.append(cell.glyph, cell.len);
+            // Writing the last column leaves the terminal in its pending-wrap state; don't trust it.
+            term_col = (term_col + 1 < width) ? term_col + 1 : -1;
+        }
+    };
+
+} // namespace honeymoon::driver
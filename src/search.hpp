@@ -0,0 +1,264 @@
+/*
+ * Search.
+ * Substring search straight over the buffer's runs. Nothing gets copied but the few
+ * bytes that straddle a run boundary.
+ * Candidates are found 16 or 32 bytes at a time by matching the needle's first and last byte.
+ */
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace honeymoon::search {
+
+    inline constexpr size_t npos = std::string_view::npos;
+
+    namespace detail {
+
+        // Checks the bytes between the first and last, which the filter already matched.
+        inline bool middle_matches(const char* at, std::string_view needle) {
+            return needle.size() <= 2 || std::memcmp(at + 1, needle.data() + 1, needle.size() - 2) == 0;
+        }
+
+        // From `i` on, one candidate at a time. Used for tails and when there's no SIMD.
+        inline size_t find_scalar(std::string_view hay, std::string_view needle, size_t i) {
+            size_t m = needle.size();
+            size_t last = hay.size() - m; // last possible start
+            while (i <= last) {
+                const void* hit = std::memchr(hay.data() + i, needle[0], last - i + 1);
+                if (!hit)
+                    return npos;
+                i = static_cast<size_t>(static_cast<const char*>(hit) - hay.data());
+                if (hay[i + m - 1] == needle[m - 1] && middle_matches(hay.data() + i, needle))
+                    return i;
+                i++;
+            }
+            return npos;
+        }
+
+#if defined(__x86_64__)
+        inline size_t find_sse2(std::string_view hay, std::string_view needle) {
+            size_t m = needle.size();
+            const char* h = hay.data();
+            const __m128i first = _mm_set1_epi8(needle[0]);
+            const __m128i last = _mm_set1_epi8(needle[m - 1]);
+            size_t i = 0;
+            for (; i + 16 + m - 1 <= hay.size(); i += 16) {
+                __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h + i));
+                __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(h + i + m - 1));
+                unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+                while (mask) {
+                    size_t at = i + (size_t)__builtin_ctz(mask);
+                    if (middle_matches(h + at, needle))
+                        return at;
+                    mask &= mask - 1;
+                }
+            }
+            return find_scalar(hay, needle, i);
+        }
+
+        __attribute__((target("avx2"))) inline size_t find_avx2(std::string_view hay, std::string_view needle) {
+            size_t m = needle.size();
+            const char* h = hay.data();
+            const __m256i first = _mm256_set1_epi8(needle[0]);
+            const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+            size_t i = 0;
+            for (; i + 32 + m - 1 <= hay.size(); i += 32) {
+                __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h + i));
+                __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(h + i + m - 1));
+                unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+                while (mask) {
+                    size_t at = i + (size_t)__builtin_ctz(mask);
+                    if (middle_matches(h + at, needle))
+                        return at;
+                    mask &= mask - 1;
+                }
+            }
+            return find_scalar(hay, needle, i);
+        }
+
+        // cpuid by hand: __builtin_cpu_supports wants libgcc's __cpu_model, which we don't link.
+        inline bool has_avx2() {
+            static const bool yes = [] {
+                unsigned a, b, c, d;
+                if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE))
+                    return false;
+                unsigned lo, hi;
+                __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+                if ((lo & 6) != 6) // the OS saves the ymm registers
+                    return false;
+                return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_AVX2);
+            }();
+            return yes;
+        }
+#endif
+
+    } // namespace detail
+
+    // First occurrence of needle in one contiguous run, like string_view::find.
+    inline size_t find_in(std::string_view hay, std::string_view needle) {
+        if (needle.empty())
+            return 0;
+        if (needle.size() > hay.size())
+            return npos;
+        if (needle.size() == 1) {
+            const void* hit = std::memchr(hay.data(), needle[0], hay.size());
+            return hit ? static_cast<size_t>(static_cast<const char*>(hit) - hay.data()) : npos;
+        }
+#if defined(__x86_64__)
+        return detail::has_avx2() ? detail::find_avx2(hay, needle) : detail::find_sse2(hay, needle);
+#else
+        return detail::find_scalar(hay, needle, 0);
+#endif
+    }
+
+    // Calls on_match(pos) for every match starting in [from, to), in order, until it
+    // returns false. Matches may overlap. Returns false if it was stopped.
+    template <typename Buf, typename OnMatch>
+    bool scan(const Buf& buffer, size_t from, size_t to, std::string_view needle, OnMatch&& on_match) {
+        size_t m = needle.size();
+        size_t n = buffer.size();
+        if (m == 0 || m > n)
+            return true;
+        to = std::min(to, n - m + 1);
+        std::string seam;
+        size_t pos = from;
+        while (pos < to) {
+            std::string_view run = buffer.chunk_at(pos);
+            if (run.empty())
+                break;
+            size_t run_end = pos + run.size();
+
+            // Matches that fit inside this run.
+            size_t inner_end = std::min(to, run_end >= m - 1 ? run_end - (m - 1) : 0);
+            for (size_t at = pos; at < inner_end;) {
+                size_t hit = find_in(run.substr(at - pos, inner_end - at + m - 1), needle);
+                if (hit == npos)
+                    break;
+                if (!on_match(at + hit))
+                    return false;
+                at += hit + 1;
+            }
+
+            // Matches that start here and end in a later run.
+            size_t seam_start = std::max(pos, inner_end);
+            size_t seam_end = std::min(to, run_end);
+            if (seam_start < seam_end) {
+                seam.clear();
+                for (size_t p = seam_start; p < seam_end + m - 1;) {
+                    std::string_view c = buffer.chunk_at(p);
+                    c = c.substr(0, seam_end + m - 1 - p);
+                    seam.append(c.data(), c.size());
+                    p += c.size();
+                }
+                for (size_t at = 0; at < seam_end - seam_start;) {
+                    size_t hit = find_in(std::string_view(seam).substr(at), needle);
+                    if (hit == npos || at + hit >= seam_end - seam_start)
+                        break;
+                    if (!on_match(seam_start + at + hit))
+                        return false;
+                    at += hit + 1;
+                }
+            }
+            pos = run_end;
+        }
+        return true;
+    }
+
+    // Same contract as std::string::find.
+    template <typename Buf>
+    size_t find_forward(const Buf& buffer, std::string_view needle, size_t from) {
+        if (from > buffer.size())
+            return npos;
+        if (needle.empty())
+            return from;
+        size_t found = npos;
+        scan(buffer, from, buffer.size(), needle, [&](size_t at) {
+            found = at;
+            return false;
+        });
+        return found;
+    }
+
+    // Same contract as std::string::rfind: the last match starting at or before `from`.
+    // Scans forward through windows that step backwards, so the SIMD path is the only path.
+    template <typename Buf>
+    size_t find_backward(const Buf& buffer, std::string_view needle, size_t from) {
+        static constexpr size_t WINDOW = 1 << 20;
+        size_t n = buffer.size();
+        if (needle.size() > n)
+            return npos;
+        size_t hi = std::min(from, n - needle.size()) + 1; // exclusive bound on starts
+        if (needle.empty())
+            return hi - 1;
+        while (hi > 0) {
+            size_t lo = hi > WINDOW ? hi - WINDOW : 0;
+            size_t found = npos;
+            scan(buffer, lo, hi, needle, [&](size_t at) {
+                found = at;
+                return true;
+            });
+            if (found != npos)
+                return found;
+            hi = lo;
+        }
+        return npos;
+    }
+
+    // Counts matches a slice at a time, so a big buffer gets counted between key presses.
+    class MatchCounter {
+    public:
+        void start(std::string_view needle) {
+            needle_.assign(needle);
+            pos_ = 0;
+            count_ = 0;
+            busy_ = !needle_.empty();
+        }
+
+        void stop() {
+            needle_.clear();
+            busy_ = false;
+        }
+
+        bool busy() const noexcept { return busy_; }
+        bool done() const noexcept { return !busy_ && !needle_.empty(); }
+        size_t count() const noexcept { return count_; }
+
+        // Scans the next `budget` bytes of start positions.
+        template <typename Buf>
+        void step(const Buf& buffer, size_t budget) {
+            if (!busy_)
+                return;
+            size_t end = std::min(buffer.size(), pos_ + budget);
+            scan(buffer, pos_, end, needle_, [this](size_t) {
+                count_++;
+                return true;
+            });
+            pos_ = end;
+            if (pos_ >= buffer.size())
+                busy_ = false;
+        }
+
+    private:
+        std::string needle_;
+        size_t pos_ = 0;
+        size_t count_ = 0;
+        bool busy_ = false;
+    };
+
+    // One step of an incremental search: a key typed or a repeat, and where it left us.
+    struct Step {
+        size_t query_len;
+        size_t pos;
+        size_t end; // of the match at pos
+        bool found;
+    };
+
+} // namespace honeymoon::search
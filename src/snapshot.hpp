@@ -0,0 +1,60 @@
+/*
+ * Text Snapshot.
+ * A frozen view of the text that another thread can read while the editor keeps editing.
+ * The gap buffer pays for one copy. The piece table just shares what it already has.
+ */
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace honeymoon::mem {
+
+    template <typename CharT = char>
+    class TextSnapshot {
+    public:
+        TextSnapshot() = default;
+
+        // Snapshot over a private copy of the text.
+        explicit TextSnapshot(std::basic_string<CharT> text) {
+            auto copy = std::make_shared<const std::basic_string<CharT>>(std::move(text));
+            add_run(copy->data(), copy->size());
+            keep(std::move(copy));
+        }
+
+        // Runs are appended in document order and must stay valid as long as the owners kept here.
+        void add_run(const CharT* data, size_t len) {
+            if (len == 0)
+                return;
+            starts.push_back(total);
+            runs_.push_back({data, len});
+            total += len;
+        }
+
+        void keep(std::shared_ptr<const void> owner) { owners.push_back(std::move(owner)); }
+
+        size_t size() const { return total; }
+        const std::vector<std::basic_string_view<CharT>>& runs() const { return runs_; }
+
+        // Contiguous text from pos to the end of its run. Readers mostly go front to back,
+        // so the last run found is tried first.
+        std::basic_string_view<CharT> chunk_at(size_t pos) const {
+            if (pos >= total)
+                return {};
+            if (!(hint < runs_.size() && starts[hint] <= pos && pos < starts[hint] + runs_[hint].size()))
+                hint = std::upper_bound(starts.begin(), starts.end(), pos) - starts.begin() - 1;
+            return runs_[hint].substr(pos - starts[hint]);
+        }
+
+    private:
+        std::vector<std::basic_string_view<CharT>> runs_;
+        std::vector<size_t> starts;
+        size_t total = 0;
+        std::vector<std::shared_ptr<const void>> owners;
+        mutable size_t hint = 0; // a snapshot has one reader at a time
+    };
+
+} // namespace honeymoon::mem
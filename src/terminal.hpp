@@ -6,10 +6,13 @@
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <utility>
 #include "input.hpp"
+#include "keyreader.hpp"
 #include "concepts.hpp"
 
 namespace honeymoon::driver {
@@ -26,46 +29,34 @@ namespace honeymoon::driver {
             return {ws.ws_row, ws.ws_col};
         }
 
+        int input_fd() const { return STDIN_FILENO; }
+
+        // Never blocks. Everything the tty has goes into the reader in one go; keys come
+        // out of it one at a time until it runs dry.
         Key read_key() {
-            int n; char c;
-            while ((n = read(STDIN_FILENO, &c, 1)) != 1) { if (n == -1 && errno != EAGAIN) return Key::None; }
-            if (c == 27) {
-                char seq[3];
-                if (read(STDIN_FILENO, &seq[0], 1) != 1) return Key::Esc;
-                if (read(STDIN_FILENO, &seq[1], 1) != 1) return Key::Esc;
-        if (seq[0] == '[') {
-                    if (seq[1] >= '0' && seq[1] <= '9') {
-                        if (read(STDIN_FILENO, &seq[2], 1) != 1) return Key::Esc;
-                        if (seq[2] == '~') {
-                            switch (seq[1]) {
-                                case '1': case '7': return Key::Home;
-                                case '3': return Key::Del;
-                                case '4': case '8': return Key::End;
-                                case '5': return Key::PageUp;
-                                case '6': return Key::PageDown;
-                            }
-                        }
-                    } else {
-                        switch (seq[1]) {
-                            case 'A': return Key::ArrowUp; case 'B': return Key::ArrowDown;
-                            case 'C': return Key::ArrowRight; case 'D': return Key::ArrowLeft;
-                            case 'H': return Key::Home; case 'F': return Key::End;
-                            case 'Z': return Key::ShiftTab;
-                        }
-                    }
-                } else if (seq[0] == 'O') {
-                    switch (seq[1]) { case 'H': return Key::Home; case 'F': return Key::End; }
-                }
-                return Key::Esc;
-            }
-            return static_cast<Key>(c);
+            Key k = keys.next();
+            if (k == Key::None && keys.fill(STDIN_FILENO) > 0) k = keys.next();
+            return k;
         }
 
-        void write_raw(const char* s, size_t n) { (void)write(STDOUT_FILENO, s, n); }
+        std::string take_paste() { return keys.take_paste(); }
+
+        // How long the caller may sleep before a lone ESC has to be delivered as a key.
+        int input_timeout() const { return keys.timeout_ms(); }
+
+        // One write per frame; only loops if the tty takes less than everything.
+        void write_raw(const char* s, size_t n) {
+            while (n > 0) {
+                ssize_t w = write(STDOUT_FILENO, s, n);
+                if (w < 0) { if (errno == EINTR || errno == EAGAIN) continue; return; }
+                s += w; n -= w;
+            }
+        }
         void write_raw(std::string_view s) { write_raw(s.data(), s.size()); }
         void write_raw(const char* s) { write_raw(s, strlen(s)); }
 
     private:
+        KeyReader keys;
         struct termios orig_termios;
         bool raw_mode_enabled = false;
 
@@ -76,14 +67,15 @@ namespace honeymoon::driver {
             raw.c_oflag &= ~(OPOST);
             raw.c_cflag |= (CS8);
             raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);//icanon disables line buff and ixon disbales like cntrl+S
-            raw.c_cc[VMIN] = 0; raw.c_cc[VTIME] = 1;
+            raw.c_cc[VMIN] = 0; raw.c_cc[VTIME] = 0; // reads never wait; the event loop does
             if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) return false;
             raw_mode_enabled = true;
+            write_raw("\x1b[?2004h"); // bracketed paste: pastes arrive as one Key::Paste
             return true;
         }
 
         void disable_raw_mode() {
-            if (raw_mode_enabled) { tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios); raw_mode_enabled = false; }
+            if (raw_mode_enabled) { write_raw("\x1b[?2004l"); tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios); raw_mode_enabled = false; }
         }
     };
     static_assert(honeymoon::kernel::TerminalDevice<Terminal>);
@@ -1,16 +1,27 @@
 #pragma once
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <string>
 #include <string_view>
 #include <vector>
+#include "edit.hpp"
+#include "snapshot.hpp"
 
 namespace honeymoon::syntax {
 
-enum class HighlightKind {
+enum class HighlightKind : uint8_t {
   None,
   Comment,
   String,
@@ -30,15 +41,59 @@ struct TSNode {
   const void *id;
   const TSTree *tree;
 };
+struct TSTreeCursor {
+  const void *tree;
+  const void *id;
+  uint32_t context[3];
+};
+struct TSPoint {
+  uint32_t row;
+  uint32_t column;
+};
+enum TSInputEncoding { TSInputEncodingUTF8, TSInputEncodingUTF16 };
+// `decode` only exists since tree-sitter 0.25 and is only read for custom encodings;
+// older libraries just never look at it.
+struct TSInput {
+  void *payload;
+  const char *(*read)(void *payload, uint32_t byte_index, TSPoint position, uint32_t *bytes_read);
+  TSInputEncoding encoding;
+  void *decode;
+};
+struct TSQuery;
+struct TSQueryCursor;
+struct TSQueryCapture {
+  TSNode node;
+  uint32_t index;
+};
+struct TSQueryMatch {
+  uint32_t id;
+  uint16_t pattern_index;
+  uint16_t capture_count;
+  const TSQueryCapture *captures;
+};
+enum TSQueryError { TSQueryErrorNone = 0 };
+typedef uint16_t TSSymbol;
+struct TSInputEdit {
+  uint32_t start_byte;
+  uint32_t old_end_byte;
+  uint32_t new_end_byte;
+  TSPoint start_point;
+  TSPoint old_end_point;
+  TSPoint new_end_point;
+};
 }
 
 class TreeSitterHighlighter {
 public:
-  TreeSitterHighlighter() = default;
+  TreeSitterHighlighter() { wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); }
 
   ~TreeSitterHighlighter() {
+    stop_worker();
+    drop_query();
     if (tree_ && api_.ts_tree_delete)
       api_.ts_tree_delete(tree_);
+    if (wake_fd_ >= 0)
+      close(wake_fd_);
     if (parser_ && api_.ts_parser_delete)
       api_.ts_parser_delete(parser_);
     if (lib_tree_sitter_)
@@ -61,12 +116,7 @@ public:
     if (requested == LanguageMode::None) {
       active_ = false;
       mode_ = LanguageMode::None;
-      last_content_.clear();
-      style_map_.clear();
-      if (tree_ && api_.ts_tree_delete) {
-        api_.ts_tree_delete(tree_);
-        tree_ = nullptr;
-      }
+      invalidate();
       return false;
     }
 
@@ -75,6 +125,8 @@ public:
       return false;
     }
 
+    // The worker owns the parser while it parses.
+    quiesce();
     const TSLanguage *lang = load_language(requested);
     if (!lang || !api_.ts_parser_set_language(parser_, lang)) {
       active_ = false;
@@ -82,12 +134,9 @@ public:
     }
 
     if (mode_ != requested) {
-      last_content_.clear();
-      style_map_.clear();
-      if (tree_ && api_.ts_tree_delete) {
-        api_.ts_tree_delete(tree_);
-        tree_ = nullptr;
-      }
+      invalidate();
+      build_symbol_kinds(lang);
+      load_query(lang, requested);
     }
 
     mode_ = requested;
@@ -97,46 +146,258 @@ public:
 
   bool active() const noexcept { return active_; }
 
-  void update(const std::string &content) {
-    if (!active_ || !parser_)
+  // Tells the old tree what moved so the next parse can reuse everything the edit
+  // didn't touch. Edits must arrive in the order they were made.
+  // The current tree is edited too, so until the reparse lands the old highlighting
+  // at least moves along with the text.
+  void edit(const honeymoon::mem::EditRecord &e) {
+    needs_parse_ = true;
+    line_cache_.clear();
+    TSInputEdit in{(uint32_t)e.start, (uint32_t)e.old_end, (uint32_t)e.new_end,
+                   {e.start_point.row, e.start_point.column},
+                   {e.old_end_point.row, e.old_end_point.column},
+                   {e.new_end_point.row, e.new_end_point.column}};
+    if (tree_)
+      api_.ts_tree_edit(tree_, &in);
+    if (in_flight_)
+      edits_since_post_.push_back(in);
+  }
+
+  // The text was replaced wholesale; nothing of the old tree is worth keeping, and
+  // neither is whatever the worker is busy with.
+  void invalidate() {
+    needs_parse_ = true;
+    line_cache_.clear();
+    cancel_parse();
+    if (tree_ && api_.ts_tree_delete) {
+      api_.ts_tree_delete(tree_);
+      tree_ = nullptr;
+    }
+  }
+
+  bool needs_parse() const noexcept { return active_ && needs_parse_; }
+
+  // For when the bytes a snapshot reads are about to change under it: a parse in flight is
+  // cancelled and waited for, and the next update() starts it again.
+  void hold_parse() {
+    if (!worker_.joinable())
+      return;
+    quiesce();
+    needs_parse_ = true;
+  }
+
+  // Hands a snapshot of the text to the parse thread and returns right away; the
+  // tree arrives later through wake_fd(). Snapshotting is a memcpy for the gap
+  // buffer and free for the piece table.
+  template <typename Buf>
+  void update(const Buf &buffer) {
+    if (!active_ || !parser_ || !needs_parse_)
       return;
-    if (content == last_content_)
+    if (!start_worker())
       return;
+    ParseJob job{buffer.snapshot(), tree_ ? api_.ts_tree_copy(tree_) : nullptr, ++posted_id_};
+    needs_parse_ = false;
+    in_flight_ = true;
+    edits_since_post_.clear();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (job_ && job_->old_tree)
+        api_.ts_tree_delete(job_->old_tree);
+      job_ = std::move(job);
+      if (busy_)
+        cancel_.store(1);
+    }
+    wake_worker_.notify_one();
+  }
+
+  // Readable when a parse has finished; the event loop watches it.
+  int wake_fd() const noexcept { return wake_fd_; }
 
-    TSTree *next =
-        api_.ts_parser_parse_string(parser_, tree_, content.c_str(), content.size());
+  // Adopts the finished tree, if it belongs to the newest request. Edits made while it
+  // was parsing are replayed onto it. Returns true if the highlighting changed.
+  bool take_result() {
+    uint64_t count;
+    while (read(wake_fd_, &count, sizeof(count)) == sizeof(count)) {
+    }
+    TSTree *next;
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!result_ready_)
+        return false;
+      next = result_;
+      id = result_id_;
+      result_ = nullptr;
+      result_ready_ = false;
+    }
+    if (id != posted_id_) { // overtaken by a newer request
+      if (next)
+        api_.ts_tree_delete(next);
+      return false;
+    }
+    in_flight_ = false;
     if (!next)
-      return;
-    if (tree_ && api_.ts_tree_delete)
+      return false;
+    for (const TSInputEdit &e : edits_since_post_)
+      api_.ts_tree_edit(next, &e);
+    edits_since_post_.clear();
+    if (tree_)
       api_.ts_tree_delete(tree_);
     tree_ = next;
-
-    last_content_ = content;
-    style_map_.assign(content.size(), HighlightKind::None);
-    collect_styles();
+    line_cache_.clear();
+    return true;
   }
 
-  HighlightKind kind_at(size_t byte_index) const noexcept {
-    if (byte_index >= style_map_.size())
-      return HighlightKind::None;
-    return style_map_[byte_index];
+  // Kinds for the bytes [start, end), usually one visible line. Only the nodes that
+  // overlap the range are visited, and recent lines are remembered until the next
+  // parse. The pointer is good until the next call.
+  const HighlightKind *line_kinds(size_t start, size_t end) {
+    if (end < start)
+      end = start;
+    uint64_t stamp = ++line_clock_;
+    CachedLine *victim = nullptr;
+    for (CachedLine &line : line_cache_) {
+      if (line.start == start && line.end == end) {
+        line.used = stamp;
+        return line.kinds.data();
+      }
+      if (!victim || line.used < victim->used)
+        victim = &line;
+    }
+    if (line_cache_.size() < LINE_CACHE_SIZE)
+      victim = &line_cache_.emplace_back();
+    victim->start = start;
+    victim->end = end;
+    victim->used = stamp;
+    victim->kinds.assign(end - start, HighlightKind::None);
+    paint_range(start, end, victim->kinds.data());
+    return victim->kinds.data();
   }
 
 private:
   using ts_parser_new_fn              = TSParser *(*)();
   using ts_parser_delete_fn           = void (*)(TSParser *);
   using ts_parser_set_language_fn     = bool (*)(TSParser *, const TSLanguage *);
-  using ts_parser_parse_string_fn     = TSTree *(*)(TSParser *, const TSTree *, const char *, uint32_t);
+  using ts_parser_parse_fn            = TSTree *(*)(TSParser *, const TSTree *, TSInput);
   using ts_tree_delete_fn             = void (*)(TSTree *);
+  using ts_tree_edit_fn               = void (*)(TSTree *, const TSInputEdit *);
+  using ts_tree_copy_fn               = TSTree *(*)(const TSTree *);
+  using ts_parser_reset_fn            = void (*)(TSParser *);
+  using ts_parser_set_cancellation_flag_fn = void (*)(TSParser *, const size_t *);
   using ts_tree_root_node_fn          = TSNode (*)(const TSTree *);
-  using ts_node_type_fn               = const char *(*)(TSNode);
-  using ts_node_child_count_fn        = uint32_t (*)(TSNode);
-  using ts_node_child_fn              = TSNode (*)(TSNode, uint32_t);
+  using ts_node_symbol_fn             = TSSymbol (*)(TSNode);
+  using ts_language_symbol_count_fn   = uint32_t (*)(const TSLanguage *);
+  using ts_language_symbol_name_fn    = const char *(*)(const TSLanguage *, TSSymbol);
+  using ts_query_new_fn               = TSQuery *(*)(const TSLanguage *, const char *, uint32_t, uint32_t *, TSQueryError *);
+  using ts_query_delete_fn            = void (*)(TSQuery *);
+  using ts_query_capture_count_fn     = uint32_t (*)(const TSQuery *);
+  using ts_query_capture_name_for_id_fn = const char *(*)(const TSQuery *, uint32_t, uint32_t *);
+  using ts_query_pattern_count_fn     = uint32_t (*)(const TSQuery *);
+  using ts_query_predicates_for_pattern_fn = const void *(*)(const TSQuery *, uint32_t, uint32_t *);
+  using ts_query_cursor_new_fn        = TSQueryCursor *(*)();
+  using ts_query_cursor_delete_fn     = void (*)(TSQueryCursor *);
+  using ts_query_cursor_exec_fn       = void (*)(TSQueryCursor *, const TSQuery *, TSNode);
+  using ts_query_cursor_set_byte_range_fn = void (*)(TSQueryCursor *, uint32_t, uint32_t);
+  using ts_query_cursor_next_capture_fn = bool (*)(TSQueryCursor *, TSQueryMatch *, uint32_t *);
   using ts_node_start_byte_fn         = uint32_t (*)(TSNode);
   using ts_node_end_byte_fn           = uint32_t (*)(TSNode);
   using ts_node_is_null_fn            = bool (*)(TSNode);
+  using ts_tree_cursor_new_fn         = TSTreeCursor (*)(TSNode);
+  using ts_tree_cursor_delete_fn      = void (*)(TSTreeCursor *);
+  using ts_tree_cursor_current_node_fn = TSNode (*)(const TSTreeCursor *);
+  using ts_tree_cursor_goto_parent_fn = bool (*)(TSTreeCursor *);
+  using ts_tree_cursor_goto_next_sibling_fn = bool (*)(TSTreeCursor *);
+  using ts_tree_cursor_goto_first_child_for_byte_fn = int64_t (*)(TSTreeCursor *, uint32_t);
   using tree_sitter_language_fn       = const TSLanguage *(*)();
 
+  bool start_worker() {
+    if (!worker_.joinable())
+      worker_ = std::thread([this] { worker_loop(); });
+    return worker_.joinable();
+  }
+
+  void worker_loop() {
+    for (;;) {
+      ParseJob job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_worker_.wait(lock, [this] { return stop_ || job_.has_value(); });
+        if (stop_)
+          return;
+        job = std::move(*job_);
+        job_.reset();
+        busy_ = true;
+        cancel_.store(0);
+      }
+      // A cancelled parse would otherwise try to resume on the next call.
+      api_.ts_parser_reset(parser_);
+      using Snapshot = honeymoon::mem::TextSnapshot<char>;
+      TSInput input{&job.text, &read_chunk<Snapshot>, TSInputEncodingUTF8, nullptr};
+      TSTree *next = api_.ts_parser_parse(parser_, job.old_tree, input);
+      if (job.old_tree)
+        api_.ts_tree_delete(job.old_tree);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        busy_ = false;
+        if (result_)
+          api_.ts_tree_delete(result_);
+        result_ = next;
+        result_id_ = job.id;
+        result_ready_ = true;
+      }
+      worker_idle_.notify_all();
+      uint64_t one = 1;
+      (void)!write(wake_fd_, &one, sizeof(one));
+    }
+  }
+
+  // Drops the queued request and tells a running parse to give up.
+  void cancel_parse() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (job_ && job_->old_tree)
+      api_.ts_tree_delete(job_->old_tree);
+    job_.reset();
+    if (busy_)
+      cancel_.store(1);
+    ++posted_id_; // whatever is running now is stale
+    in_flight_ = false;
+    edits_since_post_.clear();
+  }
+
+  // Returns once the worker is idle, so the parser can be touched.
+  void quiesce() {
+    cancel_parse();
+    std::unique_lock<std::mutex> lock(mutex_);
+    worker_idle_.wait(lock, [this] { return !busy_; });
+  }
+
+  void stop_worker() {
+    if (!worker_.joinable())
+      return;
+    cancel_parse();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_worker_.notify_one();
+    worker_.join();
+    if (result_)
+      api_.ts_tree_delete(result_);
+    result_ = nullptr;
+  }
+
+  template <typename Buf>
+  static const char *read_chunk(void *payload, uint32_t byte_index, TSPoint, uint32_t *bytes_read) {
+    const Buf &buffer = *static_cast<const Buf *>(payload);
+    if (byte_index >= buffer.size()) {
+      *bytes_read = 0;
+      return "";
+    }
+    auto run = buffer.chunk_at(byte_index);
+    *bytes_read = static_cast<uint32_t>(std::min<size_t>(run.size(), UINT32_MAX));
+    return reinterpret_cast<const char *>(run.data());
+  }
+
   template <typename Fn>
   static Fn load_symbol(void *handle, const char *symbol) noexcept {
     return reinterpret_cast<Fn>(dlsym(handle, symbol));
@@ -146,24 +407,48 @@ private:
     ts_parser_new_fn              ts_parser_new            = nullptr;
     ts_parser_delete_fn           ts_parser_delete         = nullptr;
     ts_parser_set_language_fn     ts_parser_set_language   = nullptr;
-    ts_parser_parse_string_fn     ts_parser_parse_string   = nullptr;
+    ts_parser_parse_fn            ts_parser_parse          = nullptr;
     ts_tree_delete_fn             ts_tree_delete           = nullptr;
+    ts_tree_edit_fn               ts_tree_edit             = nullptr;
+    ts_tree_copy_fn               ts_tree_copy             = nullptr;
+    ts_parser_reset_fn            ts_parser_reset          = nullptr;
+    // Optional (deprecated in newer releases); without it stale parses run to completion.
+    ts_parser_set_cancellation_flag_fn ts_parser_set_cancellation_flag = nullptr;
     ts_tree_root_node_fn          ts_tree_root_node        = nullptr;
-    ts_node_type_fn               ts_node_type             = nullptr;
-    ts_node_child_count_fn        ts_node_child_count      = nullptr;
-    ts_node_child_fn              ts_node_child            = nullptr;
+    ts_node_symbol_fn             ts_node_symbol           = nullptr;
+    ts_language_symbol_count_fn   ts_language_symbol_count = nullptr;
+    ts_language_symbol_name_fn    ts_language_symbol_name  = nullptr;
+    // Queries are optional; all of these are null if any one is missing.
+    ts_query_new_fn               ts_query_new             = nullptr;
+    ts_query_delete_fn            ts_query_delete          = nullptr;
+    ts_query_capture_count_fn     ts_query_capture_count   = nullptr;
+    ts_query_capture_name_for_id_fn ts_query_capture_name_for_id = nullptr;
+    ts_query_pattern_count_fn     ts_query_pattern_count   = nullptr;
+    ts_query_predicates_for_pattern_fn ts_query_predicates_for_pattern = nullptr;
+    ts_query_cursor_new_fn        ts_query_cursor_new      = nullptr;
+    ts_query_cursor_delete_fn     ts_query_cursor_delete   = nullptr;
+    ts_query_cursor_exec_fn       ts_query_cursor_exec     = nullptr;
+    ts_query_cursor_set_byte_range_fn ts_query_cursor_set_byte_range = nullptr;
+    ts_query_cursor_next_capture_fn ts_query_cursor_next_capture = nullptr;
     ts_node_start_byte_fn         ts_node_start_byte       = nullptr;
     ts_node_end_byte_fn           ts_node_end_byte         = nullptr;
     ts_node_is_null_fn            ts_node_is_null          = nullptr;
+    ts_tree_cursor_new_fn         ts_tree_cursor_new       = nullptr;
+    ts_tree_cursor_delete_fn      ts_tree_cursor_delete    = nullptr;
+    ts_tree_cursor_current_node_fn ts_tree_cursor_current_node = nullptr;
+    ts_tree_cursor_goto_parent_fn ts_tree_cursor_goto_parent = nullptr;
+    ts_tree_cursor_goto_next_sibling_fn ts_tree_cursor_goto_next_sibling = nullptr;
+    ts_tree_cursor_goto_first_child_for_byte_fn ts_tree_cursor_goto_first_child_for_byte = nullptr;
   } api_;
 
   enum class LanguageMode { None, C, Cpp };
 
-  struct Span {
-    size_t start;
-    size_t end;
-    HighlightKind kind;
+  struct CachedLine {
+    size_t start = 0, end = 0;
+    uint64_t used = 0;
+    std::vector<HighlightKind> kinds;
   };
+  static constexpr size_t LINE_CACHE_SIZE = 128;
 
   void *lib_tree_sitter_ = nullptr;
   void *lib_lang_c_      = nullptr;
@@ -177,9 +462,39 @@ private:
   bool               active_     = false;
   bool               api_loaded_ = false;
   LanguageMode       mode_       = LanguageMode::None;
+  bool               needs_parse_ = true;
   std::string        last_filename_;
-  std::string        last_content_;
-  std::vector<HighlightKind> style_map_;
+  std::vector<HighlightKind> symbol_kinds_;  // by TSSymbol
+  TSQuery           *query_        = nullptr;
+  TSQueryCursor     *query_cursor_ = nullptr;
+  std::vector<HighlightKind> capture_kinds_; // by capture id
+  std::vector<bool>  pattern_has_predicates_;
+  std::vector<CachedLine> line_cache_;
+
+  // Parse thread. It owns parser_ while busy_; everything it shares with the UI
+  // thread is guarded by mutex_, except cancel_, which tree-sitter polls.
+  struct ParseJob {
+    honeymoon::mem::TextSnapshot<char> text;
+    TSTree  *old_tree = nullptr; // a copy; the UI thread keeps using tree_
+    uint64_t id = 0;
+  };
+  std::thread             worker_;
+  std::mutex              mutex_;
+  std::condition_variable wake_worker_;
+  std::condition_variable worker_idle_;
+  std::optional<ParseJob> job_;
+  TSTree                 *result_ = nullptr;
+  uint64_t                result_id_ = 0;
+  bool                    result_ready_ = false;
+  bool                    busy_ = false;
+  bool                    stop_ = false;
+  std::atomic<size_t>     cancel_{0};
+  int                     wake_fd_ = -1;
+  // UI thread only.
+  uint64_t                posted_id_ = 0;
+  bool                    in_flight_ = false;
+  std::vector<TSInputEdit> edits_since_post_;
+  uint64_t           line_clock_ = 0;
 
   static constexpr int priority(HighlightKind k) noexcept {
     switch (k) {
@@ -231,30 +546,72 @@ private:
     api_.ts_parser_new          = load_symbol<ts_parser_new_fn>(lib_tree_sitter_, "ts_parser_new");
     api_.ts_parser_delete       = load_symbol<ts_parser_delete_fn>(lib_tree_sitter_, "ts_parser_delete");
     api_.ts_parser_set_language = load_symbol<ts_parser_set_language_fn>(lib_tree_sitter_, "ts_parser_set_language");
-    api_.ts_parser_parse_string = load_symbol<ts_parser_parse_string_fn>(lib_tree_sitter_, "ts_parser_parse_string");
+    api_.ts_parser_parse        = load_symbol<ts_parser_parse_fn>(lib_tree_sitter_, "ts_parser_parse");
     api_.ts_tree_delete         = load_symbol<ts_tree_delete_fn>(lib_tree_sitter_, "ts_tree_delete");
+    api_.ts_tree_edit           = load_symbol<ts_tree_edit_fn>(lib_tree_sitter_, "ts_tree_edit");
+    api_.ts_tree_copy           = load_symbol<ts_tree_copy_fn>(lib_tree_sitter_, "ts_tree_copy");
+    api_.ts_parser_reset        = load_symbol<ts_parser_reset_fn>(lib_tree_sitter_, "ts_parser_reset");
+    api_.ts_parser_set_cancellation_flag = load_symbol<ts_parser_set_cancellation_flag_fn>(lib_tree_sitter_, "ts_parser_set_cancellation_flag");
     api_.ts_tree_root_node      = load_symbol<ts_tree_root_node_fn>(lib_tree_sitter_, "ts_tree_root_node");
-    api_.ts_node_type           = load_symbol<ts_node_type_fn>(lib_tree_sitter_, "ts_node_type");
-    api_.ts_node_child_count    = load_symbol<ts_node_child_count_fn>(lib_tree_sitter_, "ts_node_child_count");
-    api_.ts_node_child          = load_symbol<ts_node_child_fn>(lib_tree_sitter_, "ts_node_child");
+    api_.ts_node_symbol         = load_symbol<ts_node_symbol_fn>(lib_tree_sitter_, "ts_node_symbol");
+    api_.ts_language_symbol_count = load_symbol<ts_language_symbol_count_fn>(lib_tree_sitter_, "ts_language_symbol_count");
+    api_.ts_language_symbol_name = load_symbol<ts_language_symbol_name_fn>(lib_tree_sitter_, "ts_language_symbol_name");
     api_.ts_node_start_byte     = load_symbol<ts_node_start_byte_fn>(lib_tree_sitter_, "ts_node_start_byte");
     api_.ts_node_end_byte       = load_symbol<ts_node_end_byte_fn>(lib_tree_sitter_, "ts_node_end_byte");
     api_.ts_node_is_null        = load_symbol<ts_node_is_null_fn>(lib_tree_sitter_, "ts_node_is_null");
+    api_.ts_tree_cursor_new     = load_symbol<ts_tree_cursor_new_fn>(lib_tree_sitter_, "ts_tree_cursor_new");
+    api_.ts_tree_cursor_delete  = load_symbol<ts_tree_cursor_delete_fn>(lib_tree_sitter_, "ts_tree_cursor_delete");
+    api_.ts_tree_cursor_current_node = load_symbol<ts_tree_cursor_current_node_fn>(lib_tree_sitter_, "ts_tree_cursor_current_node");
+    api_.ts_tree_cursor_goto_parent = load_symbol<ts_tree_cursor_goto_parent_fn>(lib_tree_sitter_, "ts_tree_cursor_goto_parent");
+    api_.ts_tree_cursor_goto_next_sibling = load_symbol<ts_tree_cursor_goto_next_sibling_fn>(lib_tree_sitter_, "ts_tree_cursor_goto_next_sibling");
+    api_.ts_tree_cursor_goto_first_child_for_byte = load_symbol<ts_tree_cursor_goto_first_child_for_byte_fn>(lib_tree_sitter_, "ts_tree_cursor_goto_first_child_for_byte");
 
     api_loaded_ = api_.ts_parser_new          && api_.ts_parser_delete       &&
-                  api_.ts_parser_set_language  && api_.ts_parser_parse_string &&
-                  api_.ts_tree_delete          && api_.ts_tree_root_node     &&
-                  api_.ts_node_type            && api_.ts_node_child_count   &&
-                  api_.ts_node_child           && api_.ts_node_start_byte    &&
-                  api_.ts_node_end_byte        && api_.ts_node_is_null;
+                  api_.ts_parser_set_language  && api_.ts_parser_parse        &&
+                  api_.ts_tree_delete          && api_.ts_tree_edit          &&
+                  api_.ts_tree_copy            && api_.ts_parser_reset       &&
+                  api_.ts_tree_root_node       && api_.ts_node_symbol        &&
+                  api_.ts_node_start_byte      && api_.ts_node_end_byte      &&
+                  api_.ts_node_is_null         && api_.ts_language_symbol_count &&
+                  api_.ts_language_symbol_name &&
+                  api_.ts_tree_cursor_new      && api_.ts_tree_cursor_delete &&
+                  api_.ts_tree_cursor_current_node && api_.ts_tree_cursor_goto_parent &&
+                  api_.ts_tree_cursor_goto_next_sibling &&
+                  api_.ts_tree_cursor_goto_first_child_for_byte;
+    if (api_loaded_)
+      load_query_api();
     return api_loaded_;
   }
 
+  void load_query_api() {
+    api_.ts_query_new           = load_symbol<ts_query_new_fn>(lib_tree_sitter_, "ts_query_new");
+    api_.ts_query_delete        = load_symbol<ts_query_delete_fn>(lib_tree_sitter_, "ts_query_delete");
+    api_.ts_query_capture_count = load_symbol<ts_query_capture_count_fn>(lib_tree_sitter_, "ts_query_capture_count");
+    api_.ts_query_capture_name_for_id = load_symbol<ts_query_capture_name_for_id_fn>(lib_tree_sitter_, "ts_query_capture_name_for_id");
+    api_.ts_query_pattern_count = load_symbol<ts_query_pattern_count_fn>(lib_tree_sitter_, "ts_query_pattern_count");
+    api_.ts_query_predicates_for_pattern = load_symbol<ts_query_predicates_for_pattern_fn>(lib_tree_sitter_, "ts_query_predicates_for_pattern");
+    api_.ts_query_cursor_new    = load_symbol<ts_query_cursor_new_fn>(lib_tree_sitter_, "ts_query_cursor_new");
+    api_.ts_query_cursor_delete = load_symbol<ts_query_cursor_delete_fn>(lib_tree_sitter_, "ts_query_cursor_delete");
+    api_.ts_query_cursor_exec   = load_symbol<ts_query_cursor_exec_fn>(lib_tree_sitter_, "ts_query_cursor_exec");
+    api_.ts_query_cursor_set_byte_range = load_symbol<ts_query_cursor_set_byte_range_fn>(lib_tree_sitter_, "ts_query_cursor_set_byte_range");
+    api_.ts_query_cursor_next_capture = load_symbol<ts_query_cursor_next_capture_fn>(lib_tree_sitter_, "ts_query_cursor_next_capture");
+    bool complete = api_.ts_query_new && api_.ts_query_delete && api_.ts_query_capture_count &&
+                    api_.ts_query_capture_name_for_id && api_.ts_query_pattern_count &&
+                    api_.ts_query_predicates_for_pattern && api_.ts_query_cursor_new &&
+                    api_.ts_query_cursor_delete && api_.ts_query_cursor_exec &&
+                    api_.ts_query_cursor_set_byte_range && api_.ts_query_cursor_next_capture;
+    if (!complete)
+      api_.ts_query_new = nullptr;
+  }
+
   bool ensure_parser() {
     if (!load_api())
       return false;
-    if (!parser_)
+    if (!parser_) {
       parser_ = api_.ts_parser_new();
+      if (parser_ && api_.ts_parser_set_cancellation_flag)
+        api_.ts_parser_set_cancellation_flag(parser_, reinterpret_cast<const size_t *>(&cancel_));
+    }
     return parser_ != nullptr;
   }
 
@@ -297,6 +654,106 @@ private:
     return nullptr;
   }
 
+  // Node names are classified once per language, so the highlight loop only
+  // ever indexes a table by TSSymbol.
+  void build_symbol_kinds(const TSLanguage *lang) {
+    uint32_t n = api_.ts_language_symbol_count(lang);
+    symbol_kinds_.assign(n, HighlightKind::None);
+    for (uint32_t sym = 0; sym < n; ++sym) {
+      const char *name = api_.ts_language_symbol_name(lang, (TSSymbol)sym);
+      if (name)
+        symbol_kinds_[sym] = classify_node(name);
+    }
+  }
+
+  static constexpr const char *query_name(LanguageMode mode) noexcept {
+    return mode == LanguageMode::C ? "c" : "cpp";
+  }
+
+  static std::string read_file(const std::string &path) {
+    std::string out;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return out;
+    char buf[8192];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+      out.append(buf, n);
+    close(fd);
+    return out;
+  }
+
+  // Optional: queries/<lang>/highlights.scm next to keybinds.moon, or under
+  // ~/.config/honeymoon. Without one, the symbol table does the job.
+  void load_query(const TSLanguage *lang, LanguageMode mode) {
+    drop_query();
+    if (!api_.ts_query_new)
+      return;
+    std::string rel = std::string("queries/") + query_name(mode) + "/highlights.scm";
+    std::string source = read_file(rel);
+    if (source.empty()) {
+      if (const char *home = getenv("HOME"))
+        source = read_file(std::string(home) + "/.config/honeymoon/" + rel);
+    }
+    if (source.empty())
+      return;
+    uint32_t error_offset = 0;
+    TSQueryError error = TSQueryErrorNone;
+    query_ = api_.ts_query_new(lang, source.data(), (uint32_t)source.size(), &error_offset, &error);
+    if (!query_)
+      return;
+    query_cursor_ = api_.ts_query_cursor_new();
+    if (!query_cursor_) {
+      drop_query();
+      return;
+    }
+    uint32_t captures = api_.ts_query_capture_count(query_);
+    capture_kinds_.assign(captures, HighlightKind::None);
+    for (uint32_t i = 0; i < captures; ++i) {
+      uint32_t len = 0;
+      const char *name = api_.ts_query_capture_name_for_id(query_, i, &len);
+      capture_kinds_[i] = classify_capture(std::string_view(name, len));
+    }
+    uint32_t patterns = api_.ts_query_pattern_count(query_);
+    pattern_has_predicates_.assign(patterns, false);
+    for (uint32_t i = 0; i < patterns; ++i) {
+      uint32_t steps = 0;
+      api_.ts_query_predicates_for_pattern(query_, i, &steps);
+      pattern_has_predicates_[i] = steps > 0;
+    }
+  }
+
+  void drop_query() {
+    if (query_cursor_)
+      api_.ts_query_cursor_delete(query_cursor_);
+    if (query_)
+      api_.ts_query_delete(query_);
+    query_cursor_ = nullptr;
+    query_ = nullptr;
+    capture_kinds_.clear();
+    pattern_has_predicates_.clear();
+  }
+
+  // Capture names are dotted (@keyword.return, @string.escape); the head decides.
+  static HighlightKind classify_capture(std::string_view name) noexcept {
+    std::string_view head = name.substr(0, name.find('.'));
+    if (head == "comment")
+      return HighlightKind::Comment;
+    if (head == "string" || head == "character")
+      return HighlightKind::String;
+    if (head == "number" || head == "float" || head == "boolean" || name == "constant.numeric")
+      return HighlightKind::Number;
+    if (head == "keyword" || head == "conditional" || head == "repeat" || head == "exception")
+      return HighlightKind::Keyword;
+    if (head == "type" || head == "storageclass")
+      return HighlightKind::Type;
+    if (head == "function" || head == "method" || head == "constructor")
+      return HighlightKind::Function;
+    if (head == "preproc" || head == "include" || head == "define" || head == "macro")
+      return HighlightKind::Preprocessor;
+    return HighlightKind::None;
+  }
+
   static HighlightKind classify_node(std::string_view node_type) noexcept {
     struct Rule {
       std::string_view pattern;
@@ -338,47 +795,82 @@ private:
     return HighlightKind::None;
   }
 
-  void collect_styles() {
-    if (!tree_)
+  void paint(TSNode node, size_t start, size_t end, HighlightKind *out) const {
+    TSSymbol sym = api_.ts_node_symbol(node);
+    HighlightKind kind = sym < symbol_kinds_.size() ? symbol_kinds_[sym] : HighlightKind::None;
+    if (kind == HighlightKind::None)
       return;
+    size_t from = std::max<size_t>(api_.ts_node_start_byte(node), start);
+    size_t to = std::min<size_t>(api_.ts_node_end_byte(node), end);
+    for (size_t i = from; i < to; ++i) {
+      if (priority(kind) >= priority(out[i - start]))
+        out[i - start] = kind;
+    }
+  }
+
+  // A highlights query knows better than node names. Captures arrive in document
+  // order and the first one to claim a byte keeps it, which is how highlights.scm
+  // files expect to be read. Patterns with predicates (#match? and friends) are
+  // skipped: they would need a regex engine to mean what they say.
+  void paint_captures(TSNode root, size_t start, size_t end, HighlightKind *out) {
+    api_.ts_query_cursor_set_byte_range(query_cursor_, (uint32_t)start, (uint32_t)end);
+    api_.ts_query_cursor_exec(query_cursor_, query_, root);
+    TSQueryMatch match;
+    uint32_t index;
+    while (api_.ts_query_cursor_next_capture(query_cursor_, &match, &index)) {
+      if (match.pattern_index < pattern_has_predicates_.size() && pattern_has_predicates_[match.pattern_index])
+        continue;
+      const TSQueryCapture &cap = match.captures[index];
+      HighlightKind kind = cap.index < capture_kinds_.size() ? capture_kinds_[cap.index] : HighlightKind::None;
+      if (kind == HighlightKind::None)
+        continue;
+      size_t from = std::max<size_t>(api_.ts_node_start_byte(cap.node), start);
+      size_t to = std::min<size_t>(api_.ts_node_end_byte(cap.node), end);
+      for (size_t i = from; i < to; ++i) {
+        if (out[i - start] == HighlightKind::None)
+          out[i - start] = kind;
+      }
+    }
+  }
 
+  // Depth-first over the nodes overlapping [start, end). The cursor jumps straight to
+  // the first child reaching start and stops at the first sibling past end, so the
+  // rest of the file is never looked at.
+  void paint_range(size_t start, size_t end, HighlightKind *out) {
+    if (!tree_ || start >= end)
+      return;
     TSNode root = api_.ts_tree_root_node(tree_);
     if (api_.ts_node_is_null(root))
       return;
-
-    std::vector<Span> spans;
-    std::vector<TSNode> stack;
-    stack.push_back(root);
-
-    while (!stack.empty()) {
-      TSNode node = stack.back();
-      stack.pop_back();
-      if (api_.ts_node_is_null(node))
-        continue;
-
-      std::string_view node_type{api_.ts_node_type(node)};
-      HighlightKind kind = classify_node(node_type);
-      if (kind != HighlightKind::None) {
-        size_t start = api_.ts_node_start_byte(node);
-        size_t end   = api_.ts_node_end_byte(node);
-        if (start < end) {
-          spans.push_back({start, end, kind});
+    if (query_) {
+      paint_captures(root, start, end, out);
+      return;
+    }
+    paint(root, start, end, out);
+
+    TSTreeCursor cursor = api_.ts_tree_cursor_new(root);
+    uint32_t depth = 0;
+    if (api_.ts_tree_cursor_goto_first_child_for_byte(&cursor, (uint32_t)start) >= 0)
+      depth++;
+    while (depth > 0) {
+      TSNode node = api_.ts_tree_cursor_current_node(&cursor);
+      if (api_.ts_node_start_byte(node) < end) {
+        paint(node, start, end, out);
+        if (api_.ts_tree_cursor_goto_first_child_for_byte(&cursor, (uint32_t)start) >= 0) {
+          depth++;
+          continue;
         }
+      } else {
+        // This sibling and the ones after it are past the range.
+        api_.ts_tree_cursor_goto_parent(&cursor);
+        depth--;
       }
-
-      uint32_t child_count = api_.ts_node_child_count(node);
-      for (uint32_t i = 0; i < child_count; ++i) {
-        stack.push_back(api_.ts_node_child(node, child_count - 1 - i));
-      }
-    }
-
-    for (const auto &[start, end, kind] : spans) {
-      size_t capped_end = std::min(end, style_map_.size());
-      for (size_t i = start; i < capped_end; ++i) {
-        if (priority(kind) >= priority(style_map_[i]))
-          style_map_[i] = kind;
+      while (depth > 0 && !api_.ts_tree_cursor_goto_next_sibling(&cursor)) {
+        api_.ts_tree_cursor_goto_parent(&cursor);
+        depth--;
       }
     }
+    api_.ts_tree_cursor_delete(&cursor);
   }
 };
 
@@ -1,55 +1,138 @@
 #pragma once
 #include <cstddef>
-#include <optional>
+#include <deque>
 #include <string>
 #include <vector>
 
 namespace honeymoon::mem {
 
+// Operation log. Each group remembers what was inserted or erased and where,
+// so memory and undo time scale with the edit, not with the document.
 template <typename...>
 struct UndoHistory {
 protected:
-  struct Snapshot {
-    std::string content;
-    size_t cursor;
+  struct Edit {
+    size_t pos;
+    std::string text;
+    bool inserted; // true: text was inserted at pos, false: text was erased from pos
   };
 
-  std::vector<Snapshot> undo_stack;
-  std::vector<Snapshot> redo_stack;
+  struct Group {
+    std::vector<Edit> edits;
+    size_t cursor_before = 0;
+    size_t cursor_after = 0;
+    size_t bytes = 0;
+  };
+
+  std::deque<Group> undo_stack;
+  std::vector<Group> redo_stack;
   bool typing_group_active = false;
-  size_t max_undo_levels = 100;
+  size_t max_undo_bytes = 64u << 20;
+  size_t undo_bytes = 0;
 
-  void snapshot_for_undo(const std::string &content, size_t cursor) {
+  // Opens a group unless a typing run is already collecting edits.
+  void begin_undo_group(size_t cursor) {
     if (typing_group_active)
       return;
-    undo_stack.push_back({content, cursor});
-    if (undo_stack.size() > max_undo_levels)
-      undo_stack.erase(undo_stack.begin());
+    drop_redo();
+    undo_stack.emplace_back().cursor_before = cursor;
     typing_group_active = true;
   }
 
   void close_typing_group() { typing_group_active = false; }
 
-  std::optional<Snapshot> apply_undo(const std::string &cur_content,
-                                      size_t cur_cursor) {
+  void record_insert(size_t pos, const char *s, size_t n) {
+    if (n == 0)
+      return;
+    Group &g = current_group(pos);
+    if (!g.edits.empty()) {
+      Edit &last = g.edits.back();
+      if (last.inserted && last.pos + last.text.size() == pos) {
+        last.text.append(s, n);
+        account(g, n);
+        return;
+      }
+    }
+    g.edits.push_back({pos, std::string(s, n), true});
+    account(g, n + sizeof(Edit));
+  }
+
+  void record_erase(size_t pos, std::string text) {
+    if (text.empty())
+      return;
+    Group &g = current_group(pos);
+    size_t n = text.size();
+    if (!g.edits.empty()) {
+      Edit &last = g.edits.back();
+      if (!last.inserted && pos + n == last.pos) { // backspace run
+        last.text.insert(0, text);
+        last.pos = pos;
+        account(g, n);
+        return;
+      }
+      if (!last.inserted && pos == last.pos) { // delete-forward run
+        last.text += text;
+        account(g, n);
+        return;
+      }
+    }
+    g.edits.push_back({pos, std::move(text), false});
+    account(g, n + sizeof(Edit));
+  }
+
+  // Moves the newest group to the redo stack and returns it; the caller replays
+  // its edits backwards. Empty groups are skipped.
+  const Group *apply_undo(size_t cur_cursor) {
+    typing_group_active = false;
+    while (!undo_stack.empty() && undo_stack.back().edits.empty())
+      undo_stack.pop_back();
     if (undo_stack.empty())
-      return std::nullopt;
-    redo_stack.push_back({cur_content, cur_cursor});
-    Snapshot s = undo_stack.back();
+      return nullptr;
+    redo_stack.push_back(std::move(undo_stack.back()));
     undo_stack.pop_back();
-    typing_group_active = false;
-    return s;
+    redo_stack.back().cursor_after = cur_cursor;
+    return &redo_stack.back();
   }
 
-  std::optional<Snapshot> apply_redo(const std::string &cur_content,
-                                      size_t cur_cursor) {
+  const Group *apply_redo() {
+    typing_group_active = false;
     if (redo_stack.empty())
-      return std::nullopt;
-    undo_stack.push_back({cur_content, cur_cursor});
-    Snapshot s = redo_stack.back();
+      return nullptr;
+    undo_stack.push_back(std::move(redo_stack.back()));
     redo_stack.pop_back();
+    return &undo_stack.back();
+  }
+
+  void clear_undo() {
+    undo_stack.clear();
+    redo_stack.clear();
+    undo_bytes = 0;
     typing_group_active = false;
-    return s;
+  }
+
+private:
+  Group &current_group(size_t cursor) {
+    if (undo_stack.empty() || !typing_group_active) {
+      typing_group_active = false;
+      begin_undo_group(cursor);
+    }
+    return undo_stack.back();
+  }
+
+  void account(Group &g, size_t n) {
+    g.bytes += n;
+    undo_bytes += n;
+    // Oldest history goes first; the group being built is never evicted.
+    while (undo_bytes > max_undo_bytes && undo_stack.size() > 1) {
+      undo_bytes -= undo_stack.front().bytes;
+      undo_stack.pop_front();
+    }
+  }
+
+  void drop_redo() {
+    for (const Group &g : redo_stack)
+      undo_bytes -= g.bytes;
+    redo_stack.clear();
   }
 };
 
@@ -0,0 +1,334 @@
+/*
+ * Directory Walker.
+ * Every core gets a deque of directories and files. Whoever runs dry steals from the others.
+ * .gitignore is honoured, .git is never entered, and symlinks are left alone.
+ */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace honeymoon::util {
+
+    // Shell-style glob as gitignore uses it: * and ? stop at '/', ** doesn't, [a-z] and [!a] are classes.
+    inline bool glob_match(std::string_view p, std::string_view s) {
+        while (!p.empty()) {
+            if (p.starts_with("**")) {
+                p.remove_prefix(2);
+                if (p.starts_with('/'))
+                    p.remove_prefix(1);
+                for (size_t i = 0; i <= s.size(); ++i)
+                    if ((i == 0 || s[i - 1] == '/') && glob_match(p, s.substr(i)))
+                        return true;
+                return p.empty();
+            }
+            if (p[0] == '*') {
+                p.remove_prefix(1);
+                for (size_t i = 0;; ++i) {
+                    if (glob_match(p, s.substr(i)))
+                        return true;
+                    if (i == s.size() || s[i] == '/')
+                        return false;
+                }
+            }
+            if (s.empty())
+                return false;
+            char c = s[0];
+            if (p[0] == '?') {
+                if (c == '/')
+                    return false;
+                p.remove_prefix(1);
+            } else if (p[0] == '[' && p.find(']', 2) != p.npos) {
+                size_t i = 1;
+                bool negate = p[i] == '!' || p[i] == '^';
+                if (negate)
+                    i++;
+                bool hit = false;
+                for (bool first = true; i < p.size() && (first || p[i] != ']'); first = false) {
+                    char lo = p[i], hi = lo;
+                    if (i + 2 < p.size() && p[i + 1] == '-' && p[i + 2] != ']') {
+                        hi = p[i + 2];
+                        i += 2;
+                    }
+                    hit |= lo <= c && c <= hi;
+                    i++;
+                }
+                if (hit == negate || c == '/')
+                    return false;
+                p.remove_prefix(i + 1);
+            } else {
+                if (p[0] == '\\' && p.size() > 1)
+                    p.remove_prefix(1);
+                if (p[0] != c)
+                    return false;
+                p.remove_prefix(1);
+            }
+            s.remove_prefix(1);
+        }
+        return s.empty();
+    }
+
+    inline int64_t mtime_of(const struct stat& st) { return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec; }
+
+    // The rules of one .gitignore, chained to the ones above it.
+    struct IgnoreRules {
+        struct Rule {
+            std::string glob;
+            bool negate = false;
+            bool dir_only = false;
+            bool anchored = false; // had a slash, so it's matched against the path, not the name
+        };
+
+        std::shared_ptr<const IgnoreRules> parent;
+        std::string base; // the directory it sits in, relative to the root, with a trailing '/'
+        std::vector<Rule> rules;
+
+        // `parent` if there's no .gitignore in dir or it has no rules. The file's mtime goes in
+        // mtime_ns, 0 if there isn't one.
+        static std::shared_ptr<const IgnoreRules> load(const std::string& dir, std::string base,
+                                                       std::shared_ptr<const IgnoreRules> parent,
+                                                       int64_t* mtime_ns = nullptr) {
+            if (mtime_ns)
+                *mtime_ns = 0;
+            int fd = open((dir + "/.gitignore").c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return parent;
+            struct stat st;
+            if (mtime_ns && fstat(fd, &st) == 0)
+                *mtime_ns = mtime_of(st);
+            std::string text;
+            char buf[4096];
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0)
+                text.append(buf, n);
+            close(fd);
+            auto out = std::make_shared<IgnoreRules>();
+            for (size_t pos = 0; pos < text.size();) {
+                size_t nl = text.find('\n', pos);
+                if (nl == text.npos)
+                    nl = text.size();
+                std::string_view line(text.data() + pos, nl - pos);
+                pos = nl + 1;
+                while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+                    line.remove_suffix(1);
+                if (line.empty() || line[0] == '#')
+                    continue;
+                Rule r;
+                if (line[0] == '!') {
+                    r.negate = true;
+                    line.remove_prefix(1);
+                } else if (line[0] == '\\') {
+                    line.remove_prefix(1);
+                }
+                if (line.ends_with('/')) {
+                    r.dir_only = true;
+                    line.remove_suffix(1);
+                }
+                r.anchored = line.find('/') != line.npos;
+                if (line.starts_with('/'))
+                    line.remove_prefix(1);
+                if (line.empty())
+                    continue;
+                r.glob.assign(line);
+                out->rules.push_back(std::move(r));
+            }
+            if (out->rules.empty())
+                return parent;
+            out->parent = std::move(parent);
+            out->base = std::move(base);
+            return out;
+        }
+
+        // The deepest file wins, and within a file the last rule that matches.
+        bool ignored(std::string_view rel, bool is_dir) const {
+            std::string_view name = rel.substr(rel.rfind('/') + 1);
+            for (const IgnoreRules* g = this; g; g = g->parent.get()) {
+                std::string_view sub = rel.substr(g->base.size());
+                for (size_t i = g->rules.size(); i-- > 0;) {
+                    const Rule& r = g->rules[i];
+                    if (r.dir_only && !is_dir)
+                        continue;
+                    if (glob_match(r.glob, r.anchored ? sub : name))
+                        return !r.negate;
+                }
+            }
+            return false;
+        }
+    };
+
+    // One directory's worth of entries that survived .gitignore.
+    struct DirListing {
+        std::shared_ptr<const IgnoreRules> ignore; // in force below this directory
+        std::vector<std::string> dirs;             // names, not paths
+        std::vector<std::string> files;
+        int64_t mtime_ns = 0;
+        int64_t ignore_mtime_ns = 0; // of its .gitignore, 0 without one
+    };
+
+    // Where a directory's .gitignore rules are anchored: its path below the root, with a trailing '/'.
+    inline std::string rule_base(const std::string& path, size_t rel_off) {
+        std::string prefix = path == "." ? std::string() : path + "/";
+        return prefix.substr(std::min(rel_off, prefix.size()));
+    }
+
+    // Lists `path`, loading its .gitignore on top of `parent`. rel_off is how much of a path
+    // to drop to make it relative to the walk's root.
+    inline bool list_dir(const std::string& path, size_t rel_off, std::shared_ptr<const IgnoreRules> parent,
+                         DirListing& out) {
+        out.dirs.clear();
+        out.files.clear();
+        DIR* d = opendir(path.c_str());
+        if (!d)
+            return false;
+        struct stat st;
+        out.mtime_ns = fstat(dirfd(d), &st) == 0 ? mtime_of(st) : 0;
+        std::string base = rule_base(path, rel_off), rel;
+        out.ignore = IgnoreRules::load(path, base, std::move(parent), &out.ignore_mtime_ns);
+        while (dirent* e = readdir(d)) {
+            std::string_view name = e->d_name;
+            if (name == "." || name == ".." || name == ".git")
+                continue;
+            unsigned char type = e->d_type;
+            if (type == DT_UNKNOWN) {
+                if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type != DT_DIR && type != DT_REG)
+                continue;
+            if (out.ignore) {
+                rel.assign(base);
+                rel += name;
+                if (out.ignore->ignored(rel, type == DT_DIR))
+                    continue;
+            }
+            (type == DT_DIR ? out.dirs : out.files).emplace_back(name);
+        }
+        closedir(d);
+        return true;
+    }
+
+    inline std::string join_path(const std::string& dir, std::string_view name) {
+        std::string path = dir == "." ? std::string() : dir + "/";
+        path += name;
+        return path;
+    }
+
+    // Calls on_dir(worker, path, listing) for every directory under root that isn't ignored,
+    // and on_file(worker, path) for every regular file, from `threads` threads at once; worker
+    // is in [0, threads). Returns when everything's been visited or `cancel` is set. Paths are
+    // relative to the working directory, like root. With nullptr for on_file, files aren't
+    // visited at all; the listings still name them.
+    //
+    // A subtree of an earlier walk starts from its directory with the rules in force above
+    // it, and rel_off still measured from the original root.
+    template <typename OnFile, typename OnDir>
+    void walk_tree(const std::string& root, size_t rel_off, std::shared_ptr<const IgnoreRules> ignore,
+                   unsigned threads, const std::atomic<bool>& cancel, OnFile&& on_file, OnDir&& on_dir) {
+        struct Task {
+            std::string path;
+            std::shared_ptr<const IgnoreRules> ignore;
+            bool dir;
+        };
+        struct Queue {
+            std::mutex m;
+            std::deque<Task> tasks;
+        };
+
+        threads = std::max(threads, 1u);
+        std::vector<Queue> queues(threads);
+        std::atomic<size_t> pending{1}; // tasks queued or running
+        queues[0].tasks.push_back({root, std::move(ignore), true});
+
+        // Own work comes off the back, depth first; stolen work off the front, nearest the root.
+        auto take = [&](unsigned me, Task& t) {
+            for (unsigned k = 0; k < threads; ++k) {
+                Queue& q = queues[(me + k) % threads];
+                std::lock_guard lock(q.m);
+                if (q.tasks.empty())
+                    continue;
+                if (k == 0) {
+                    t = std::move(q.tasks.back());
+                    q.tasks.pop_back();
+                } else {
+                    t = std::move(q.tasks.front());
+                    q.tasks.pop_front();
+                }
+                return true;
+            }
+            return false;
+        };
+
+        auto read_dir = [&](unsigned me, const Task& t, DirListing& ls) {
+            if (!list_dir(t.path, rel_off, t.ignore, ls))
+                return;
+            on_dir(me, t.path, ls);
+            size_t n = ls.dirs.size() + (std::is_invocable_v<OnFile, unsigned, const std::string&> ? ls.files.size() : 0);
+            if (n == 0)
+                return;
+            pending.fetch_add(n, std::memory_order_relaxed);
+            std::lock_guard lock(queues[me].m);
+            if constexpr (std::is_invocable_v<OnFile, unsigned, const std::string&>)
+                for (const auto& name : ls.files)
+                    queues[me].tasks.push_back({join_path(t.path, name), nullptr, false});
+            for (const auto& name : ls.dirs)
+                queues[me].tasks.push_back({join_path(t.path, name), ls.ignore, true});
+        };
+
+        auto work = [&](unsigned me) {
+            Task t;
+            DirListing ls;
+            unsigned idle = 0;
+            while (!cancel.load(std::memory_order_relaxed)) {
+                if (take(me, t)) {
+                    idle = 0;
+                    if (t.dir)
+                        read_dir(me, t, ls);
+                    else if constexpr (std::is_invocable_v<OnFile, unsigned, const std::string&>)
+                        on_file(me, t.path);
+                    pending.fetch_sub(1, std::memory_order_acq_rel);
+                } else if (pending.load(std::memory_order_acquire) == 0) {
+                    return;
+                } else if (++idle < 64) {
+                    std::this_thread::yield();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads; ++i)
+            pool.emplace_back(work, i);
+        work(0);
+        for (auto& th : pool)
+            th.join();
+    }
+
+    inline size_t root_offset(const std::string& root) { return root == "." ? 0 : root.size() + 1; }
+
+    template <typename OnFile, typename OnDir>
+    void walk(const std::string& root, unsigned threads, const std::atomic<bool>& cancel, OnFile&& on_file,
+              OnDir&& on_dir) {
+        walk_tree(root, root_offset(root), nullptr, threads, cancel, on_file, on_dir);
+    }
+
+    // Files only.
+    template <typename OnFile>
+    void walk(const std::string& root, unsigned threads, const std::atomic<bool>& cancel, OnFile&& on_file) {
+        walk(root, threads, cancel, on_file, [](unsigned, const std::string&, const DirListing&) {});
+    }
+
+} // namespace honeymoon::util